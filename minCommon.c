@@ -14,17 +14,111 @@
 "Bad magic number. (0x%.4x)\nThis doesn't look like a MINIX filesystem.\n"
 
 #define USAGE_MSG \
-"usage: %s  [ -v ] [ -p num [ -s num ] ] imagefile [ path ]\n\
+"usage: %s  [ -v ] [ -E ] [ -R | -r dest [ -b bytes ] ] [ -j num ] \
+[ -0 ] [ -S socket ] [ --offset bytes ] [ --length bytes ] \
+[ --stats[=text|json] ] [ --index[=file] ] \
+[ --format=text|json|ndjson|nul ] [ --readahead bytes ] [ --checksum ] \
+[ -p num [ -s num ] | -p all ] \
+imagefile [ path ]\n\
 Options:\n\
-\t-p\t part    --- select partition for filesystem (default: none)\n\
+\t-p\t part    --- select partition for filesystem (default: none), or\n\
+\t\t\t    all for every filesystem in the image, in parallel\n\
 \t-s\t sub     --- select subpartition for filesystem (default: none)\n\
 \t-h\t help    --- print usage information and exit\n\
-\t-v\t verbose --- increase verbosity level\n"
+\t-v\t verbose --- increase verbosity level\n\
+\t-E\t eager   --- read the whole inode table up front\n\
+\t-R\t recurse --- list subdirectories recursively (minls)\n\
+\t-j\t jobs    --- worker threads for -R (default: one per CPU)\n\
+\t-0\t nul     --- requests end in NUL, not newline (minserve)\n\
+\t-S\t socket  --- serve requests on a Unix socket (minserve)\n\
+\t-r\t dest    --- extract the whole tree under path into dest (minget)\n\
+\t-b\t bytes   --- most data -r may have in flight (default: 64M)\n\
+\t--offset bytes  --- start reading here, or this far from the end if\n\
+\t\t\t    negative (minget)\n\
+\t--length bytes  --- read at most this much (minget)\n\
+\t--stats[=format] --- report I/O counters and phase times on stderr,\n\
+\t\t\t    as text (the default, also given by -v) or json\n\
+\t--index[=file]  --- look things up in a sidecar index, built or rebuilt\n\
+\t\t\t    as needed (default: imagefile.idx)\n\
+\t--format=format --- list as text (the default), a json array, ndjson\n\
+\t\t\t    (an object per line) or nul (NUL-terminated paths) (minls)\n\
+\t--readahead bytes --- ask for this much of a file ahead of copying it,\n\
+\t\t\t    0 for none (default: 8M)\n\
+\t--checksum\t --- print the CRC32C of the file, or of every file\n\
+\t\t\t    under a directory, instead of its contents (minget)\n"
 
-static uint32_t partitionOffset = 0;
-static uint32_t partitionSize = -1;
-char fullPathName[PATH_MAX] = "";
-static int verbose;
+#define IMAGE_BOUNDS \
+"Attempting to read outside of partition (offset %llu)\n"
+
+/* the last error on each thread, for minfsError */
+static __thread char lastError[PATH_MAX + 128];
+
+/* time this thread has spent in timed phases, for phaseStart */
+static __thread uint64_t phasedNanos = 0;
+
+/* a block of metadata (an inode-table block or an indirect zone table)
+ * in a filesystem's metadata cache. A pinned block stays put until its
+ * last user lets go.
+ */
+struct metaBlock {
+   uint64_t offset;        /* where the block starts in the image */
+   uint32_t len;           /* 0 while the slot is empty */
+   int pins;               /* callers still using data */
+   int referenced;         /* used since the clock hand last passed */
+   int ready;              /* data has been read in */
+   int slot;               /* index in metaCache, -1 if not cached */
+   int next;               /* slot + 1 of the next block in its chain */
+   unsigned char *data;
+};
+
+/* a directory indexed for lookups, hashed by inode number */
+struct dirIndex {
+   uint32_t inodeNum;            /* the directory's inode */
+   struct fileEntry *entries;    /* its entries, read once */
+   int numEntries;
+   int numBuckets;               /* a power of two */
+   int *buckets;                 /* entry index + 1 heading each chain */
+   int *next;                    /* entry index + 1 of the next in chain */
+   uint64_t bytes;               /* memory held by this index */
+   struct dirIndex *nextInBucket;
+   struct dirIndex *newer;
+   struct dirIndex *older;
+};
+
+/* Parses a byte count with an optional K, M or G suffix into *size,
+ * returning 0, or -1 if it isn't one
+ */
+static int parseSize(const char *arg, uint64_t *size) {
+   char *end;
+   *size = strtoull(arg, &end, 10);
+   switch (*end) {
+      case 'G': case 'g':
+         *size <<= 10;
+      /* fall through */
+      case 'M': case 'm':
+         *size <<= 10;
+      /* fall through */
+      case 'K': case 'k':
+         *size <<= 10;
+         end++;
+      break;
+   }
+   return *end || end == arg || *arg == '-' ? -1 : 0;
+}
+
+/* long options, for the ones without a letter */
+enum { OPT_OFFSET = 256, OPT_LENGTH, OPT_STATS, OPT_INDEX, OPT_FORMAT,
+       OPT_READAHEAD, OPT_CHECKSUM };
+static const struct option longOptions[] = {
+   { "offset", required_argument, NULL, OPT_OFFSET },
+   { "length", required_argument, NULL, OPT_LENGTH },
+   { "stats", optional_argument, NULL, OPT_STATS },
+   { "index", optional_argument, NULL, OPT_INDEX },
+   { "format", required_argument, NULL, OPT_FORMAT },
+   { "readahead", required_argument, NULL, OPT_READAHEAD },
+   { "checksum", no_argument, NULL, OPT_CHECKSUM },
+   { NULL, 0, NULL, 0 }
+};
 
 /* Parse the arguments for the minls and minget programs */
 void parseArgs(int argc, char *const argv[], struct minOptions *options) {
@@ -32,16 +126,144 @@ void parseArgs(int argc, char *const argv[], struct minOptions *options) {
    opterr = 0;
 
    /* traverse through the given command-line args */
-   while ((opt = getopt(argc, argv, "vp:s:")) != -1) {
+   while ((opt = getopt_long(argc, argv, "vERj:0S:r:b:p:s:", 
+                             longOptions, NULL)) != -1) {
       switch (opt) {
          /* verbose */
          case 'v':
             options->verbose++;
          break;
 
+         /* eager inode table */
+         case 'E':
+            options->eager = 1;
+         break;
+
+         /* recursive */
+         case 'R':
+            options->recursive = 1;
+         break;
+
+         /* worker threads */
+         case 'j':
+            options->threads = atoi(optarg);
+            if (options->threads < 1) {
+               fprintf(stderr, "Thread count %d must be at least 1.\n",
+                       options->threads);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+
+         /* NUL-delimited requests */
+         case '0':
+            options->nulDelim = 1;
+         break;
+
+         /* Unix socket to serve on */
+         case 'S':
+            options->socketPath = optarg;
+         break;
+
+         /* extract a tree into a host directory */
+         case 'r':
+            options->destDir = optarg;
+         break;
+
+         /* in-flight byte budget, with an optional K, M or G */
+         case 'b':
+            if (parseSize(optarg, &options->budget) || !options->budget) {
+               fprintf(stderr, "Bad byte count %s.\n", optarg);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+
+         /* where a byte-range read starts, from the end if negative */
+         case OPT_OFFSET: {
+            uint64_t offset;
+            if (parseSize(optarg + (*optarg == '-'), &offset) || 
+                offset > INT64_MAX) {
+               fprintf(stderr, "Bad offset %s.\n", optarg);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+            options->rangeOffset = *optarg == '-' ? -(int64_t)offset 
+                                                  : (int64_t)offset;
+         }
+         break;
+
+         /* how many bytes a byte-range read covers */
+         case OPT_LENGTH:
+            if (parseSize(optarg, &options->rangeLength)) {
+               fprintf(stderr, "Bad length %s.\n", optarg);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+
+         /* the end-of-run report, as text or JSON */
+         case OPT_STATS:
+            if (!optarg || !strcmp(optarg, "text")) {
+               options->stats = STATS_TEXT;
+            }
+            else if (!strcmp(optarg, "json")) {
+               options->stats = STATS_JSON;
+            }
+            else {
+               fprintf(stderr, "Bad stats format %s.\n", optarg);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+
+         /* a sidecar index, named after the image unless given */
+         case OPT_INDEX:
+            options->indexFile = optarg ? optarg : "";
+         break;
+
+         /* how minls lays out its listing */
+         case OPT_FORMAT:
+            if (!strcmp(optarg, "text")) {
+               options->format = FORMAT_TEXT;
+            }
+            else if (!strcmp(optarg, "json")) {
+               options->format = FORMAT_JSON;
+            }
+            else if (!strcmp(optarg, "ndjson")) {
+               options->format = FORMAT_NDJSON;
+            }
+            else if (!strcmp(optarg, "nul")) {
+               options->format = FORMAT_NUL;
+            }
+            else {
+               fprintf(stderr, "Bad listing format %s.\n", optarg);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+
+         /* how far ahead of copying to ask for a file's data */
+         case OPT_READAHEAD:
+            if (parseSize(optarg, &options->readahead)) {
+               fprintf(stderr, "Bad readahead %s.\n", optarg);
+               fprintf(stderr, USAGE_MSG, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+
+         /* checksums instead of contents */
+         case OPT_CHECKSUM:
+            options->checksum = 1;
+         break;
+
          /* partition number */
          case 'p':
-            options->partition = atoi(optarg);
+            options->partition = strcmp(optarg, "all") ? atoi(optarg)
+                                                       : ALL_PARTITIONS;
+            if (options->partition == ALL_PARTITIONS) {
+               break;
+            }
             if (options->partition < 0 || options->partition > 3) {
                fprintf(stderr, PARTITION_MSG, options->partition);
                fprintf(stderr, USAGE_MSG, argv[0]);
@@ -65,6 +287,10 @@ void parseArgs(int argc, char *const argv[], struct minOptions *options) {
             exit(EXIT_FAILURE);
       }
    }
+   /* -v alone asks for the text report */
+   if (options->verbose && options->stats == STATS_NONE) {
+      options->stats = STATS_TEXT;
+   }
    /* required image file */
    if (optind < argc) {
       strcpy(options->imagefile, argv[optind]);
@@ -73,6 +299,11 @@ void parseArgs(int argc, char *const argv[], struct minOptions *options) {
       fprintf(stderr, USAGE_MSG, argv[0]);
    }
    optind++;
+   /* with -p all, each filesystem names its own index once it's found */
+   if (options->indexFile && !*options->indexFile &&
+       options->partition != ALL_PARTITIONS) {
+      nameIndex(options);
+   }
    /* optional source path */
    if (optind < argc) {
       strcpy(options->path, argv[optind]);
@@ -80,6 +311,7 @@ void parseArgs(int argc, char *const argv[], struct minOptions *options) {
    }
    else {
       strcpy(options->path, "/");
+      strcpy(options->fullPath, options->path);
    }
    /* relative paths become absolute from / */
    if (options->path[0] != '/') {
@@ -87,294 +319,2157 @@ void parseArgs(int argc, char *const argv[], struct minOptions *options) {
       strcat(pathBase, options->path);
       strcpy(options->path, pathBase);
    }
-   strcpy(fullPathName, options->path);
-
-   verbose = options->verbose;
 }
 
-/* Gets configuration data for a Minix image file */
-void getMinixConfig(struct minOptions options, struct minixConfig *config) {
-   /* open the image file */
-   FILE *fp = fopen(options.imagefile, "rb");
-   if (!fp) {
-      fprintf(stderr, "Failed to open file %s (errno: %d)\n", 
-                      options.imagefile, 
-                      errno);
+/* Names the default sidecar index after the image and the partition it
+ * is for: each one gets its own, .p0.idx, .p0.s1.idx and so on
+ */
+void nameIndex(struct minOptions *options) {
+   char part[32] = "";
+   if (!strcmp(options->imagefile, "-")) {
+      fprintf(stderr, "--index needs an image file, not -\n");
       exit(EXIT_FAILURE);
    }
-   config->image = fp;
+   if (options->partition >= 0 && options->subpartition >= 0) {
+      snprintf(part, sizeof(part), ".p%d.s%d", options->partition,
+               options->subpartition);
+   }
+   else if (options->partition >= 0) {
+      snprintf(part, sizeof(part), ".p%d", options->partition);
+   }
+   if (asprintf(&options->indexFile, "%s%s%s", options->imagefile, part,
+                INDEX_SUFFIX) < 0) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Records what went wrong on this thread, for minfsError */
+void setError(const char *format, ...) {
+   va_list args;
+   va_start(args, format);
+   vsnprintf(lastError, sizeof(lastError), format, args);
+   va_end(args);
+}
+
+/* Says what made the last failing call on this thread fail */
+const char *minfsError(void) {
+   return lastError;
+}
+
+/* Copies a stream that can't be mapped (a pipe, a terminal) into an
+ * unlinked temporary file so it can be mapped like any other image.
+ * Returns the spool file's descriptor, or -1.
+ */
+static int spoolImage(int fd) {
+   FILE *spool = tmpfile();
+   char buf[65536];
+   ssize_t got;
 
-   /* set global partition offsets if necessary */
-   if (options.partition >= 0) {
-      setPartitionOffset(config->image, options.partition);
-      if (options.subpartition >= 0) {
-         setSubpartitionOffset(config->image, options.subpartition);
+   if (!spool) {
+      setError("Failed to create spool file (errno: %d)\n", errno);
+      return -1;
+   }
+   while ((got = read(fd, buf, sizeof(buf))) > 0) {
+      if (fwrite(buf, 1, got, spool) != got) {
+         setError("error spooling image (%d)\n", errno);
+         fclose(spool);
+         return -1;
       }
    }
+   if (got < 0 || fflush(spool)) {
+      setError("error spooling image (%d)\n", errno);
+      fclose(spool);
+      return -1;
+   }
+   return fileno(spool);
+}
 
-   /* Read the superblock */
-   fseekPartition(config->image, 1024, SEEK_SET);
-   fread(&(config->sb), sizeof(struct superblock), 1, config->image);
-   if (ferror(config->image)) {
-      fprintf(stderr, "error reading file (%d)\n", ferror(config->image));
-      exit(EXIT_FAILURE);
+/* Opens an image file ("-" for stdin) and maps the whole thing read-only.
+ * Inputs that can't be mapped are spooled to a temporary file first.
+ * A gzip-compressed image isn't mapped, but read through its access
+ * points instead. Returns 0, or -1.
+ */
+static int openImage(struct minfs *fs, const char *imagefile) {
+   struct stat st;
+   off_t size;
+   int fd = strcmp(imagefile, "-") ? open(imagefile, O_RDONLY) : STDIN_FILENO;
+   if (fd < 0) {
+      setError("Failed to open file %s (errno: %d)\n", imagefile, errno);
+      return -1;
    }
 
-   if (verbose) {
-      // printSuperblock(config->sb);
+   if (fstat(fd, &st) < 0) {
+      setError("Failed to stat file %s (errno: %d)\n", imagefile, errno);
+      close(fd);
+      return -1;
+   }
+   if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+      int spool = spoolImage(fd);
+      close(fd);
+      if (spool < 0) {
+         return -1;
+      }
+      fd = spool;
    }
 
-   /* check Minix magin number */
-   if (config->sb.magic != MIN_MAGIC) {
-      fprintf(stderr, BAD_MAGIC,
-         config->sb.magic);
-      exit(EXIT_FAILURE);
+   /* block devices report no st_size, so ask the descriptor */
+   size = lseek(fd, 0, SEEK_END);
+   if (size <= 0) {
+      setError("Image %s is empty\n", imagefile);
+      close(fd);
+      return -1;
    }
+   st.st_size = size;
+   fs->fd = fd;
+   fs->imageMtime = st.st_mtim;
 
-   /* set zone size to log_zone_size << 2, if it's not 0 */
-   config->zone_size = config->sb.log_zone_size ? 
-   (config->sb.blocksize << config->sb.log_zone_size) : config->sb.blocksize;
-}
+   switch (openCompressed(fs, fd, imagefile, &st)) {
+      case 1:
+         fs->imageSize = inflatedSize(fs);
+         fs->partitionOffset = 0;
+         fs->partitionSize = fs->imageSize;
+         return 0;
+      case -1:
+         return -1;
+   }
+
+   fs->base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (fs->base == MAP_FAILED) {
+      setError("Failed to map file %s (errno: %d)\n", imagefile, errno);
+      fs->base = NULL;
+      return -1;
+   }
+   fs->imageSize = size;
 
-/* Wrapper for setOffset on top-level partitions */
-void setPartitionOffset(FILE *image, int partitionNum) {
-   setOffset(image, partitionNum, IS_PART);
+   /* until a partition is chosen, the window is the whole image */
+   fs->partitionOffset = 0;
+   fs->partitionSize = fs->imageSize;
+   return 0;
 }
 
-/* Wrapper for setOffset on subpartitions */
-void setSubpartitionOffset(FILE *image, int partitionNum) {
-   setOffset(image, partitionNum, IS_SUB_PART);
+/* Reads len bytes of metadata at offset within the partition, counting
+ * the blocks they cover. Returns 0, or -1.
+ */
+static int readMeta(struct minfs *fs, void *buf, uint64_t offset,
+                    uint64_t len) {
+   uint32_t blockSize = fs->blockSize ? fs->blockSize : 1024;
+   COUNT(fs, metaBlocks, (len + blockSize - 1) / blockSize);
+   return readImage(fs, buf, offset, len);
 }
 
-/* Sets a global offset when seeking in partitioned images */
-void setOffset(FILE *image, int partitionNum, int isSub) {
+/* Narrows the window to one entry of the partition table at the start of
+ * the current window: a partition, or with isSub a subpartition.
+ * Returns 0, or -1.
+ */
+static int setOffset(struct minfs *fs, int partitionNum, int isSub) {
    /* Read the partition table */
-   fseekPartition(image, 0x1BE, SEEK_SET);
-
    struct part_entry partition_table[4];
-   fread(partition_table, sizeof(struct part_entry), 4, image);
-   if (ferror(image)) {
-      fprintf(stderr, "error reading file (%d)\n", ferror(image));
-      exit(EXIT_FAILURE);
-   }
-
-   if (verbose) {
-      // for (i = 0; i < 4; i++) {
-         // printf("i: %d\n", i);
-         // printPartition(partition_table[i]);
-      // }
+   if (readMeta(fs, partition_table, PART_TABLE_OFF,
+                sizeof(partition_table))) {
+      return -1;
    }
 
    /* make sure partition table is valid */
-   uint16_t *ptValid = malloc(sizeof(uint16_t));
-   fread(ptValid, sizeof(uint16_t), 1, image);
-   if (ferror(image)) {
-      fprintf(stderr, "error reading file (%d)\n", ferror(image));
-      exit(EXIT_FAILURE);
+   uint8_t ptValid[2];
+   if (readImage(fs, ptValid, PART_TABLE_OFF + sizeof(partition_table), 2)) {
+      return -1;
    }
-   if (*ptValid != 0xAA55) {
-      fprintf(stderr, "not a valid partition table (%X)\n", *ptValid);
-      exit(EXIT_FAILURE);
+   if (ptValid[0] != PMAGIC510 || ptValid[1] != PMAGIC511) {
+      setError("not a valid partition table (%X)\n",
+               ptValid[0] | ptValid[1] << 8);
+      return -1;
    }
 
    /* make sure subpartition is Minix */
    struct part_entry *partition = partition_table + partitionNum;
    if (partition->sysind != 0x81) {
-      fprintf(stderr, isSub == IS_SUB_PART ? SUB_INVALID : PART_INVALID);
-      exit(EXIT_FAILURE);
+      setError(isSub == IS_SUB_PART ? SUB_INVALID : PART_INVALID);
+      return -1;
+   }
+
+   /* move the window (sectors count from the start of the image),
+      keeping it inside the image */
+   fs->partitionOffset = (uint64_t)partition->lowsec * 512;
+   fs->partitionSize = (uint64_t)partition->size * 512;
+   if (fs->partitionOffset >= fs->imageSize) {
+      setError("Partition starts past the end of the image\n");
+      return -1;
+   }
+   if (fs->partitionSize > fs->imageSize - fs->partitionOffset) {
+      fs->partitionSize = fs->imageSize - fs->partitionOffset;
+   }
+   return 0;
+}
+
+/* Sets up the metadata cache with slots of the given size, as many as
+ * fit in META_CACHE_BYTES (but never fewer than META_CACHE_MIN).
+ * Returns 0, or -1.
+ */
+static int initMetaCache(struct minfs *fs, uint32_t blockSize) {
+   int slot;
+
+   fs->metaCacheSlots = META_CACHE_BYTES / blockSize;
+   if (fs->metaCacheSlots < META_CACHE_MIN) {
+      fs->metaCacheSlots = META_CACHE_MIN;
+   }
+   for (fs->metaCacheBuckets = 1; fs->metaCacheBuckets < fs->metaCacheSlots;
+        fs->metaCacheBuckets <<= 1) {
+   }
+   fs->metaClock = 0;
+   fs->metaCache = calloc(fs->metaCacheSlots, sizeof(struct metaBlock));
+   fs->metaBuckets = calloc(fs->metaCacheBuckets, sizeof(int));
+   if (!fs->metaCache || !fs->metaBuckets) {
+      setError("Malloc is failing\n");
+      return -1;
    }
+   for (slot = 0; slot < fs->metaCacheSlots; slot++) {
+      fs->metaCache[slot].slot = slot;
+      fs->metaCache[slot].data = malloc(blockSize);
+      if (!fs->metaCache[slot].data) {
+         setError("Malloc is failing\n");
+         return -1;
+      }
+   }
+   return 0;
+}
 
-   /* set offset globals */
-   partitionOffset = partition->lowsec * 512;
-   partitionSize = partition->size;
+/* Sets up an empty filesystem, with nothing open yet */
+static void initFs(struct minfs *fs) {
+   memset(fs, 0, sizeof(struct minfs));
+   fs->fd = -1;
+   fs->readahead = DEFAULT_READAHEAD;
+   pthread_mutex_init(&fs->metaCacheLock, NULL);
+   pthread_cond_init(&fs->metaCacheReady, NULL);
+   pthread_mutex_init(&fs->dirCacheLock, NULL);
 }
 
-/* 
- * Takes the root inode and an absolute path, and returns the inode 
- * of the requested file or directory.
+/* Reads and checks the superblock at the start of the window, and sets
+ * up the caches. When eager, the whole inode table is read up front in
+ * one go, which suits full-image scans. Returns 0, or -1 with nothing
+ * left open.
  */
-struct inode traversePath(struct inode *inodeTable, 
-   uint32_t ninodes, char *path) {
+static int openSuper(struct minfs *fs, int eager) {
+   uint64_t start = phaseStart();
+   if (readMeta(fs, &fs->sb, 1024, sizeof(struct superblock))) {
+      minfsClose(fs);
+      return -1;
+   }
 
-   struct inode currnode = inodeTable[0];
+   /* check Minix magin number */
+   if (fs->sb.magic != MIN_MAGIC) {
+      setError(BAD_MAGIC, fs->sb.magic);
+      minfsClose(fs);
+      return -1;
+   }
 
-   /* traverse through file path */
-   char *file = strtok(path, "/");
-   while (file) {
-      int numFiles = currnode.size / sizeof(struct fileEntry);
-      struct fileEntry *fileEntries;
-      fileEntries = getFileEntries(currnode);
+   /* set zone size to log_zone_size << 2, if it's not 0 */
+   fs->zoneSize = fs->sb.log_zone_size ?
+      (fs->sb.blocksize << fs->sb.log_zone_size) : fs->sb.blocksize;
 
-      /* traverse through directory, looking for the file name */
-      struct fileEntry *currEntry = fileEntries;
-      while (strcmp(currEntry->name, file) && 
-             currEntry < fileEntries + numFiles) {
-         currEntry++;
-      }
+   /* where the inode table lives */
+   fs->numInodes = fs->sb.ninodes;
+   fs->inodeTableOffset = (uint64_t)(2 + fs->sb.i_blocks + fs->sb.z_blocks)
+                          * fs->sb.blocksize;
+   fs->blockSize = fs->sb.blocksize;
+   fs->inodesPerBlock = fs->sb.blocksize / sizeof(struct inode);
+   if (!fs->inodesPerBlock || fs->zoneSize < fs->blockSize) {
+      setError("Bad block size (%u)\n", fs->sb.blocksize);
+      minfsClose(fs);
+      return -1;
+   }
+   phaseEnd(fs, PHASE_SUPERBLOCK, start);
+
+   /* setting up the cache counts as opening */
+   start = phaseStart();
+   if (initMetaCache(fs, fs->zoneSize)) {
+      minfsClose(fs);
+      return -1;
+   }
+   phaseEnd(fs, PHASE_OPEN, start);
 
-      /* didn't find the file */
-      if (currEntry >= fileEntries + numFiles) {
-         fprintf(stderr, "%s: File not found.\n", fullPathName);
-         exit(EXIT_FAILURE);
+   if (eager) {
+      uint64_t tableSize = (uint64_t)fs->numInodes * sizeof(struct inode);
+      fs->iTable = malloc(tableSize ? tableSize : 1);
+      if (!fs->iTable) {
+         setError("Malloc is failing\n");
+         minfsClose(fs);
+         return -1;
+      }
+      start = phaseStart();
+      if (readMeta(fs, fs->iTable, fs->inodeTableOffset, tableSize)) {
+         minfsClose(fs);
+         return -1;
       }
+      phaseEnd(fs, PHASE_INODES, start);
+   }
+   return 0;
+}
+
+/* Opens the Minix filesystem in an image file ("-" for stdin), within
+ * the given partition and subpartition if they aren't INVALID_OPTION.
+ * When eager, the whole inode table is read up front in one go, which
+ * suits full-image scans. Otherwise inode-table blocks are read on first
+ * use through the metadata cache, so lookups cost a handful of block
+ * reads. Returns 0, or -1 with nothing left open.
+ */
+int minfsOpen(struct minfs *fs, const char *imagefile, int partition,
+              int subpartition, int eager) {
+   uint64_t start;
+
+   initFs(fs);
+   start = phaseStart();
+   if (openImage(fs, imagefile)) {
+      minfsClose(fs);
+      return -1;
+   }
+   phaseEnd(fs, PHASE_OPEN, start);
 
-      /* found it, get its inode */
-      currnode = *(struct inode *)getInode(currEntry->inode);
-      file = strtok(NULL, "/");
+   start = phaseStart();
+   if ((partition >= 0 && setOffset(fs, partition, IS_PART)) ||
+       (partition >= 0 && subpartition >= 0 &&
+        setOffset(fs, subpartition, IS_SUB_PART))) {
+      minfsClose(fs);
+      return -1;
    }
+   phaseEnd(fs, PHASE_PARTITION, start);
 
-   return currnode;
+   return openSuper(fs, eager);
 }
 
-/* Assumes that the given inode is a directory, returning all its entries */
-struct fileEntry *getFileEntries(struct inode directory) {
-   struct fileEntry *entries = (struct fileEntry *) copyZones(directory);
-   return entries;
+/* Opens a filesystem findPartitions found, going straight to its window
+ * rather than reading the partition tables again. Returns 0, or -1 with
+ * nothing left open.
+ */
+int minfsOpenPart(struct minfs *fs, const char *imagefile,
+                  struct minPart *part, int eager) {
+   uint64_t start;
+
+   initFs(fs);
+   start = phaseStart();
+   if (openImage(fs, imagefile)) {
+      minfsClose(fs);
+      return -1;
+   }
+   phaseEnd(fs, PHASE_OPEN, start);
+
+   if (part->offset >= fs->imageSize ||
+       part->size > fs->imageSize - part->offset) {
+      setError("Partition lies past the end of the image\n");
+      minfsClose(fs);
+      return -1;
+   }
+   fs->partitionOffset = part->offset;
+   fs->partitionSize = part->size;
+   return openSuper(fs, eager);
 }
 
-/* Returns the inode at the given index in the inode Table */
-void *getInode(int inodeNum) {
-   if (inodeNum == 0) {          /* invalid inode */
-      return NULL;
+/* Reads the partition table in the boot sector at offset in the image
+ * into table. Returns 1 if it has the partition table signature, or 0
+ * if there isn't one there (or it can't be read).
+ */
+static int readPartTable(struct minfs *fs, uint64_t offset,
+                         struct part_entry *table) {
+   uint8_t sector[512];
+
+   if (offset >= fs->imageSize || fs->imageSize - offset < sizeof(sector)) {
+      return 0;
    }
-   if (inodeNum > numInodes) {   /* invalid inode */
-      return NULL;
+   fs->partitionOffset = offset;
+   fs->partitionSize = fs->imageSize - offset;
+   if (readMeta(fs, sector, 0, sizeof(sector))) {
+      return 0;
    }
+   memcpy(table, sector + PART_TABLE_OFF,
+          NR_PARTITIONS * sizeof(struct part_entry));
+   return sector[510] == PMAGIC510 && sector[511] == PMAGIC511;
+}
+
+/* Says whether the window at offset holds a Minix superblock, and if
+ * not, why not in problem. Returns 1 if it does, or 0.
+ */
+static int checkSuper(struct minfs *fs, uint64_t offset, uint64_t size,
+                      char *problem, size_t len) {
+   struct superblock sb;
 
-   return &iTable[inodeNum - 1];
+   fs->partitionOffset = offset;
+   fs->partitionSize = size;
+   if (readMeta(fs, &sb, 1024, sizeof(sb))) {
+      snprintf(problem, len, "too small to hold a filesystem");
+      return 0;
+   }
+   if (sb.magic != MIN_MAGIC) {
+      snprintf(problem, len, "bad magic number (0x%.4x)",
+               (uint16_t)sb.magic);
+      return 0;
+   }
+   if (sb.blocksize < sizeof(struct inode) || 
+       (sb.blocksize << sb.log_zone_size) < sb.blocksize) {
+      snprintf(problem, len, "bad block size (%u)", sb.blocksize);
+      return 0;
+   }
+   return 1;
 }
 
-/* Copies all valid direct, indirect, and double-indirect zones in the given
- * inode, zongregating them into a single block of returned memory
- */ 
-void *copyZones(struct inode file) {
-   char *data, *nextData;
-   /* round size of the returned data up to the nearest zone_size */
-   uint32_t dataSize = (((file.size - 1) / zone_size) + 1) * zone_size;
-   data = nextData = malloc(dataSize);
+/* Adds an entry to the list findPartitions is building, checking its
+ * superblock unless it already has a problem. Returns 0, or -1.
+ */
+static int addPart(struct minfs *fs, struct minPart **parts, int *count,
+                   int partition, int subpartition, struct part_entry *entry,
+                   const char *problem) {
+   struct minPart *part = realloc(*parts, (*count + 1) *
+                                  sizeof(struct minPart));
+   if (!part) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   *parts = part;
+   part += (*count)++;
+   part->partition = partition;
+   part->subpartition = subpartition;
+   part->offset = entry ? (uint64_t)entry->lowsec * 512 : 0;
+   part->size = entry ? (uint64_t)entry->size * 512 : fs->imageSize;
+   part->problem[0] = '\0';
+
+   /* sectors count from the start of the image */
+   if (problem) {
+      snprintf(part->problem, sizeof(part->problem), "%s", problem);
+   }
+   else if (part->offset >= fs->imageSize) {
+      snprintf(part->problem, sizeof(part->problem),
+               "starts past the end of the image");
+   }
+   else {
+      if (part->size > fs->imageSize - part->offset) {
+         part->size = fs->imageSize - part->offset;
+      }
+      checkSuper(fs, part->offset, part->size, part->problem,
+                 sizeof(part->problem));
+   }
+   return 0;
+}
 
-   int zoneIdx = 0;
+/* Walks the image's partition table and the subpartition table in each
+ * Minix partition, once, and lists every filesystem they lead to (or
+ * the whole image, if it isn't partitioned), each checked for a Minix
+ * superblock. Entries that can't be used are listed too, with what is
+ * wrong with them, so they can be reported. Returns how many entries
+ * there are, or -1 if the image can't be read.
+ */
+int findPartitions(const char *imagefile, struct minPart **parts) {
+   struct part_entry table[NR_PARTITIONS], subTable[NR_PARTITIONS];
+   char problem[128];
+   struct minfs fs;
+   int count = 0, p, s;
 
-   /* Direct Zones */
-   /* loop through all direct zones while there's more data */
-   while (nextData < data + file.size &&
-          zoneIdx < DIRECT_ZONES) {
-
-      uint32_t zoneNum = file.zone[zoneIdx];
-
-      if (zoneNum) {
-         /* copy the zone */
-         fseekPartition(image, zoneNum * zone_size, SEEK_SET);
-         fread(nextData, zone_size, 1, image);
-         if (ferror(image)) {
-            fprintf(stderr, "error reading file (%d)\n", ferror(image));
-            exit(EXIT_FAILURE);
+   *parts = NULL;
+   initFs(&fs);
+   if (openImage(&fs, imagefile)) {
+      minfsClose(&fs);
+      return -1;
+   }
+
+   /* an image without a partition table is one filesystem */
+   if (!readPartTable(&fs, 0, table)) {
+      if (addPart(&fs, parts, &count, INVALID_OPTION, INVALID_OPTION,
+                  NULL, NULL)) {
+         minfsClose(&fs);
+         return -1;
+      }
+      minfsClose(&fs);
+      return count;
+   }
+
+   for (p = 0; p < NR_PARTITIONS; p++) {
+      struct part_entry *entry = table + p;
+      int subs = 0;
+
+      if (entry->sysind == NO_PART && !entry->size) {
+         continue;
+      }
+      if (entry->sysind != MINIX_PART) {
+         /* say so if it holds a filesystem anyway */
+         int holds = checkSuper(&fs, (uint64_t)entry->lowsec * 512,
+                                (uint64_t)entry->size * 512, problem,
+                                sizeof(problem));
+         snprintf(problem, sizeof(problem),
+                  "not a Minix partition (type 0x%.2x)%s", entry->sysind,
+                  holds ? ", though it holds a Minix filesystem" : "");
+         if (addPart(&fs, parts, &count, p, INVALID_OPTION, entry,
+                     problem)) {
+            minfsClose(&fs);
+            return -1;
          }
+         continue;
       }
-      else {         
-         /* fill with zeros */
-         memset(nextData, 0, zone_size);
+
+      /* a Minix partition may be split into subpartitions */
+      memset(subTable, 0, sizeof(subTable));
+      if (readPartTable(&fs, (uint64_t)entry->lowsec * 512, subTable)) {
+         for (s = 0; s < NR_PARTITIONS; s++) {
+            struct part_entry *sub = subTable + s;
+            if (sub->sysind == NO_PART && !sub->size) {
+               continue;
+            }
+            snprintf(problem, sizeof(problem),
+                     "not a Minix subpartition (type 0x%.2x)", sub->sysind);
+            if (addPart(&fs, parts, &count, p, s, sub,
+                        sub->sysind == MINIX_PART ? NULL : problem)) {
+               minfsClose(&fs);
+               return -1;
+            }
+            subs++;
+         }
+      }
+      if (subs) {
+         continue;
+      }
+      if (addPart(&fs, parts, &count, p, INVALID_OPTION, entry, NULL)) {
+         minfsClose(&fs);
+         return -1;
+      }
+
+      /* a subpartition table that only lacks its signature is likely
+         where the filesystem went */
+      struct minPart *last = *parts + count - 1;
+      for (s = 0; last->problem[0] && s < NR_PARTITIONS; s++) {
+         if (subTable[s].sysind == MINIX_PART) {
+            size_t len = strlen(last->problem);
+            snprintf(last->problem + len, sizeof(last->problem) - len,
+                     "; it has a subpartition table with no signature");
+            break;
+         }
       }
-      nextData += zone_size;
-      zoneIdx++;
    }
+   minfsClose(&fs);
+   return count;
+}
+
+/* Closes a filesystem opened with minfsOpen, freeing its caches */
+void minfsClose(struct minfs *fs) {
+   int slot;
 
-   if (nextData >= data + file.size) {
-      return data;
+   freeDirCache(fs);
+   closeIndex(fs);
+   for (slot = 0; fs->metaCache && slot < fs->metaCacheSlots; slot++) {
+      free(fs->metaCache[slot].data);
    }
+   free(fs->metaCache);
+   free(fs->metaBuckets);
+   free(fs->iTable);
+   free(fs->bitmaps[INODE_MAP]);
+   free(fs->bitmaps[ZONE_MAP]);
+   closeCompressed(fs);
+   fs->metaCache = NULL;
+   fs->metaBuckets = NULL;
+   fs->iTable = NULL;
+   if (fs->base) {
+      munmap(fs->base, fs->imageSize);
+      fs->base = NULL;
+   }
+   if (fs->fd >= 0) {
+      close(fs->fd);
+      fs->fd = -1;
+   }
+   pthread_mutex_destroy(&fs->metaCacheLock);
+   pthread_cond_destroy(&fs->metaCacheReady);
+   pthread_mutex_destroy(&fs->dirCacheLock);
+}
 
-   /* Indirect Zones */
-   int zoneNumsPerZone = zone_size / sizeof(uint32_t);
-   uint32_t *indirectZones = malloc(sizeof(uint32_t) * zoneNumsPerZone);
-   fseekPartition(image, file.indirect * zone_size, SEEK_SET);
-   fread(indirectZones, sizeof(uint32_t), zoneNumsPerZone, image);
-   if (ferror(image)) {
-      fprintf(stderr, "error reading file (%d)\n", ferror(image));
-      exit(EXIT_FAILURE);
+/* Which chain of the metadata cache a block at offset belongs on */
+static int metaBucket(struct minfs *fs, uint64_t offset) {
+   return (offset / fs->blockSize * 0x9E3779B97F4A7C15ull >> 32) &
+          (fs->metaCacheBuckets - 1);
+}
+
+/* Takes a cached block out of its chain. Called with metaCacheLock held. */
+static void unlinkMetaBlock(struct minfs *fs, struct metaBlock *block) {
+   int *link = fs->metaBuckets + metaBucket(fs, block->offset);
+
+   while (*link != block->slot + 1) {
+      link = &fs->metaCache[*link - 1].next;
    }
-   zoneIdx = 0;
+   *link = block->next;
+   block->len = 0;
+}
+
+/* Picks an unpinned slot that hasn't been used since the clock hand last
+ * passed it, or NULL if every slot is pinned. Called with metaCacheLock
+ * held.
+ */
+static struct metaBlock *sweepMetaCache(struct minfs *fs) {
+   int turns;
 
-   /* loop through all indirect zones while there's more data */
-   while (nextData < data + file.size &&
-          zoneIdx < zoneNumsPerZone) {
-      uint32_t zoneNum = indirectZones[zoneIdx];
+   for (turns = 0; turns < 2 * fs->metaCacheSlots; turns++) {
+      struct metaBlock *block = fs->metaCache + fs->metaClock;
 
-      if (zoneNum) {
-         /* copy the zone */
-         fseekPartition(image, zoneNum * zone_size, SEEK_SET);
-         fread(nextData, zone_size, 1, image);
-         if (ferror(image)) {
-            fprintf(stderr, "error reading file (%d)\n", ferror(image));
-            exit(EXIT_FAILURE);
+      fs->metaClock = (fs->metaClock + 1) % fs->metaCacheSlots;
+      if (block->pins) {
+         continue;
+      }
+      if (block->referenced) {
+         block->referenced = 0;
+         continue;
+      }
+      return block;
+   }
+   return NULL;
+}
+
+/* Reads metadata for getMetaBlock, timed as the given phase unless that
+   is -1. Returns 0, or -1. */
+static int readMetaTimed(struct minfs *fs, void *buf, uint64_t offset,
+                         uint64_t len, int phase) {
+   uint64_t start = phase >= 0 ? phaseStart() : 0;
+   int ret = readMeta(fs, buf, offset, len);
+   if (phase >= 0) {
+      phaseEnd(fs, phase, start);
+   }
+   return ret;
+}
+
+/* Returns the len bytes of metadata at offset within the partition,
+ * reading them into the cache if they aren't there yet, or NULL if they
+ * can't be read. The block is pinned through *pin until it is handed
+ * back to putMetaBlock. The read itself is done without holding the
+ * cache lock, and is timed as phase (-1 for none); cache hits aren't.
+ */
+static void *getMetaBlock(struct minfs *fs, uint64_t offset, uint32_t len,
+                          struct metaBlock **pin, int phase) {
+   uint64_t key = fs->partitionOffset + offset;
+   int bucket = metaBucket(fs, key);
+   struct metaBlock *block;
+   int slot, failed;
+
+   *pin = NULL;
+   pthread_mutex_lock(&fs->metaCacheLock);
+   for (slot = fs->metaBuckets[bucket]; slot;
+        slot = fs->metaCache[slot - 1].next) {
+      block = fs->metaCache + slot - 1;
+      if (block->offset == key && block->len == len) {
+         block->pins++;
+         block->referenced = 1;
+         while (!block->ready) {
+            pthread_cond_wait(&fs->metaCacheReady, &fs->metaCacheLock);
+         }
+         if (!block->len) {
+            /* the read this was waiting on failed */
+            block->pins--;
+            pthread_mutex_unlock(&fs->metaCacheLock);
+            setError("error reading file (%d)\n", EIO);
+            return NULL;
          }
+         pthread_mutex_unlock(&fs->metaCacheLock);
+         COUNT(fs, cacheHits, 1);
+         *pin = block;
+         return block->data;
       }
-      else {         
-         /* fill with zeros */
-         memset(nextData, 0, zone_size);
+   }
+   COUNT(fs, cacheMisses, 1);
+
+   block = sweepMetaCache(fs);
+   if (!block) {
+      /* every slot is in use: read into a block of its own */
+      pthread_mutex_unlock(&fs->metaCacheLock);
+      block = calloc(1, sizeof(struct metaBlock));
+      if (!block || !(block->data = malloc(len))) {
+         setError("Malloc is failing\n");
+         free(block);
+         return NULL;
+      }
+      block->slot = -1;
+      if (readMetaTimed(fs, block->data, offset, len, phase)) {
+         free(block->data);
+         free(block);
+         return NULL;
       }
-      nextData += zone_size;
-      zoneIdx++;
+      *pin = block;
+      return block->data;
    }
 
-   if (nextData >= data + file.size) {
-      return data;
+   if (block->len) {
+      unlinkMetaBlock(fs, block);
    }
+   block->offset = key;
+   block->len = len;
+   block->pins = 1;
+   block->referenced = 1;
+   block->ready = 0;
+   block->next = fs->metaBuckets[bucket];
+   fs->metaBuckets[bucket] = block->slot + 1;
+   pthread_mutex_unlock(&fs->metaCacheLock);
 
-   /* Double-Indirect Zones */
-   uint32_t *doubleIndirect = malloc(sizeof(uint32_t) * zoneNumsPerZone);
-   fseekPartition(image, file.two_indirect * zone_size, SEEK_SET);
-   fread(doubleIndirect, sizeof(uint32_t), zoneNumsPerZone, image);
-   if (ferror(image)) {
-      fprintf(stderr, "error reading file (%d)\n", ferror(image));
-      exit(EXIT_FAILURE);
+   failed = readMetaTimed(fs, block->data, offset, len, phase);
+
+   /* a block that couldn't be read leaves the cache again */
+   pthread_mutex_lock(&fs->metaCacheLock);
+   block->ready = 1;
+   if (failed) {
+      unlinkMetaBlock(fs, block);
+      block->pins--;
+   }
+   pthread_cond_broadcast(&fs->metaCacheReady);
+   pthread_mutex_unlock(&fs->metaCacheLock);
+   if (failed) {
+      return NULL;
+   }
+   *pin = block;
+   return block->data;
+}
+
+/* Lets go of a block from getMetaBlock. NULL is ignored. */
+static void putMetaBlock(struct minfs *fs, struct metaBlock *block) {
+   if (!block) {
+      return;
+   }
+   if (block->slot < 0) {
+      free(block->data);
+      free(block);
+      return;
+   }
+   pthread_mutex_lock(&fs->metaCacheLock);
+   block->pins--;
+   pthread_mutex_unlock(&fs->metaCacheLock);
+}
+
+/* Returns the given inode-table block through the metadata cache, or
+ * NULL if it can't be read
+ */
+static struct inode *getInodeBlock(struct minfs *fs, int64_t block,
+                                   struct metaBlock **pin) {
+   uint64_t len = (uint64_t)fs->numInodes * sizeof(struct inode) -
+                  block * fs->blockSize;
+   return getMetaBlock(fs, fs->inodeTableOffset + block * fs->blockSize,
+                       len < fs->blockSize ? len : fs->blockSize, pin,
+                       PHASE_INODES);
+}
+
+/* Returns the zone numbers held by an indirect zone through the metadata
+ * cache, or NULL (with nothing pinned) for a missing one. Returns 0, or
+ * -1 if the zone can't be read.
+ */
+static int getZoneTable(struct minfs *fs, uint32_t zoneNum,
+                        uint32_t **zones, struct metaBlock **pin) {
+   *pin = NULL;
+   *zones = NULL;
+   if (!zoneNum) {
+      return 0;
    }
-   zoneIdx = 0;
+   *zones = getMetaBlock(fs, (uint64_t)zoneNum * fs->zoneSize,
+                         fs->zoneSize, pin, -1);
+   return *zones ? 0 : -1;
+}
+
+/*
+ * Takes an absolute path and copies the inode of the requested file or
+ * directory into *found. Returns 0, or -1 if there is no such file or it
+ * can't be read.
+ */
+int traversePath(struct minfs *fs, const char *path, struct inode *found) {
+   int64_t inodeNum = lookupPath(fs, path);
 
-   /* loop through all double-indirect zones while there's more data */
-   while (nextData < data + file.size &&
-          zoneIdx < zoneNumsPerZone) {
-      fseekPartition(image, doubleIndirect[zoneIdx] * zone_size, SEEK_SET);
-      fread(indirectZones, sizeof(uint32_t), zoneNumsPerZone, image);
+   /* didn't find the file */
+   if (!inodeNum) {
+      setError("%s: File not found.\n", path);
+      return -1;
+   }
+   if (inodeNum < 0 || copyInode(fs, inodeNum, found)) {
+      return -1;
+   }
+   return 0;
+}
 
-      int indirectZoneIdx = 0;
+/*
+ * Takes an absolute path and returns the inode number of the requested
+ * file or directory, 0 if there is no such file, or -1 if it can't be
+ * read on the way (with minfsError saying why).
+ */
+int64_t lookupPath(struct minfs *fs, const char *path) {
+   struct inode currnode;
+   int64_t currNum = lookupIndex(fs, path);
+   char copy[PATH_MAX];
+   char *rest;
 
-      while (nextData < data + file.size &&
-             indirectZoneIdx < zoneNumsPerZone) {
-         uint32_t zoneNum = indirectZones[indirectZoneIdx];
+   /* paths the index doesn't know are walked as usual */
+   if (currNum) {
+      return currNum;
+   }
+   currNum = ROOT_INODE;
 
-         if (zoneNum) {
-            /* copy the data*/
-            fseekPartition(image, zoneNum * zone_size, SEEK_SET);
-            fread(nextData, zone_size, 1, image);
-            if (ferror(image)) {
-               fprintf(stderr, "error reading file (%d)\n", ferror(image));
-               exit(EXIT_FAILURE);
-            }
-         }  
-         else {         
-            /* fill with zeros */
-            memset(nextData, 0, zone_size);
-         }
-         nextData += zone_size;
-         indirectZoneIdx++;
+   if (strlen(path) >= sizeof(copy)) {
+      setError("%s: Path too long.\n", path);
+      return -1;
+   }
+   strcpy(copy, path);
+   if (copyInode(fs, ROOT_INODE, &currnode)) {
+      return -1;
+   }
+
+   /* traverse through file path */
+   char *file = strtok_r(copy, "/", &rest);
+   while (file) {
+      /* only real directories can be looked into */
+      if (!MIN_ISDIR(currnode.mode)) {
+         return 0;
       }
-      zoneIdx++;
+
+      /* look the name up in the directory's hash index,
+         then get the inode it names */
+      currNum = lookupEntry(fs, currNum, currnode, file);
+      if (currNum <= 0) {
+         return currNum;
+      }
+      if (copyInode(fs, currNum, &currnode)) {
+         return -1;
+      }
+      file = strtok_r(NULL, "/", &rest);
    }
 
-   return data;
+   return currNum;
 }
 
-/* Wrapper for seeking into a potentially partitioned image */
-size_t fseekPartition(FILE *stream, long int offset, int whence) {
-   if (partitionSize > -1 && offset > partitionSize) {
-      fprintf(stderr, "Attempting to seek outside of partition\n");
-      exit(EXIT_FAILURE);
+/* FNV-1a hash of a directory entry name, which may fill all DIRSIZ bytes */
+static uint32_t hashName(const char *name) {
+   uint32_t hash = 2166136261u;
+   int i;
+   for (i = 0; i < DIRSIZ && name[i]; i++) {
+      hash = (hash ^ (unsigned char)name[i]) * 16777619u;
    }
+   return hash;
+}
 
-   int ret = fseek(stream, offset + partitionOffset, whence);
-   if (ret < 0) {
-      fprintf(stderr, "error seeking in file (%d)\n", errno);
-      exit(EXIT_FAILURE);
+/* Unlinks a directory index from the cache and frees it */
+static void dropDirIndex(struct minfs *fs, struct dirIndex *dir) {
+   struct dirIndex **link = fs->dirCache + dir->inodeNum % DIR_CACHE_BUCKETS;
+   while (*link != dir) {
+      link = &(*link)->nextInBucket;
    }
-   return ret;
-}
\ No newline at end of file
+   *link = dir->nextInBucket;
+
+   if (dir->newer) {
+      dir->newer->older = dir->older;
+   }
+   else {
+      fs->dirCacheNewest = dir->older;
+   }
+   if (dir->older) {
+      dir->older->newer = dir->newer;
+   }
+   else {
+      fs->dirCacheOldest = dir->newer;
+   }
+
+   fs->dirCacheBytes -= dir->bytes;
+   free(dir->entries);
+   free(dir->buckets);
+   free(dir);
+}
+
+/* Moves a directory index to the most recently used end of the cache */
+static void touchDirIndex(struct minfs *fs, struct dirIndex *dir) {
+   if (dir == fs->dirCacheNewest) {
+      return;
+   }
+   if (dir->newer) {
+      dir->newer->older = dir->older;
+   }
+   if (dir->older) {
+      dir->older->newer = dir->newer;
+   }
+   else {
+      fs->dirCacheOldest = dir->newer;
+   }
+   dir->older = fs->dirCacheNewest;
+   dir->newer = NULL;
+   if (fs->dirCacheNewest) {
+      fs->dirCacheNewest->newer = dir;
+   }
+   fs->dirCacheNewest = dir;
+   if (!fs->dirCacheOldest) {
+      fs->dirCacheOldest = dir;
+   }
+}
+
+/* Reads a directory and builds a hash index over its live entries,
+ * evicting the least recently used directories to stay within
+ * DIR_CACHE_BYTES. Returns NULL if the directory can't be read.
+ */
+static struct dirIndex *buildDirIndex(struct minfs *fs, uint32_t inodeNum,
+                                      struct inode directory) {
+   struct dirIndex *dir = malloc(sizeof(struct dirIndex));
+   int i;
+   if (!dir) {
+      setError("Malloc is failing\n");
+      return NULL;
+   }
+
+   dir->inodeNum = inodeNum;
+   dir->entries = getFileEntries(fs, directory);
+   dir->numEntries = directory.size / sizeof(struct fileEntry);
+   if (!dir->entries) {
+      free(dir);
+      return NULL;
+   }
+
+   /* a power of two at least as big as the entry count */
+   dir->numBuckets = 1;
+   while (dir->numBuckets < dir->numEntries) {
+      dir->numBuckets <<= 1;
+   }
+
+   /* buckets hold entry index + 1, chained through next */
+   dir->buckets = calloc(dir->numBuckets + dir->numEntries, sizeof(int));
+   if (!dir->buckets) {
+      setError("Malloc is failing\n");
+      free(dir->entries);
+      free(dir);
+      return NULL;
+   }
+   dir->next = dir->buckets + dir->numBuckets;
+   for (i = 0; i < dir->numEntries; i++) {
+      if (dir->entries[i].inode) {      /* skip deleted entries */
+         int bucket = hashName(dir->entries[i].name) & (dir->numBuckets - 1);
+         dir->next[i] = dir->buckets[bucket];
+         dir->buckets[bucket] = i + 1;
+      }
+   }
+   dir->bytes = directory.size +
+                (dir->numBuckets + dir->numEntries) * sizeof(int);
+
+   /* make room, then add it to the cache */
+   while (fs->dirCacheOldest &&
+          fs->dirCacheBytes + dir->bytes > DIR_CACHE_BYTES) {
+      dropDirIndex(fs, fs->dirCacheOldest);
+   }
+   dir->nextInBucket = fs->dirCache[inodeNum % DIR_CACHE_BUCKETS];
+   fs->dirCache[inodeNum % DIR_CACHE_BUCKETS] = dir;
+   dir->newer = NULL;
+   dir->older = fs->dirCacheNewest;
+   if (fs->dirCacheNewest) {
+      fs->dirCacheNewest->newer = dir;
+   }
+   fs->dirCacheNewest = dir;
+   if (!fs->dirCacheOldest) {
+      fs->dirCacheOldest = dir;
+   }
+   fs->dirCacheBytes += dir->bytes;
+   return dir;
+}
+
+/* Looks a name up in the given directory (inode number dirNum), indexing
+ * the directory on first visit. Returns the entry's inode number, 0 if
+ * there is no such entry, or -1 if the directory can't be read.
+ */
+int64_t lookupEntry(struct minfs *fs, uint32_t dirNum,
+                    struct inode directory, const char *name) {
+   struct dirIndex *dir;
+   int64_t found = -1;
+   int i;
+
+   pthread_mutex_lock(&fs->dirCacheLock);
+   dir = fs->dirCache[dirNum % DIR_CACHE_BUCKETS];
+   while (dir && dir->inodeNum != dirNum) {
+      dir = dir->nextInBucket;
+   }
+   if (dir) {
+      touchDirIndex(fs, dir);
+   }
+   else {
+      dir = buildDirIndex(fs, dirNum, directory);
+   }
+
+   if (dir) {
+      i = dir->buckets[hashName(name) & (dir->numBuckets - 1)];
+      while (i && strncmp(dir->entries[i - 1].name, name, DIRSIZ)) {
+         i = dir->next[i - 1];
+      }
+      found = i ? dir->entries[i - 1].inode : 0;
+   }
+   pthread_mutex_unlock(&fs->dirCacheLock);
+   return found;
+}
+
+/* Empties the directory cache, freeing everything in it */
+void freeDirCache(struct minfs *fs) {
+   pthread_mutex_lock(&fs->dirCacheLock);
+   while (fs->dirCacheOldest) {
+      dropDirIndex(fs, fs->dirCacheOldest);
+   }
+   pthread_mutex_unlock(&fs->dirCacheLock);
+}
+
+/* Assumes that the given inode is a directory, returning all its entries,
+ * or NULL if they can't be read
+ */
+struct fileEntry *getFileEntries(struct minfs *fs, struct inode directory) {
+   struct fileEntry *entries = fs->index ? indexContents(fs, &directory) 
+                                         : NULL;
+   if (!entries) {
+      entries = (struct fileEntry *) copyZones(fs, directory);
+   }
+   return entries;
+}
+
+/* Orders 64-bit sort keys, for qsort */
+static int compareKeys(const void *a, const void *b) {
+   uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+   return ka < kb ? -1 : ka > kb;
+}
+
+/* Starts reading a directory a window at a time with dirNext. Unlike
+ * getFileEntries, only one window of entries, and their inodes, is held
+ * at once. Returns 0, or -1.
+ */
+int dirOpen(struct minfs *fs, struct inode directory, struct dirIter *it) {
+   uint32_t windowBytes = fs->zoneSize > DIR_WINDOW_BYTES ?
+                          fs->zoneSize : DIR_WINDOW_BYTES;
+
+   memset(it, 0, sizeof(struct dirIter));
+   it->fs = fs;
+   it->dir = directory;
+   it->windowEntries = windowBytes / sizeof(struct fileEntry);
+   it->window = malloc(windowBytes);
+   it->inodes = malloc(it->windowEntries * sizeof(struct inode));
+   it->order = malloc(it->windowEntries * sizeof(uint64_t));
+   if (!it->window || !it->inodes || !it->order) {
+      setError("Malloc is failing\n");
+      dirClose(it);
+      return -1;
+   }
+   return 0;
+}
+
+/* Reads the next window of a directory's contents, a run of adjacent
+ * zones at a time (or out of the index, if it has them), then fetches
+ * the inodes of its live entries in inode-number order, so the
+ * inode-table blocks they share are read once and in physical order.
+ * An entry whose inode can't be read is dropped. Returns 0, or -1.
+ */
+static int readDirWindow(struct dirIter *it) {
+   struct minfs *fs = it->fs;
+   uint64_t windowBytes = it->windowEntries * sizeof(struct fileEntry);
+   uint64_t len = it->dir.size - it->offset;
+   uint64_t done = 0;
+   char *dst = (char *)it->window;
+   int numLive = 0, i;
+
+   len = len < windowBytes ? len : windowBytes;
+   if (!fs->index || indexRead(fs, &it->dir, it->offset, dst, len)) {
+      while (done < len) {
+         uint64_t skip = (it->offset + done) % fs->zoneSize;
+         uint64_t run = fs->zoneSize - skip;
+         uint32_t zone, nextZone;
+         if (zoneAt(fs, it->dir, it->offset + done, &zone)) {
+            return -1;
+         }
+         /* stretch the read over zones that follow on disk */
+         while (zone && done + run < len &&
+                !zoneAt(fs, it->dir, it->offset + done + run, &nextZone) &&
+                nextZone == zone + run / fs->zoneSize) {
+            run += fs->zoneSize;
+         }
+         run = run < len - done ? run : len - done;
+         if (!zone) {
+            memset(dst + done, 0, run);
+         }
+         else if (readImage(fs, dst + done,
+                            (uint64_t)zone * fs->zoneSize + skip, run)) {
+            return -1;
+         }
+         else {
+            countData(fs, run);
+         }
+         done += run;
+      }
+   }
+   it->offset += len;
+   it->count = len / sizeof(struct fileEntry);
+   it->next = 0;
+
+   /* live entries, sorted by inode number */
+   for (i = 0; i < it->count; i++) {
+      if (it->window[i].inode) {
+         it->order[numLive++] = (uint64_t)it->window[i].inode << 32 | i;
+      }
+   }
+   qsort(it->order, numLive, sizeof(uint64_t), compareKeys);
+   for (i = 0; i < numLive; i++) {
+      int entry = (uint32_t)it->order[i];
+      if (copyInode(fs, it->window[entry].inode, &it->inodes[entry])) {
+         it->window[entry].inode = 0;
+      }
+   }
+   return 0;
+}
+
+/* Hands out the directory's next live entry and its inode, both good
+ * until the following call. Returns 1, 0 once there are no more, or -1
+ * if the directory can't be read.
+ */
+int dirNext(struct dirIter *it, struct fileEntry **entry, struct inode **in) {
+   for (;;) {
+      while (it->next < it->count) {
+         int i = it->next++;
+         if (it->window[i].inode) {
+            *entry = &it->window[i];
+            *in = &it->inodes[i];
+            return 1;
+         }
+      }
+      if (it->offset + sizeof(struct fileEntry) > it->dir.size) {
+         return 0;
+      }
+      if (readDirWindow(it)) {
+         return -1;
+      }
+   }
+}
+
+/* Frees what dirOpen set up */
+void dirClose(struct dirIter *it) {
+   free(it->window);
+   free(it->inodes);
+   free(it->order);
+   it->window = NULL;
+   it->inodes = NULL;
+   it->order = NULL;
+}
+
+/* Returns the inode at the given index in the inode Table, or NULL if
+ * there is no such inode. Without an eagerly loaded table, the pointer is
+ * into the metadata cache and only good until the next cached read, so
+ * threads should use copyInode instead.
+ */
+void *getInode(struct minfs *fs, int inodeNum) {
+   struct metaBlock *pin;
+   struct inode *found;
+
+   if (inodeNum <= 0 || inodeNum > fs->numInodes) {   /* invalid inode */
+      setError("Bad inode number %d\n", inodeNum);
+      return NULL;
+   }
+
+   if (fs->iTable) {
+      return &fs->iTable[inodeNum - 1];
+   }
+   found = getInodeBlock(fs, (inodeNum - 1) / fs->inodesPerBlock, &pin);
+   putMetaBlock(fs, pin);
+   return found ? found + (inodeNum - 1) % fs->inodesPerBlock : NULL;
+}
+
+/* Copies the given inode into *in. Returns 0, or -1 for an invalid
+ * inode or one that can't be read.
+ */
+int copyInode(struct minfs *fs, int inodeNum, struct inode *in) {
+   struct metaBlock *pin;
+   struct inode *block;
+
+   if (inodeNum <= 0 || inodeNum > fs->numInodes) {   /* invalid inode */
+      setError("Bad inode number %d\n", inodeNum);
+      return -1;
+   }
+   if (fs->iTable) {
+      *in = fs->iTable[inodeNum - 1];
+      return 0;
+   }
+   block = getInodeBlock(fs, (inodeNum - 1) / fs->inodesPerBlock, &pin);
+   if (!block) {
+      return -1;
+   }
+   *in = block[(inodeNum - 1) % fs->inodesPerBlock];
+   putMetaBlock(fs, pin);
+   return 0;
+}
+
+/* Copies all valid direct, indirect, and double-indirect zones in the given
+ * inode, zongregating them into a single block of returned memory, or
+ * NULL if they can't be read. Each run of adjacent zones is read with a
+ * single pread.
+ */
+void *copyZones(struct minfs *fs, struct inode file) {
+   struct readAhead ra;
+   struct extent *extents;
+   int numExtents, i;
+   char *data = malloc(file.size ? file.size : 1);
+   if (!data) {
+      setError("Malloc is failing\n");
+      return NULL;
+   }
+
+   numExtents = mapExtents(fs, file, &extents);
+   if (numExtents < 0) {
+      free(data);
+      return NULL;
+   }
+   startReadahead(&ra, fs, extents, numExtents);
+   for (i = 0; i < numExtents; i++) {
+      readAheadTo(&ra, extents[i].offset);
+      if (!extents[i].zone) {
+         /* fill with zeros */
+         memset(data + extents[i].offset, 0, extents[i].length);
+      }
+      else if (readImage(fs, data + extents[i].offset,
+                         (uint64_t)extents[i].zone * fs->zoneSize,
+                         extents[i].length)) {
+         free(extents);
+         free(data);
+         return NULL;
+      }
+      else {
+         countData(fs, extents[i].length);
+      }
+   }
+   free(extents);
+   return data;
+}
+
+/* Visits one run of zone numbers, stopping once *left bytes are covered
+ * or a visitor fails. A NULL table is a missing indirect block: every
+ * zone in it is a hole. Returns 0, or -1 if a visitor failed.
+ */
+static int visitZoneList(struct minfs *fs, uint32_t *zones, int count,
+                         uint32_t *left, zoneNumVisitor visit, void *arg) {
+   int zoneIdx;
+   for (zoneIdx = 0; zoneIdx < count && *left; zoneIdx++) {
+      uint32_t len = *left < fs->zoneSize ? *left : fs->zoneSize;
+      if (visit(zones ? zones[zoneIdx] : 0, len, arg)) {
+         return -1;
+      }
+      *left -= len;
+   }
+   return 0;
+}
+
+/* Walks the direct, indirect, and double-indirect zone numbers of the given
+ * inode in file order, with each zone's length trimmed to the file size.
+ * Returns 0, or -1 if a pointer block can't be read or a visitor failed.
+ */
+static int walkZoneNums(struct minfs *fs, struct inode file,
+                        zoneNumVisitor visit, void *arg) {
+   uint32_t left = file.size;
+   int zoneNumsPerZone = fs->zoneSize / sizeof(uint32_t);
+   struct metaBlock *pin, *tablePin;
+   uint32_t *zones, *doubleIndirect;
+   int zoneIdx, ret = 0;
+
+   /* Direct Zones */
+   if (visitZoneList(fs, file.zone, DIRECT_ZONES, &left, visit, arg)) {
+      return -1;
+   }
+
+   /* Indirect Zones */
+   if (left) {
+      if (getZoneTable(fs, file.indirect, &zones, &pin)) {
+         return -1;
+      }
+      ret = visitZoneList(fs, zones, zoneNumsPerZone, &left, visit, arg);
+      putMetaBlock(fs, pin);
+   }
+
+   /* Double-Indirect Zones */
+   if (left && !ret) {
+      if (getZoneTable(fs, file.two_indirect, &doubleIndirect, &tablePin)) {
+         return -1;
+      }
+      for (zoneIdx = 0; zoneIdx < zoneNumsPerZone && left && !ret;
+           zoneIdx++) {
+         ret = getZoneTable(fs, doubleIndirect ? doubleIndirect[zoneIdx] : 0,
+                            &zones, &pin);
+         if (!ret) {
+            ret = visitZoneList(fs, zones, zoneNumsPerZone, &left,
+                                visit, arg);
+            putMetaBlock(fs, pin);
+         }
+      }
+      putMetaBlock(fs, tablePin);
+   }
+   return ret;
+}
+
+/* The filesystem, visitor and argument walkZones was called with */
+struct zoneWalk {
+   struct minfs *fs;
+   zoneVisitor visit;
+   void *arg;
+};
+
+/* Turns a zone number into a pointer into the image for walkZones, or
+ * into a copy of the zone if the image is compressed
+ */
+static int visitZonePtr(uint32_t zoneNum, uint32_t len, void *arg) {
+   struct zoneWalk *walk = arg;
+   uint64_t offset = (uint64_t)zoneNum * walk->fs->zoneSize;
+   void *data = NULL;
+
+   if (zoneNum && walk->fs->gz) {
+      data = malloc(len ? len : 1);
+      if (!data) {
+         setError("Malloc is failing\n");
+         return -1;
+      }
+      if (readImage(walk->fs, data, offset, len)) {
+         free(data);
+         return -1;
+      }
+      walk->visit(data, len, walk->arg);
+      free(data);
+      return 0;
+   }
+   if (zoneNum && !(data = partitionPtr(walk->fs, offset, len))) {
+      return -1;
+   }
+   walk->visit(data, len, walk->arg);
+   return 0;
+}
+
+/* Walks the zones of the given inode in file order, handing each zone's
+ * bytes (trimmed to the file size) straight out of the mapped image
+ * to the visitor. Returns 0, or -1 if a zone can't be reached.
+ */
+int walkZones(struct minfs *fs, struct inode file, zoneVisitor visit,
+              void *arg) {
+   struct zoneWalk walk;
+   walk.fs = fs;
+   walk.visit = visit;
+   walk.arg = arg;
+   return walkZoneNums(fs, file, visitZonePtr, &walk);
+}
+
+/* The extent list being built by mapExtents */
+struct extentList {
+   struct minfs *fs;
+   struct extent *extents;
+   int count;
+   int max;
+   uint64_t offset;        /* logical offset of the next zone */
+};
+
+/* Adds one zone to the extent list, growing the last extent if the zone
+ * continues it on disk (or if both are holes). Returns 0, or -1.
+ */
+static int addExtentZone(uint32_t zoneNum, uint32_t len, void *arg) {
+   struct extentList *list = arg;
+   struct extent *last = list->count ? list->extents + list->count - 1 : NULL;
+
+   COUNT(list->fs, zones, 1);
+   if (last && (last->zone ?
+       zoneNum == last->zone + last->length / list->fs->zoneSize :
+       !zoneNum)) {
+      last->length += len;
+   }
+   else {
+      if (list->count == list->max) {
+         struct extent *grown;
+         list->max = list->max ? list->max * 2 : 16;
+         grown = realloc(list->extents, list->max * sizeof(struct extent));
+         if (!grown) {
+            setError("Malloc is failing\n");
+            return -1;
+         }
+         list->extents = grown;
+      }
+      last = list->extents + list->count++;
+      last->offset = list->offset;
+      last->zone = zoneNum;
+      last->length = len;
+      COUNT(list->fs, extents, 1);
+   }
+   list->offset += len;
+   return 0;
+}
+
+/* Resolves the zones of the given inode into a list of extents: runs of
+ * physically adjacent zones, with holes as extents of zone 0. The list is
+ * malloc'd into *extents and the number of extents returned, or -1 (with
+ * nothing to free) if the zones can't be read.
+ */
+int mapExtents(struct minfs *fs, struct inode file, struct extent **extents) {
+   struct extentList list;
+   int count;
+
+   if (fs->index && (count = indexExtents(fs, &file, extents)) >= 0) {
+      return count;
+   }
+   list.fs = fs;
+   list.extents = NULL;
+   list.count = 0;
+   list.max = 0;
+   list.offset = 0;
+
+   if (walkZoneNums(fs, file, addExtentZone, &list)) {
+      free(list.extents);
+      *extents = NULL;
+      return -1;
+   }
+   *extents = list.extents;
+   return list.count;
+}
+
+/* How streamFile moves bytes from the image to the output */
+enum copyMethod { COPY_FILE_RANGE, COPY_SPLICE, COPY_SENDFILE, COPY_WRITE };
+
+/* Where streamFile is writing to */
+struct outStream {
+   struct minfs *fs;
+   int fd;
+   enum copyMethod method;
+   char *zeros;            /* one zone of zeros for writing holes */
+   int sparse;             /* holes can be seeked over instead */
+   uint64_t oldSize;       /* bytes the output held before, maybe stale */
+};
+
+/* Writes len bytes of buf to fd, riding out short writes and counting
+ * the writes in *syscalls if it isn't NULL.
+ * Returns 0, or -1 with errno set if the output fails.
+ */
+static int writeCounted(int fd, const void *buf, uint64_t len,
+                        uint64_t *syscalls) {
+   const char *next = buf;
+   while (len) {
+      ssize_t put = write(fd, next, len);
+      if (syscalls) {
+         __atomic_add_fetch(syscalls, 1, __ATOMIC_RELAXED);
+      }
+      if (put < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return -1;
+      }
+      next += put;
+      len -= put;
+   }
+   return 0;
+}
+
+/* Writes len bytes of buf to fd, riding out short writes.
+ * Returns 0, or -1 with errno set if the output fails.
+ */
+int writeAll(int fd, const void *buf, uint64_t len) {
+   return writeCounted(fd, buf, len, NULL);
+}
+
+/* Writes to a stream's output, counting the writes against its image */
+static int streamWrite(struct outStream *out, const void *buf, uint64_t len) {
+   if (writeCounted(out->fd, buf, len, &out->fs->stats.syscalls)) {
+      setError("error writing output (%d)\n", errno);
+      return -1;
+   }
+   return 0;
+}
+
+/* Has the kernel copy len bytes at image offset off to the output.
+ * Returns bytes copied, or -1 with errno set.
+ */
+static ssize_t kernelCopy(struct outStream *out, loff_t off, uint64_t len) {
+   int imageFd = out->fs->fd;
+   ssize_t put;
+   do {
+      COUNT(out->fs, syscalls, 1);
+      switch (out->method) {
+         case COPY_FILE_RANGE:
+            put = copy_file_range(imageFd, &off, out->fd, NULL, len, 0);
+         break;
+         case COPY_SPLICE:
+            put = splice(imageFd, &off, out->fd, NULL, len, SPLICE_F_MORE);
+         break;
+         default:
+            put = sendfile(out->fd, imageFd, &off, len);
+         break;
+      }
+   } while (put < 0 && errno == EINTR);
+
+   if (put == 0) {
+      errno = EIO;
+      return -1;
+   }
+   return put;
+}
+
+/* Writes one extent of a file to the output, less its first skip bytes.
+ * Returns 0, or -1 with errno set if the output fails.
+ */
+static int streamExtent(struct outStream *out, struct extent *ext,
+                        uint64_t skip) {
+   struct minfs *fs = out->fs;
+   uint64_t length = ext->length - skip;
+   uint64_t done = 0;
+
+   if (!ext->zone && out->sparse) {
+      off_t pos = lseek(out->fd, 0, SEEK_CUR);
+      if (pos < 0) {
+         setError("error writing output (%d)\n", errno);
+         return -1;
+      }
+      /* seeking leaves the hole unwritten; anything already under it
+         has to be punched out, or zeroed if that fails */
+      if ((uint64_t)pos >= out->oldSize ||
+          fallocate(out->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    pos, length) == 0) {
+         COUNT(fs, holes, length);
+         if (lseek(out->fd, length, SEEK_CUR) < 0) {
+            setError("error writing output (%d)\n", errno);
+            return -1;
+         }
+         return 0;
+      }
+   }
+   if (!ext->zone) {
+      while (done < length) {
+         uint64_t len = length - done;
+         len = len < fs->zoneSize ? len : fs->zoneSize;
+         if (streamWrite(out, out->zeros, len)) {
+            return -1;
+         }
+         done += len;
+      }
+      return 0;
+   }
+
+   /* a compressed image can only be inflated and written out */
+   if (fs->gz) {
+      uint64_t offset = (uint64_t)ext->zone * fs->zoneSize + skip;
+      uint64_t chunk = length < COPY_CHUNK ? length : COPY_CHUNK;
+      char *buffer = malloc(chunk ? chunk : 1);
+      if (!buffer) {
+         setError("Malloc is failing\n");
+         return -1;
+      }
+      while (done < length) {
+         uint64_t len = length - done < chunk ? length - done : chunk;
+         if (readImage(fs, buffer, offset + done, len) ||
+             streamWrite(out, buffer, len)) {
+            free(buffer);
+            return -1;
+         }
+         done += len;
+      }
+      free(buffer);
+      countData(fs, length);
+      return 0;
+   }
+
+   /* bounds-check the whole run once, then work in image offsets */
+   char *data = partitionPtr(fs, (uint64_t)ext->zone * fs->zoneSize + skip,
+                             length);
+   if (!data) {
+      return -1;
+   }
+   uint64_t offset = (unsigned char *)data - fs->base;
+
+   while (done < length && out->method != COPY_WRITE) {
+      ssize_t put = kernelCopy(out, offset + done, length - done);
+      if (put >= 0) {
+         done += put;
+      }
+      else if (errno == EPIPE || errno == EIO || errno == ENOSPC ||
+               errno == ECONNRESET) {
+         setError("error writing output (%d)\n", errno);
+         return -1;
+      }
+      else {
+         /* this descriptor can't take it, write from the map instead */
+         out->method = COPY_WRITE;
+      }
+   }
+   if (done < length && streamWrite(out, data + done, length - done)) {
+      return -1;
+   }
+   COUNT(fs, bytes, length);
+   countData(fs, length);
+   return 0;
+}
+
+/* Writes one extent of a file to the output, less its first skip bytes,
+ * in pieces of half the readahead window so that readahead keeps ahead
+ * of the copy, but never less than COPY_CHUNK at a time, so a small
+ * window doesn't break the copy up. Returns 0, or -1 with errno set if
+ * the output fails.
+ */
+static int streamAhead(struct outStream *out, struct extent *ext,
+                       uint64_t skip, struct readAhead *ra) {
+   uint64_t step = out->fs->readahead / 2;
+   struct extent piece = *ext;
+
+   if (step && step < COPY_CHUNK) {
+      step = COPY_CHUNK;
+   }
+   if (!step || !ext->zone) {
+      readAheadTo(ra, ext->offset + skip);
+      return streamExtent(out, ext, skip);
+   }
+   while (skip < ext->length) {
+      readAheadTo(ra, ext->offset + skip);
+      piece.length = ext->length - skip < step ? ext->length : skip + step;
+      if (streamExtent(out, &piece, skip)) {
+         return -1;
+      }
+      skip = piece.length;
+   }
+   return 0;
+}
+
+/* Picks how to copy into outFd, for streamFile and streamRange.
+ * Returns 0, or -1.
+ */
+static int openStream(struct minfs *fs, struct outStream *out, int outFd) {
+   struct stat st;
+
+   out->fs = fs;
+   out->fd = outFd;
+   out->method = COPY_WRITE;
+   out->sparse = 0;
+   if (fstat(outFd, &st) == 0) {
+      if (S_ISREG(st.st_mode)) {
+         /* appending writes ignore the file offset, so can't skip holes */
+         out->method = COPY_FILE_RANGE;
+         out->sparse = !(fcntl(outFd, F_GETFL) & O_APPEND);
+         out->oldSize = st.st_size;
+      }
+      else if (S_ISFIFO(st.st_mode)) {
+         out->method = COPY_SPLICE;
+      }
+      else if (S_ISSOCK(st.st_mode)) {
+         out->method = COPY_SENDFILE;
+      }
+   }
+
+   out->zeros = calloc(1, fs->zoneSize);
+   if (!out->zeros) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   return 0;
+}
+
+/* Gives a sparse output the length a trailing hole was only seeked over.
+ * Returns 0, or -1 with errno set if the output fails.
+ */
+static int closeStream(struct outStream *out) {
+   struct stat st;
+   off_t end;
+
+   if (!out->sparse) {
+      return 0;
+   }
+   end = lseek(out->fd, 0, SEEK_CUR);
+   if (end < 0 || (fstat(out->fd, &st) == 0 && st.st_size < end &&
+                   ftruncate(out->fd, end) < 0)) {
+      setError("error writing output (%d)\n", errno);
+      return -1;
+   }
+   return 0;
+}
+
+/* Streams the contents of a file to outFd in file order, holding at most
+ * one zone in memory. Each extent goes out in one piece, copied by the
+ * kernel straight from the image descriptor when the output allows it
+ * (copy_file_range to regular files, splice to pipes, sendfile to sockets).
+ * Holes are seeked over in regular files, so the output stays sparse.
+ * Returns 0, or -1 (with errno set if it was the output that failed).
+ */
+int streamFile(struct minfs *fs, struct inode file, int outFd) {
+   struct readAhead ra;
+   struct outStream out;
+   struct extent *extents;
+   int numExtents, i, ret = 0;
+
+   if (openStream(fs, &out, outFd)) {
+      return -1;
+   }
+   numExtents = mapExtents(fs, file, &extents);
+   if (numExtents < 0) {
+      free(out.zeros);
+      return -1;
+   }
+   startReadahead(&ra, fs, extents, numExtents);
+   for (i = 0; i < numExtents && !ret; i++) {
+      ret = streamAhead(&out, extents + i, 0, &ra);
+   }
+   if (!ret && numExtents && !extents[numExtents - 1].zone) {
+      ret = closeStream(&out);
+   }
+   free(extents);
+   free(out.zeros);
+   return ret;
+}
+
+/* Finds the zone holding the given byte of a file, 0 if that byte is in
+ * a hole or past the end. Only the pointer blocks on the way to it are
+ * read: none for a direct zone, one for an indirect one, two beyond that.
+ * Returns 0, or -1 if a pointer block can't be read.
+ */
+int zoneAt(struct minfs *fs, struct inode file, uint64_t offset,
+           uint32_t *zone) {
+   uint64_t zoneNumsPerZone = fs->zoneSize / sizeof(uint32_t);
+   uint64_t index = offset / fs->zoneSize;
+   struct metaBlock *pin;
+   uint32_t *zones;
+
+   *zone = 0;
+   if (offset >= file.size) {
+      return 0;
+   }
+
+   /* Direct Zones */
+   if (index < DIRECT_ZONES) {
+      *zone = file.zone[index];
+      return 0;
+   }
+   index -= DIRECT_ZONES;
+
+   /* Indirect Zones */
+   if (index < zoneNumsPerZone) {
+      if (getZoneTable(fs, file.indirect, &zones, &pin)) {
+         return -1;
+      }
+      *zone = zones ? zones[index] : 0;
+      putMetaBlock(fs, pin);
+      return 0;
+   }
+   index -= zoneNumsPerZone;
+
+   /* Double-Indirect Zones */
+   if (index >= zoneNumsPerZone * zoneNumsPerZone) {
+      return 0;
+   }
+   if (getZoneTable(fs, file.two_indirect, &zones, &pin)) {
+      return -1;
+   }
+   *zone = zones ? zones[index / zoneNumsPerZone] : 0;
+   putMetaBlock(fs, pin);
+   if (getZoneTable(fs, *zone, &zones, &pin)) {
+      return -1;
+   }
+   *zone = zones ? zones[index % zoneNumsPerZone] : 0;
+   putMetaBlock(fs, pin);
+   return 0;
+}
+
+/* Resolves the zones covering length bytes at offset in a file (clipped
+ * to its size) into extents, like mapExtents. The first extent starts on
+ * the zone boundary at or before offset. Returns the number of extents,
+ * or -1 (with nothing to free).
+ */
+int mapRange(struct minfs *fs, struct inode file, uint64_t offset,
+             uint64_t length, struct extent **extents) {
+   struct extentList list;
+   uint64_t end;
+   uint32_t zone;
+
+   offset = offset < file.size ? offset : file.size;
+   end = length < file.size - offset ? offset + length : file.size;
+   list.fs = fs;
+   list.extents = NULL;
+   list.count = 0;
+   list.max = 0;
+   list.offset = offset - offset % fs->zoneSize;
+
+   *extents = NULL;
+   while (list.offset < end) {
+      uint64_t len = end - list.offset;
+      if (zoneAt(fs, file, list.offset, &zone) ||
+          addExtentZone(zone, len < fs->zoneSize ? len : fs->zoneSize,
+                        &list)) {
+         free(list.extents);
+         return -1;
+      }
+   }
+   *extents = list.extents;
+   return list.count;
+}
+
+/* Streams length bytes at offset in a file (clipped to its size) to
+ * outFd, the way streamFile streams the whole file. Returns 0, or -1
+ * (with errno set if it was the output that failed).
+ */
+int streamRange(struct minfs *fs, struct inode file, uint64_t offset,
+                uint64_t length, int outFd) {
+   struct readAhead ra;
+   struct outStream out;
+   struct extent *extents;
+   int numExtents, i, ret = 0;
+
+   offset = offset < file.size ? offset : file.size;
+   if (openStream(fs, &out, outFd)) {
+      return -1;
+   }
+   numExtents = mapRange(fs, file, offset, length, &extents);
+   if (numExtents < 0) {
+      free(out.zeros);
+      return -1;
+   }
+   startReadahead(&ra, fs, extents, numExtents);
+   for (i = 0; i < numExtents && !ret; i++) {
+      ret = streamAhead(&out, extents + i, i ? 0 : offset - extents->offset,
+                        &ra);
+   }
+   if (!ret && numExtents && !extents[numExtents - 1].zone) {
+      ret = closeStream(&out);
+   }
+   free(extents);
+   free(out.zeros);
+   return ret;
+}
+
+/* Checks that len bytes at offset lie inside the filesystem's partition.
+ * Returns 0, or -1 if they don't.
+ */
+static int checkRange(struct minfs *fs, uint64_t offset, uint64_t len) {
+   if (offset > fs->partitionSize || len > fs->partitionSize - offset) {
+      setError(IMAGE_BOUNDS, (unsigned long long)offset);
+      return -1;
+   }
+   return 0;
+}
+
+/* Reads len bytes at offset within the filesystem's partition into buf
+ * with as few preads as the kernel allows. Returns 0, or -1.
+ */
+int readImage(struct minfs *fs, void *buf, uint64_t offset, uint64_t len) {
+   char *dst = buf;
+
+   /* bounds-check the whole range once */
+   if (checkRange(fs, offset, len)) {
+      return -1;
+   }
+   uint64_t pos = fs->partitionOffset + offset;
+   COUNT(fs, bytes, len);
+   if (fs->gz) {
+      return readInflated(fs, buf, pos, len);
+   }
+   while (len) {
+      ssize_t got = pread(fs->fd, dst, len, pos);
+      COUNT(fs, syscalls, 1);
+      if (got < 0 && errno == EINTR) {
+         continue;
+      }
+      if (got <= 0) {
+         setError("error reading file (%d)\n", got ? errno : EIO);
+         return -1;
+      }
+      dst += got;
+      pos += got;
+      len -= got;
+   }
+   return 0;
+}
+
+/* Starts readahead for a file about to be read in the order of its
+ * extents, asking for the first window of it
+ */
+void startReadahead(struct readAhead *ra, struct minfs *fs,
+                    struct extent *extents, int numExtents) {
+   ra->fs = fs;
+   ra->extents = extents;
+   ra->numExtents = numExtents;
+   ra->next = 0;
+   ra->advised = 0;
+   readAheadTo(ra, 0);
+}
+
+/* Notes that the file has been consumed up to offset, and once less than
+ * half a window is left asked for, asks for the image ranges under the
+ * next window with posix_fadvise, so the kernel reads them in the
+ * background. Holes need nothing read, and a compressed image is
+ * inflated a frame at a time anyway, so neither is asked for.
+ */
+void readAheadTo(struct readAhead *ra, uint64_t offset) {
+   struct minfs *fs = ra->fs;
+   uint64_t end = offset + fs->readahead;
+
+   if (!fs->readahead || fs->gz || ra->next >= ra->numExtents ||
+       ra->advised >= offset + fs->readahead / 2) {
+      return;
+   }
+   while (ra->next < ra->numExtents && ra->advised < end) {
+      struct extent *ext = ra->extents + ra->next;
+      uint64_t from = ra->advised > ext->offset ? ra->advised : ext->offset;
+      uint64_t to = ext->offset + ext->length < end ?
+                    ext->offset + ext->length : end;
+      if (ext->zone && to > from) {
+         posix_fadvise(fs->fd, fs->partitionOffset +
+                       (uint64_t)ext->zone * fs->zoneSize +
+                       (from - ext->offset), to - from, POSIX_FADV_WILLNEED);
+         COUNT(fs, syscalls, 1);
+      }
+      ra->advised = to;
+      if (to == ext->offset + ext->length) {
+         ra->next++;
+      }
+   }
+}
+
+/* Returns the time now in nanoseconds, less the time this thread has
+ * spent in phases, to hand to phaseEnd. A phase timed inside another is
+ * so only counted once: the outer one's time leaves the inner one out.
+ */
+uint64_t phaseStart(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec - phasedNanos;
+}
+
+/* Adds the time since start, less any phases within it, to one of a
+   filesystem's phases */
+void phaseEnd(struct minfs *fs, int phase, uint64_t start) {
+   uint64_t spent = phaseStart() - start;
+   COUNT(fs, phaseNanos[phase], spent);
+   phasedNanos += spent;
+}
+
+/* Counts len bytes of file or directory contents read from the image */
+void countData(struct minfs *fs, uint64_t len) {
+   COUNT(fs, dataBlocks, (len + fs->blockSize - 1) / fs->blockSize);
+}
+
+/* the phases' names in the report, in enum minPhase order */
+static const char *phaseNames[NUM_PHASES] = {
+   "open", "partition", "superblock", "inodes", "traverse", "copy", "output",
+   "index"
+};
+
+/* Reports the I/O counters and phase times on the given stream, as
+ * readable text (STATS_TEXT) or a single JSON object (STATS_JSON)
+ */
+void printIoStats(struct minfs *fs, FILE *out, int format) {
+   struct ioStats *stats = &fs->stats;
+   int phase;
+
+   if (format == STATS_JSON) {
+      fprintf(out, "{\"syscalls\": %llu, \"bytes\": %llu, \"zones\": %llu, "
+              "\"extents\": %llu, \"holes\": %llu, \"metaBlocks\": %llu, "
+              "\"dataBlocks\": %llu, \"cacheHits\": %llu, "
+              "\"cacheMisses\": %llu, \"indexHits\": %llu, "
+              "\"frames\": %llu, \"phaseNanos\": {",
+              (unsigned long long)stats->syscalls,
+              (unsigned long long)stats->bytes,
+              (unsigned long long)stats->zones,
+              (unsigned long long)stats->extents,
+              (unsigned long long)stats->holes,
+              (unsigned long long)stats->metaBlocks,
+              (unsigned long long)stats->dataBlocks,
+              (unsigned long long)stats->cacheHits,
+              (unsigned long long)stats->cacheMisses,
+              (unsigned long long)stats->indexHits,
+              (unsigned long long)stats->frames);
+      for (phase = 0; phase < NUM_PHASES; phase++) {
+         fprintf(out, "%s\"%s\": %llu", phase ? ", " : "", phaseNames[phase],
+                 (unsigned long long)stats->phaseNanos[phase]);
+      }
+      fprintf(out, "}}\n");
+      return;
+   }
+
+   fprintf(out, "%llu zones in %llu extents, %llu bytes in %llu syscalls\n",
+           (unsigned long long)stats->zones,
+           (unsigned long long)stats->extents,
+           (unsigned long long)stats->bytes,
+           (unsigned long long)stats->syscalls);
+   fprintf(out, "%llu bytes of holes left unwritten\n",
+           (unsigned long long)stats->holes);
+   fprintf(out, "%llu metadata blocks, %llu data blocks read\n",
+           (unsigned long long)stats->metaBlocks,
+           (unsigned long long)stats->dataBlocks);
+   fprintf(out, "metadata cache: %llu hits, %llu misses\n",
+           (unsigned long long)stats->cacheHits,
+           (unsigned long long)stats->cacheMisses);
+   if (fs->index) {
+      fprintf(out, "%llu lookups answered by the index\n",
+              (unsigned long long)stats->indexHits);
+   }
+   if (fs->gz) {
+      fprintf(out, "%llu compressed frames inflated\n",
+              (unsigned long long)stats->frames);
+   }
+   for (phase = 0; phase < NUM_PHASES; phase++) {
+      fprintf(out, "%-10s %10.3f ms\n", phaseNames[phase],
+              stats->phaseNanos[phase] / 1e6);
+   }
+}
+
+/* Returns a pointer to the given zone in the mapped partition, or NULL if
+ * it lies outside
+ */
+void *zonePtr(struct minfs *fs, uint32_t zoneNum) {
+   return partitionPtr(fs, (uint64_t)zoneNum * fs->zoneSize, fs->zoneSize);
+}
+
+/* Returns a pointer to len bytes at offset within the filesystem's
+ * partition, checking once that the whole range lies inside it, or
+ * NULL if it doesn't
+ */
+void *partitionPtr(struct minfs *fs, uint64_t offset, uint64_t len) {
+   if (checkRange(fs, offset, len)) {
+      return NULL;
+   }
+   if (!fs->base) {
+      setError("Compressed images can't be mapped\n");
+      return NULL;
+   }
+   return fs->base + fs->partitionOffset + offset;
+}
+
+/* Returns the inode (INODE_MAP) or zone (ZONE_MAP) bitmap in the mapped
+ * partition, or NULL if it lies outside. A compressed image's bitmap is
+ * read out once and kept until the filesystem is closed. *numBits is how
+ * many of its bits mean something: bit i is inode i, or zone
+ * firstdata + i - 1, and bit 0 is reserved in both.
+ */
+uint8_t *getBitmap(struct minfs *fs, int which, uint64_t *numBits) {
+   uint64_t offset = 2 * (uint64_t)fs->blockSize;
+   uint64_t blocks = fs->sb.i_blocks;
+   uint64_t bits = (uint64_t)fs->sb.ninodes + 1;
+
+   if (which == ZONE_MAP) {
+      offset += (uint64_t)fs->sb.i_blocks * fs->blockSize;
+      blocks = fs->sb.z_blocks;
+      bits = fs->sb.zones > fs->sb.firstdata ?
+             (uint64_t)fs->sb.zones - fs->sb.firstdata + 1 : 1;
+   }
+   if (bits > blocks * fs->blockSize * 8) {
+      bits = blocks * fs->blockSize * 8;
+   }
+   *numBits = bits;
+   if (!fs->gz) {
+      return partitionPtr(fs, offset, blocks * fs->blockSize);
+   }
+
+   uint64_t size = blocks * fs->blockSize;
+   uint8_t *map = __atomic_load_n(&fs->bitmaps[which], __ATOMIC_ACQUIRE);
+   if (map) {
+      return map;
+   }
+   map = malloc(size ? size : 1);
+   if (!map) {
+      setError("Malloc is failing\n");
+      return NULL;
+   }
+   if (readMeta(fs, map, offset, size)) {
+      free(map);
+      return NULL;
+   }
+   /* another thread may have read it first */
+   uint8_t *none = NULL;
+   if (!__atomic_compare_exchange_n(&fs->bitmaps[which], &none, map, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      free(map);
+      return none;
+   }
+   return map;
+}
+
+/* Counts the set bits in n 64-bit words */
+static uint64_t popcountWords(const uint8_t *words, uint64_t n) {
+   uint64_t count = 0, i, word;
+   for (i = 0; i < n; i++) {
+      memcpy(&word, words + i * 8, 8);
+      count += __builtin_popcountll(word);
+   }
+   return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* popcountWords using the popcnt instruction, four words at a time so
+ * the adds don't wait on each other
+ */
+__attribute__((target("popcnt")))
+static uint64_t popcountWordsNative(const uint8_t *words, uint64_t n) {
+   uint64_t counts[4] = { 0, 0, 0, 0 }, i, word[4];
+   for (i = 0; i + 4 <= n; i += 4) {
+      memcpy(word, words + i * 8, sizeof(word));
+      counts[0] += __builtin_popcountll(word[0]);
+      counts[1] += __builtin_popcountll(word[1]);
+      counts[2] += __builtin_popcountll(word[2]);
+      counts[3] += __builtin_popcountll(word[3]);
+   }
+   for (; i < n; i++) {
+      memcpy(word, words + i * 8, 8);
+      counts[0] += __builtin_popcountll(word[0]);
+   }
+   return counts[0] + counts[1] + counts[2] + counts[3];
+}
+#endif
+
+/* Counts the set bits of a bitmap from bit start up to (not including)
+ * bit end. Whole words are counted with popcnt where the CPU has it.
+ */
+uint64_t countBits(const uint8_t *map, uint64_t start, uint64_t end) {
+   uint64_t count = 0;
+
+   /* odd bits up to a word boundary, then whole words, then the rest */
+   while (start < end && start % 64) {
+      count += map[start / 8] >> (start % 8) & 1;
+      start++;
+   }
+   if (end - start >= 64) {
+      uint64_t words = (end - start) / 64;
+#if defined(__x86_64__) || defined(__i386__)
+      if (__builtin_cpu_supports("popcnt")) {
+         count += popcountWordsNative(map + start / 8, words);
+      }
+      else
+#endif
+      count += popcountWords(map + start / 8, words);
+      start += words * 64;
+   }
+   while (start < end) {
+      count += map[start / 8] >> (start % 8) & 1;
+      start++;
+   }
+   return count;
+}
+
+/* Finds the first run of bits equal to set (0 or 1) at or after bit start
+ * and before bit end. Returns where it starts, with its length in *len,
+ * or end (and *len 0) if there is none. Whole words are skipped at a time.
+ */
+uint64_t findRun(const uint8_t *map, uint64_t start, uint64_t end, int set,
+                 uint64_t *len) {
+   uint64_t skip = set ? 0 : ~0ull;     /* a word with nothing to find */
+   uint64_t word, runStart;
+
+   /* find the start of the run */
+   while (start < end) {
+      if (start % 64 == 0 && end - start >= 64) {
+         memcpy(&word, map + start / 8, 8);
+         if (word == skip) {
+            start += 64;
+            continue;
+         }
+         start += __builtin_ctzll(set ? word : ~word);
+         break;
+      }
+      if ((map[start / 8] >> (start % 8) & 1) == set) {
+         break;
+      }
+      start++;
+   }
+   if (start >= end) {
+      *len = 0;
+      return end;
+   }
+
+   /* then its end */
+   runStart = start;
+   while (start < end) {
+      if (start % 64 == 0 && end - start >= 64) {
+         memcpy(&word, map + start / 8, 8);
+         if (word == ~skip) {
+            start += 64;
+            continue;
+         }
+         start += __builtin_ctzll(set ? ~word : word);
+         break;
+      }
+      if ((map[start / 8] >> (start % 8) & 1) != set) {
+         break;
+      }
+      start++;
+   }
+   if (start > end) {
+      start = end;
+   }
+   *len = start - runStart;
+   return runStart;
+}
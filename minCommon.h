@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -5,6 +6,19 @@
 #include <string.h>
 #include <linux/limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdarg.h>
 
 /* constants */
 #define PTABLE_OFFSET 0x1BE
@@ -29,11 +43,31 @@
 #define MIN_IXOTH 0001
 
 #define INVALID_OPTION -1
+#define ALL_PARTITIONS -2        /* -p all: every filesystem in the image */
 
-unsigned int zone_size;
-struct inode *iTable;
-FILE *image;
-int numInodes;
+#define META_CACHE_BYTES (4 << 20) /* memory the metadata cache may hold */
+#define META_CACHE_MIN 16        /* metadata blocks kept at the least */
+#define DIR_CACHE_BUCKETS 256    /* hash chains for indexed directories */
+#define DIR_CACHE_BYTES (16 << 20) /* memory the directory cache may hold */
+#define ROOT_INODE 1
+#define DEFAULT_BUDGET (64 << 20) /* bytes minget -r may have in flight */
+#define DEFAULT_READAHEAD (8 << 20) /* bytes of a file asked for ahead */
+#define RANGE_TO_END UINT64_MAX  /* --length default: the rest of the file */
+#define INODE_MAP 0              /* getBitmap: the inode bitmap */
+#define ZONE_MAP 1               /* getBitmap: the zone bitmap */
+#define INDEX_SUFFIX ".idx"       /* --index default: the image name plus this */
+#define STATS_NONE 0             /* --stats: no report */
+#define STATS_TEXT 1             /* --stats=text (or -v): a readable report */
+#define STATS_JSON 2             /* --stats=json: one JSON object */
+#define COPY_CHUNK (1 << 20)     /* bytes inflated at a time for output */
+#define OUT_BUF_BYTES (1 << 20)  /* listing output written at a time */
+#define DIR_WINDOW_BYTES (32 << 10) /* directory read at a time by dirNext */
+#define HASH_CHUNK (1 << 20)     /* bytes hashFile reads in one go */
+#define FORMAT_TEXT 0            /* --format=text: ls-style lines */
+#define FORMAT_JSON 1            /* --format=json: one array of entries */
+#define FORMAT_NDJSON 2          /* --format=ndjson: an object per line */
+#define FORMAT_NUL 3             /* --format=nul: NUL-terminated paths */
+#define FORMAT_RAW -1            /* eachPartition: output passed on as is */
 
 struct part_entry {
    uint8_t bootind;      /* boot indicator 0/ACTIVE_FLAG   */
@@ -108,6 +142,20 @@ struct fileEntry {
 
 struct minOptions {
    int verbose;
+   int eager;
+   int recursive;
+   int threads;
+   int nulDelim;
+   char *socketPath;
+   char *destDir;
+   uint64_t budget;
+   int64_t rangeOffset;    /* --offset; negative counts back from the end */
+   uint64_t rangeLength;   /* --length, RANGE_TO_END if not given */
+   int stats;              /* STATS_NONE, STATS_TEXT or STATS_JSON */
+   char *indexFile;        /* --index: the sidecar index, NULL for none */
+   int format;             /* --format: FORMAT_TEXT, _JSON, _NDJSON or _NUL */
+   uint64_t readahead;     /* --readahead: bytes to ask for ahead, 0 for none */
+   int checksum;           /* --checksum: print CRC32Cs, not contents */
    int partition;
    int subpartition;
    char *imagefile;
@@ -115,21 +163,245 @@ struct minOptions {
    char *fullPath;
 };
 
-struct minixConfig {
-   FILE *image;
+/* Readahead for one file being read in order: the kernel is asked for
+ * the image ranges under its extents up to the filesystem's readahead
+ * window past what has been consumed
+ */
+struct readAhead {
+   struct minfs *fs;
+   struct extent *extents;
+   int numExtents;
+   int next;                     /* the first extent not wholly asked for */
+   uint64_t advised;             /* file offset asked for up to */
+};
+
+/* A directory being read a window of entries at a time, by dirNext */
+struct dirIter {
+   struct minfs *fs;
+   struct inode dir;
+   uint64_t offset;              /* where the next window starts */
+   struct fileEntry *window;
+   struct inode *inodes;         /* the inode of each live entry in window */
+   uint64_t *order;              /* inode << 32 | entry, for sorting */
+   int windowEntries;            /* entries a window holds */
+   int count;                    /* entries in the window now */
+   int next;                     /* the next one to hand out */
+};
+
+/* Listing output gathered in memory, and written to fd each time it
+ * fills unless fd is -1. Formatting can't fail part way: the first
+ * failure is remembered, and outFlush reports it.
+ */
+struct outBuf {
+   char *data;
+   size_t len;
+   size_t max;
+   int fd;
+   int format;             /* FORMAT_TEXT, FORMAT_JSON and so on */
+   uint64_t entries;       /* entries formatted, for JSON separators */
+   int failed;             /* something couldn't be formatted or written */
+};
+
+/* A run of physically adjacent zones in a file, or a run of holes */
+struct extent {
+   uint64_t offset;     /* logical byte offset in the file */
+   uint64_t length;     /* bytes in the run, trimmed to the file size */
+   uint32_t zone;       /* first zone of the run, 0 for a hole */
+};
+
+/* the phases a run's time is split into, for --stats */
+enum minPhase {
+   PHASE_OPEN,          /* opening and mapping the image */
+   PHASE_PARTITION,     /* reading partition tables */
+   PHASE_SUPERBLOCK,    /* reading and checking the superblock */
+   PHASE_INODES,        /* reading inode-table blocks */
+   PHASE_TRAVERSE,      /* resolving paths and walking directories */
+   PHASE_COPY,          /* copying file data out */
+   PHASE_OUTPUT,        /* formatting and writing listings and attributes */
+   PHASE_INDEX,         /* checking, building and mapping a sidecar index */
+   NUM_PHASES
+};
+
+/* bumps one of a filesystem's I/O counters; workers may be counting at
+   the same time */
+#define COUNT(fs, field, n) \
+   __atomic_add_fetch(&(fs)->stats.field, (n), __ATOMIC_RELAXED)
+
+/* I/O counters kept for each open filesystem */
+struct ioStats {
+   uint64_t syscalls;   /* reads, kernel copies and writes issued */
+   uint64_t bytes;      /* bytes moved out of the image */
+   uint64_t zones;      /* zones resolved into extents, holes included */
+   uint64_t extents;    /* extents those zones coalesced into */
+   uint64_t holes;      /* hole bytes skipped rather than written out */
+   uint64_t metaBlocks; /* superblock, partition, inode and pointer blocks */
+   uint64_t dataBlocks; /* blocks of file and directory contents */
+   uint64_t cacheHits;  /* metadata blocks found in the cache */
+   uint64_t cacheMisses;/* metadata blocks read from the image */
+   uint64_t indexHits;  /* lookups, zone lists and directories indexed */
+   uint64_t frames;     /* frames of a compressed image inflated */
+   uint64_t phaseNanos[NUM_PHASES]; /* time spent in each phase, less
+                                       phases within it; phases run by
+                                       several threads add up */
+};
+
+/* what the caches hold, private to minCommon.c */
+struct metaBlock;
+struct dirIndex;
+
+/* access points into a compressed image, private to minGzip.c */
+struct gzImage;
+
+/* An open Minix filesystem: the image, the partition window within it,
+ * the filesystem's geometry, and its caches. One process may have several
+ * open, and every call taking one is safe from several threads at once.
+ * Calls report failure by return value, and minfsError() then says what
+ * went wrong on the calling thread.
+ */
+struct minfs {
+   int fd;                       /* the image, or the spool file for it */
+   unsigned char *base;          /* the whole image, mapped read-only,
+                                    unless it is compressed */
+   struct gzImage *gz;           /* how to read it if it is */
+   uint64_t imageSize;
+   struct timespec imageMtime;   /* when the image file last changed */
+   uint64_t partitionOffset;     /* the filesystem's window in the image */
+   uint64_t partitionSize;
    struct superblock sb;
-   unsigned int zone_size;
+   uint32_t zoneSize;
+   uint32_t blockSize;
+   uint32_t numInodes;
+   uint64_t inodeTableOffset;
+   int inodesPerBlock;
+   struct inode *iTable;         /* the whole inode table, if read eagerly */
+   unsigned char *index;         /* the sidecar index, if one is in use */
+   uint64_t indexSize;
+   uint8_t *bitmaps[2];          /* bitmaps read out of a compressed image */
+   uint64_t readahead;           /* bytes of a file to ask for ahead */
+
+   /* inode-table blocks and indirect zone tables, evicted CLOCK-wise */
+   struct metaBlock *metaCache;
+   int metaCacheSlots;
+   int metaCacheBuckets;         /* a power of two */
+   int *metaBuckets;             /* slot + 1 heading each chain */
+   int metaClock;
+   pthread_mutex_t metaCacheLock;
+   pthread_cond_t metaCacheReady;
+
+   /* directories indexed for lookups, in LRU order */
+   struct dirIndex *dirCache[DIR_CACHE_BUCKETS];
+   struct dirIndex *dirCacheNewest;
+   struct dirIndex *dirCacheOldest;
+   uint64_t dirCacheBytes;
+   pthread_mutex_t dirCacheLock;
+
+   struct ioStats stats;
+};
+
+/* A filesystem found in an image's partition tables, or an entry in
+ * them that looked like it should hold one but can't be used
+ */
+struct minPart {
+   int partition;                /* INVALID_OPTION if not partitioned */
+   int subpartition;             /* INVALID_OPTION if not a subpartition */
+   uint64_t offset;              /* its window in the image */
+   uint64_t size;
+   char problem[128];            /* what is wrong with it, "" if nothing */
 };
 
+/* a pool of worker threads that steal tasks from each other */
+struct taskPool;
+typedef void (*taskFunc)(struct taskPool *pool, void *task);
+
+/* called once per zone of a file; data is NULL for a hole */
+typedef void (*zoneVisitor)(void *data, uint32_t len, void *arg);
+/* called once per zone of a file with its zone number, 0 for a hole;
+   returns 0 to go on, or -1 to stop the walk */
+typedef int (*zoneNumVisitor)(uint32_t zoneNum, uint32_t len, void *arg);
+
 void parseArgs(int argc, char *const argv[], struct minOptions *options);
-void getMinixConfig(struct minOptions options, struct minixConfig *config);
-void setPartitionOffset(FILE *image, int partitionNum);
-void setSubpartitionOffset(FILE *image, int partitionNum);
-void setOffset(FILE *image, int partitionNum, int isSub);
-struct inode traversePath(struct inode *root, 
-                          unsigned int ninodes, 
-                          char *path);
-struct fileEntry *getFileEntries(struct inode directory);
-void *getInode(int inodeNum);
-void *copyZones(struct inode file);
-size_t fseekPartition(FILE *stream, long int offset, int whence);
\ No newline at end of file
+int minfsOpen(struct minfs *fs, const char *imagefile, int partition,
+              int subpartition, int eager);
+int minfsOpenPart(struct minfs *fs, const char *imagefile,
+                  struct minPart *part, int eager);
+int findPartitions(const char *imagefile, struct minPart **parts);
+struct minPart *eachPartition(struct minOptions *options, int format);
+void nameIndex(struct minOptions *options);
+void minfsClose(struct minfs *fs);
+const char *minfsError(void);
+void setError(const char *format, ...);
+int minfsUseIndex(struct minfs *fs, const char *indexFile);
+void closeIndex(struct minfs *fs);
+uint32_t lookupIndex(struct minfs *fs, const char *path);
+int indexExtents(struct minfs *fs, struct inode *in, struct extent **extents);
+void *indexContents(struct minfs *fs, struct inode *in);
+int indexRead(struct minfs *fs, struct inode *in, uint64_t offset, void *buf,
+              uint64_t len);
+int traversePath(struct minfs *fs, const char *path, struct inode *found);
+int64_t lookupPath(struct minfs *fs, const char *path);
+struct fileEntry *getFileEntries(struct minfs *fs, struct inode directory);
+int dirOpen(struct minfs *fs, struct inode directory, struct dirIter *it);
+int dirNext(struct dirIter *it, struct fileEntry **entry, struct inode **in);
+void dirClose(struct dirIter *it);
+int64_t lookupEntry(struct minfs *fs, uint32_t dirNum,
+                    struct inode directory, const char *name);
+void freeDirCache(struct minfs *fs);
+void *getInode(struct minfs *fs, int inodeNum);
+int copyInode(struct minfs *fs, int inodeNum, struct inode *in);
+void *copyZones(struct minfs *fs, struct inode file);
+int walkZones(struct minfs *fs, struct inode file, zoneVisitor visit,
+              void *arg);
+int mapExtents(struct minfs *fs, struct inode file, struct extent **extents);
+int streamFile(struct minfs *fs, struct inode file, int outFd);
+int zoneAt(struct minfs *fs, struct inode file, uint64_t offset,
+           uint32_t *zone);
+int mapRange(struct minfs *fs, struct inode file, uint64_t offset,
+             uint64_t length, struct extent **extents);
+int streamRange(struct minfs *fs, struct inode file, uint64_t offset,
+                uint64_t length, int outFd);
+int writeAll(int fd, const void *buf, uint64_t len);
+int readImage(struct minfs *fs, void *buf, uint64_t offset, uint64_t len);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32cZeros(uint32_t crc, uint64_t len);
+int hashFile(struct minfs *fs, struct inode file, uint32_t *digest);
+void startReadahead(struct readAhead *ra, struct minfs *fs,
+                    struct extent *extents, int numExtents);
+void readAheadTo(struct readAhead *ra, uint64_t offset);
+int openCompressed(struct minfs *fs, int fd, const char *imagefile,
+                   struct stat *st);
+void closeCompressed(struct minfs *fs);
+int readInflated(struct minfs *fs, void *buf, uint64_t offset, uint64_t len);
+uint64_t inflatedSize(struct minfs *fs);
+uint64_t phaseStart(void);
+void phaseEnd(struct minfs *fs, int phase, uint64_t start);
+void countData(struct minfs *fs, uint64_t len);
+void printIoStats(struct minfs *fs, FILE *out, int format);
+void outInit(struct outBuf *out, int fd, int format);
+void outWrite(struct outBuf *out, const void *buf, size_t len);
+void outString(struct outBuf *out, const char *s);
+void outUnsigned(struct outBuf *out, uint64_t n, int width);
+void outAppend(struct outBuf *out, struct outBuf *src);
+int outFlush(struct outBuf *out);
+void outFree(struct outBuf *out);
+void formatPartition(int partition, int subpartition);
+void formatStart(struct outBuf *out);
+void formatEnd(struct outBuf *out);
+void formatDirHeader(struct outBuf *out, const char *path);
+void formatPermissions(char *perms, uint16_t mode);
+void printPermissions(FILE *out, uint16_t mode);
+void formatEntry(struct outBuf *out, struct inode *in, uint32_t inodeNum,
+                 const char *dir, const char *name, int nameLen);
+int formatDirEntries(struct minfs *fs, struct outBuf *out,
+                     struct inode directory, const char *path);
+uint8_t *getBitmap(struct minfs *fs, int which, uint64_t *numBits);
+uint64_t countBits(const uint8_t *map, uint64_t start, uint64_t end);
+uint64_t findRun(const uint8_t *map, uint64_t start, uint64_t end, int set,
+                 uint64_t *len);
+void *zonePtr(struct minfs *fs, uint32_t zoneNum);
+void *partitionPtr(struct minfs *fs, uint64_t offset, uint64_t len);
+struct taskPool *createPool(int threads, taskFunc run);
+void submitTask(struct taskPool *pool, void *task);
+void runPool(struct taskPool *pool);
+void freePool(struct taskPool *pool);
+void runOrdered(int threads, int count, void (*run)(int index, void *arg),
+                void *arg);
\ No newline at end of file
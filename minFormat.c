@@ -0,0 +1,334 @@
+#include "minCommon.h"
+
+/* Listing output. Lines are formatted by hand into one big buffer and
+ * written out a buffer at a time, rather than a handful of stdio calls
+ * per entry. Besides the ls-style text, entries can go out as one JSON
+ * array, as one JSON object per line, or as NUL-terminated paths.
+ */
+
+/* the permission letters for each value of a three-bit rwx field */
+static const char permTriples[8][3] = {
+   "---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx"
+};
+
+/* two decimal digits for each value 0..99 */
+static const char digitPairs[201] =
+   "00010203040506070809101112131415161718192021222324252627282930313233"
+   "34353637383940414243444546474849505152535455565758596061626364656667"
+   "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* the filesystem entries are tagged with under -p all, and whether the
+   JSON array is left to the process merging the listings */
+static int tagPartition = INVALID_OPTION, tagSubpartition = INVALID_OPTION;
+static int merging = 0;
+
+/* Starts an empty buffer, written to fd whenever it fills, or kept
+ * whole in memory if fd is -1
+ */
+void outInit(struct outBuf *out, int fd, int format) {
+   out->data = NULL;
+   out->len = 0;
+   out->max = 0;
+   out->fd = fd;
+   out->format = format;
+   out->entries = 0;
+   out->failed = 0;
+}
+
+/* Makes room for len more bytes, writing out what's there first if the
+ * buffer goes to a descriptor. Returns 0, or -1 if it can't.
+ */
+static int outReserve(struct outBuf *out, size_t len) {
+   if (out->failed) {
+      return -1;
+   }
+   if (out->len + len <= out->max) {
+      return 0;
+   }
+   if (out->fd >= 0 && out->len && outFlush(out)) {
+      return -1;
+   }
+   if (out->len + len > out->max) {
+      /* a buffer kept in memory may be one of many, so starts small */
+      size_t max = out->max ? out->max : out->fd >= 0 ? OUT_BUF_BYTES : 4096;
+      while (max < out->len + len) {
+         max *= 2;
+      }
+      char *data = realloc(out->data, max);
+      if (!data) {
+         setError("Malloc is failing\n");
+         out->failed = 1;
+         return -1;
+      }
+      out->data = data;
+      out->max = max;
+   }
+   return 0;
+}
+
+/* Adds len bytes to the buffer */
+void outWrite(struct outBuf *out, const void *buf, size_t len) {
+   if (!outReserve(out, len)) {
+      memcpy(out->data + out->len, buf, len);
+      out->len += len;
+   }
+}
+
+/* Adds a string to the buffer */
+void outString(struct outBuf *out, const char *s) {
+   outWrite(out, s, strlen(s));
+}
+
+/* Adds n in decimal, right-aligned in width characters */
+void outUnsigned(struct outBuf *out, uint64_t n, int width) {
+   char digits[24];
+   char *start = digits + sizeof(digits);
+
+   while (n >= 100) {
+      start -= 2;
+      memcpy(start, digitPairs + n % 100 * 2, 2);
+      n /= 100;
+   }
+   if (n >= 10) {
+      start -= 2;
+      memcpy(start, digitPairs + n * 2, 2);
+   }
+   else {
+      *--start = '0' + n;
+   }
+   while (digits + sizeof(digits) - start < width && start > digits) {
+      *--start = ' ';
+   }
+   outWrite(out, start, digits + sizeof(digits) - start);
+}
+
+/* Adds len bytes of s as a quoted JSON string. Bytes that aren't ASCII
+ * go through as they are.
+ */
+static void outJsonString(struct outBuf *out, const char *s, size_t len) {
+   size_t i;
+
+   if (outReserve(out, len * 6 + 2)) {
+      return;
+   }
+   char *dst = out->data + out->len;
+   *dst++ = '"';
+   for (i = 0; i < len; i++) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\') {
+         *dst++ = '\\';
+         *dst++ = c;
+      }
+      else if (c < 0x20) {
+         dst += sprintf(dst, "\\u%04x", c);
+      }
+      else {
+         *dst++ = c;
+      }
+   }
+   *dst++ = '"';
+   out->len = dst - out->data;
+}
+
+/* Adds the whole of src to the end of out, separating JSON entries */
+void outAppend(struct outBuf *out, struct outBuf *src) {
+   if (out->format == FORMAT_JSON && out->entries && src->entries) {
+      outWrite(out, ",\n", 2);
+   }
+   outWrite(out, src->data, src->len);
+   out->entries += src->entries;
+   if (src->failed) {
+      out->failed = 1;
+   }
+}
+
+/* Writes out whatever the buffer holds, if it goes to a descriptor.
+ * Returns 0, or -1 if anything couldn't be formatted or written.
+ */
+int outFlush(struct outBuf *out) {
+   if (out->failed) {
+      return -1;
+   }
+   if (out->fd >= 0 && out->len) {
+      if (writeAll(out->fd, out->data, out->len)) {
+         setError("error writing output (%d)\n", errno);
+         out->failed = 1;
+         return -1;
+      }
+      out->len = 0;
+   }
+   return 0;
+}
+
+/* Frees a buffer's memory, without writing anything out */
+void outFree(struct outBuf *out) {
+   free(out->data);
+   out->data = NULL;
+   out->len = out->max = 0;
+}
+
+/* Marks this process's listing as one of several being merged (-p all):
+ * JSON entries say which filesystem they are from, and the array they
+ * go in is opened and closed by whoever merges them
+ */
+void formatPartition(int partition, int subpartition) {
+   tagPartition = partition;
+   tagSubpartition = subpartition;
+   merging = 1;
+}
+
+/* Starts a listing: opens the array, for FORMAT_JSON */
+void formatStart(struct outBuf *out) {
+   if (out->format == FORMAT_JSON && !merging) {
+      outWrite(out, "[\n", 2);
+   }
+}
+
+/* Ends a listing: closes the array, for FORMAT_JSON */
+void formatEnd(struct outBuf *out) {
+   if (out->format == FORMAT_JSON && !merging) {
+      outString(out, out->entries ? "\n]\n" : "]\n");
+   }
+}
+
+/* Heads a directory's entries with its path, in the text listing only */
+void formatDirHeader(struct outBuf *out, const char *path) {
+   if (out->format == FORMAT_TEXT) {
+      outString(out, path);
+      outWrite(out, ":\n", 2);
+   }
+}
+
+/* Fills in the ten-character permission string for a mode */
+void formatPermissions(char *perms, uint16_t mode) {
+   perms[0] = MIN_ISDIR(mode) ? 'd' : '-';
+   memcpy(perms + 1, permTriples[(mode >> 6) & 7], 3);
+   memcpy(perms + 4, permTriples[(mode >> 3) & 7], 3);
+   memcpy(perms + 7, permTriples[mode & 7], 3);
+}
+
+/* Prints the permission string for a mode */
+void printPermissions(FILE *out, uint16_t mode) {
+   char perms[10];
+   formatPermissions(perms, mode);
+   fwrite(perms, 1, sizeof(perms), out);
+}
+
+/* Adds one entry to a listing. The text listing gets a line with its
+ * permissions, size and name; the others get the whole path (dir/name,
+ * or just name if dir is NULL) and, for JSON, the inode's attributes.
+ * The name is at most nameLen bytes and need not be terminated. The
+ * machine-readable formats leave out . and .. entries.
+ */
+void formatEntry(struct outBuf *out, struct inode *in, uint32_t inodeNum,
+                 const char *dir, const char *name, int nameLen) {
+   size_t len = strnlen(name, nameLen);
+   char perms[10];
+
+   formatPermissions(perms, in->mode);
+   if (out->format == FORMAT_TEXT) {
+      outWrite(out, perms, sizeof(perms));
+      outUnsigned(out, in->size, 10);
+      outWrite(out, " ", 1);
+      outWrite(out, name, len);
+      outWrite(out, "\n", 1);
+      out->entries++;
+      return;
+   }
+   if ((len == 1 && name[0] == '.') ||
+       (len == 2 && name[0] == '.' && name[1] == '.')) {
+      return;
+   }
+
+   /* the whole path, and the name within it */
+   char path[PATH_MAX + DIRSIZ + 2];
+   size_t pathLen = 0;
+   if (dir) {
+      pathLen = strlen(dir);
+      if (pathLen > PATH_MAX) {
+         pathLen = PATH_MAX;
+      }
+      memcpy(path, dir, pathLen);
+      if (!pathLen || path[pathLen - 1] != '/') {
+         path[pathLen++] = '/';
+      }
+   }
+   if (len > sizeof(path) - pathLen) {
+      len = sizeof(path) - pathLen;
+   }
+   memcpy(path + pathLen, name, len);
+   pathLen += len;
+   const char *base = path + pathLen;
+   while (base > path && base[-1] != '/') {
+      base--;
+   }
+
+   if (out->format == FORMAT_NUL) {
+      outWrite(out, path, pathLen);
+      outWrite(out, "", 1);
+      out->entries++;
+      return;
+   }
+
+   if (out->format == FORMAT_JSON && out->entries) {
+      outWrite(out, ",\n", 2);
+   }
+   outString(out, "{\"path\":");
+   outJsonString(out, path, pathLen);
+   outString(out, ",\"name\":");
+   outJsonString(out, base, path + pathLen - base);
+   outString(out, ",\"inode\":");
+   outUnsigned(out, inodeNum, 0);
+   outString(out, MIN_ISDIR(in->mode) ? ",\"type\":\"directory\"" :
+                  MIN_ISREG(in->mode) ? ",\"type\":\"file\"" :
+                  ",\"type\":\"other\"");
+   outString(out, ",\"mode\":");
+   outUnsigned(out, in->mode, 0);
+   outString(out, ",\"perms\":\"");
+   outWrite(out, perms, sizeof(perms));
+   outString(out, "\",\"links\":");
+   outUnsigned(out, in->links, 0);
+   outString(out, ",\"uid\":");
+   outUnsigned(out, in->uid, 0);
+   outString(out, ",\"gid\":");
+   outUnsigned(out, in->gid, 0);
+   outString(out, ",\"size\":");
+   outUnsigned(out, in->size, 0);
+   outString(out, ",\"mtime\":");
+   outUnsigned(out, in->mtime, 0);
+   if (tagPartition >= 0) {
+      outString(out, ",\"partition\":");
+      outUnsigned(out, tagPartition, 0);
+   }
+   if (tagSubpartition >= 0) {
+      outString(out, ",\"subpartition\":");
+      outUnsigned(out, tagSubpartition, 0);
+   }
+   outWrite(out, "}", 1);
+   if (out->format == FORMAT_NDJSON) {
+      outWrite(out, "\n", 1);
+   }
+   out->entries++;
+}
+
+/* Adds an entry for each live entry of the directory at path, in
+ * directory order (an entry with inode zero is a deleted file), reading
+ * the directory a window at a time.
+ * Returns 0, or -1 if the directory can't be read.
+ */
+int formatDirEntries(struct minfs *fs, struct outBuf *out,
+                     struct inode directory, const char *path) {
+   struct fileEntry *entry;
+   struct inode *in;
+   struct dirIter it;
+   int ret;
+
+   if (dirOpen(fs, directory, &it)) {
+      return -1;
+   }
+   while ((ret = dirNext(&it, &entry, &in)) > 0) {
+      formatEntry(out, in, entry->inode, path, entry->name, DIRSIZ);
+   }
+   dirClose(&it);
+   return ret;
+}
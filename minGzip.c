@@ -0,0 +1,599 @@
+#include "minCommon.h"
+#include <zlib.h>
+
+/* Random access into gzip-compressed images. One pass over the
+ * compressed file finds access points: the start of every gzip member,
+ * and a deflate block boundary every GZ_SPAN bytes of output, with the
+ * 32K of history inflate needs to restart there. The bytes between one
+ * access point and the next make a frame. A read only inflates the
+ * frames it covers, and recently used frames are kept in a bounded
+ * cache. The access points are saved next to the image (as
+ * imagefile.gzi) so later opens can skip the pass.
+ */
+
+#define GZ_SPAN (1 << 20)        /* output between access points */
+#define GZ_WINDOW 32768          /* history a restart needs */
+#define GZ_CHUNK 65536           /* compressed bytes read at a time */
+#define GZ_CACHE_BYTES (32 << 20) /* memory the frame cache may hold */
+#define GZ_CACHE_MIN 4           /* frames kept at the least */
+#define GZI_MAGIC "MINGZI1"
+#define GZI_SUFFIX ".gzi"
+
+/* a place inflate can restart from */
+struct gzPoint {
+   uint64_t out;                 /* offset in the uncompressed image */
+   uint64_t in;                  /* offset in the compressed file */
+   int32_t bits;                 /* bits of the byte before in still unused */
+   int32_t member;               /* a gzip member starts here, no history */
+   uint64_t window;              /* offset of its history in windows */
+};
+
+/* a frame in the cache */
+struct gzFrame {
+   uint64_t point;               /* the frame's first access point */
+   unsigned char *data;          /* NULL while the slot is empty */
+   uint64_t len;
+   int refs;                     /* readers still copying out of data */
+   int referenced;               /* used since the clock hand last passed */
+   int ready;                    /* 0 while it is still being inflated */
+   int own;                      /* not in the cache, freed by putFrame */
+};
+
+struct gzImage {
+   int fd;                       /* the compressed file */
+   uint64_t size;                /* bytes once uncompressed */
+   struct gzPoint *points;
+   uint64_t numPoints;
+   unsigned char *windows;
+   uint64_t numWindows;
+   void *saved;                  /* the .gzi file, if loaded from one */
+   uint64_t savedSize;
+
+   struct gzFrame *frames;
+   int numFrames;
+   int clock;
+   pthread_mutex_t lock;
+   pthread_cond_t frameReady;    /* some frame finished inflating */
+};
+
+/* the head of a .gzi file */
+struct gziHeader {
+   char magic[8];
+   uint64_t compressedSize;      /* what it was built from */
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint64_t size;
+   uint64_t numPoints;
+   uint64_t numWindows;
+};
+
+/* Reads up to len bytes of the compressed file at offset, counting the
+ * read. Returns bytes read, or -1.
+ */
+static ssize_t readCompressed(struct minfs *fs, void *buf, uint64_t len,
+                              uint64_t offset) {
+   ssize_t got;
+   do {
+      got = pread(fs->gz->fd, buf, len, offset);
+      COUNT(fs, syscalls, 1);
+   } while (got < 0 && errno == EINTR);
+   if (got < 0) {
+      setError("error reading file (%d)\n", errno);
+   }
+   return got;
+}
+
+/* Adds an access point, with the last GZ_WINDOW bytes of output (held
+ * in a circular buffer whose next free byte is at free) unless a member
+ * starts there. Returns 0, or -1.
+ */
+static int addPoint(struct gzImage *gz, uint64_t *maxPoints, uint64_t out,
+                    uint64_t in, int bits, int member,
+                    unsigned char *window, uint32_t free) {
+   struct gzPoint *point;
+
+   if (gz->numPoints == *maxPoints) {
+      *maxPoints = *maxPoints ? *maxPoints * 2 : 64;
+      gz->points = realloc(gz->points, *maxPoints * sizeof(struct gzPoint));
+      if (!gz->points) {
+         setError("Malloc is failing\n");
+         return -1;
+      }
+   }
+   point = gz->points + gz->numPoints++;
+   point->out = out;
+   point->in = in;
+   point->bits = bits;
+   point->member = member;
+   point->window = UINT64_MAX;
+   if (member) {
+      return 0;
+   }
+
+   gz->windows = realloc(gz->windows, (gz->numWindows + 1) * GZ_WINDOW);
+   if (!gz->windows) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   point->window = gz->numWindows++ * GZ_WINDOW;
+   memcpy(gz->windows + point->window, window + free, GZ_WINDOW - free);
+   memcpy(gz->windows + point->window + GZ_WINDOW - free, window, free);
+   return 0;
+}
+
+/* Inflates the whole compressed file once, noting access points as it
+ * goes. Anything after the last gzip member is ignored. Returns 0, or -1.
+ */
+static int findPoints(struct minfs *fs) {
+   struct gzImage *gz = fs->gz;
+   unsigned char *input = malloc(GZ_CHUNK);
+   unsigned char *window = calloc(1, GZ_WINDOW);
+   uint64_t totalIn = 0, totalOut = 0, last = 0, inPos = 0, maxPoints = 0;
+   z_stream strm;
+   int ret = Z_OK;
+
+   memset(&strm, 0, sizeof(strm));
+   if (!input || !window || inflateInit2(&strm, 15 + 16) != Z_OK) {
+      setError("Malloc is failing\n");
+      free(input);
+      free(window);
+      return -1;
+   }
+   if (addPoint(gz, &maxPoints, 0, 0, 0, 1, NULL, 0)) {
+      goto fail;
+   }
+
+   for (;;) {
+      if (!strm.avail_in) {
+         ssize_t got = readCompressed(fs, input, GZ_CHUNK, inPos);
+         if (got < 0) {
+            goto fail;
+         }
+         if (!got) {
+            if (ret == Z_STREAM_END) {
+               break;
+            }
+            setError("Compressed image is truncated\n");
+            goto fail;
+         }
+         inPos += got;
+         strm.next_in = input;
+         strm.avail_in = got;
+      }
+      if (ret == Z_STREAM_END) {
+         /* another member, or trailing junk to ignore */
+         if (strm.next_in[0] != 0x1f) {
+            break;
+         }
+         inflateReset(&strm);
+         if (addPoint(gz, &maxPoints, totalOut, totalIn, 0, 1, NULL, 0)) {
+            goto fail;
+         }
+         last = totalOut;
+      }
+      if (!strm.avail_out) {
+         strm.avail_out = GZ_WINDOW;
+         strm.next_out = window;
+      }
+
+      totalIn += strm.avail_in;
+      totalOut += strm.avail_out;
+      ret = inflate(&strm, Z_BLOCK);
+      totalIn -= strm.avail_in;
+      totalOut -= strm.avail_out;
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+         setError("Compressed image is damaged (%d)\n", ret);
+         goto fail;
+      }
+
+      /* at the end of a deflate block that isn't the last one */
+      if (ret != Z_STREAM_END && (strm.data_type & 128) &&
+          !(strm.data_type & 64) && totalOut - last > GZ_SPAN) {
+         if (addPoint(gz, &maxPoints, totalOut, totalIn, strm.data_type & 7,
+                      0, window, GZ_WINDOW - strm.avail_out)) {
+            goto fail;
+         }
+         last = totalOut;
+      }
+   }
+
+   inflateEnd(&strm);
+   free(input);
+   free(window);
+   gz->size = totalOut;
+   return 0;
+
+fail:
+   inflateEnd(&strm);
+   free(input);
+   free(window);
+   return -1;
+}
+
+/* Loads access points saved by an earlier open, if they were saved from
+ * this compressed file as it is now. Returns 0, or -1.
+ */
+static int loadPoints(struct gzImage *gz, const char *gziName,
+                      struct gziHeader *expect) {
+   struct gziHeader *header;
+   struct stat st;
+   int fd = open(gziName, O_RDONLY);
+
+   if (fd < 0) {
+      return -1;
+   }
+   if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct gziHeader)) {
+      close(fd);
+      return -1;
+   }
+   gz->saved = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (gz->saved == MAP_FAILED) {
+      gz->saved = NULL;
+      return -1;
+   }
+   gz->savedSize = st.st_size;
+
+   header = gz->saved;
+   if (memcmp(header->magic, GZI_MAGIC, sizeof(header->magic)) ||
+       header->compressedSize != expect->compressedSize ||
+       header->mtimeSec != expect->mtimeSec ||
+       header->mtimeNsec != expect->mtimeNsec || !header->numPoints ||
+       sizeof(struct gziHeader) + header->numPoints * sizeof(struct gzPoint) +
+       header->numWindows * GZ_WINDOW != st.st_size) {
+      munmap(gz->saved, gz->savedSize);
+      gz->saved = NULL;
+      return -1;
+   }
+   gz->size = header->size;
+   gz->numPoints = header->numPoints;
+   gz->numWindows = header->numWindows;
+   gz->points = (struct gzPoint *)(header + 1);
+   gz->windows = (unsigned char *)(gz->points + gz->numPoints);
+   return 0;
+}
+
+/* Saves the access points next to the image for later opens. This is
+ * only a shortcut, so failing to is not an error.
+ */
+static void savePoints(struct gzImage *gz, const char *gziName,
+                       struct gziHeader *header) {
+   char *tmpName;
+   int fd, failed;
+
+   if (asprintf(&tmpName, "%s.%d.tmp", gziName, (int)getpid()) < 0) {
+      return;
+   }
+   fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      free(tmpName);
+      return;
+   }
+   header->size = gz->size;
+   header->numPoints = gz->numPoints;
+   header->numWindows = gz->numWindows;
+   failed = writeAll(fd, header, sizeof(struct gziHeader)) ||
+            writeAll(fd, gz->points, gz->numPoints * sizeof(struct gzPoint)) ||
+            writeAll(fd, gz->windows, gz->numWindows * GZ_WINDOW);
+   failed |= close(fd) < 0;
+   if (failed || rename(tmpName, gziName) < 0) {
+      unlink(tmpName);
+   }
+   free(tmpName);
+}
+
+/* Sets up random access into an image if fd holds a gzip file, taking
+ * fd over. The compressed file's own stat is st, and imagefile its name
+ * ("-" for one that has been spooled, whose access points aren't saved).
+ * Returns 1 if the image is compressed, 0 if it isn't, or -1.
+ */
+int openCompressed(struct minfs *fs, int fd, const char *imagefile,
+                   struct stat *st) {
+   struct gziHeader expect;
+   unsigned char magic[2];
+   char *gziName = NULL;
+   uint64_t maxLen = 0, i;
+   struct gzImage *gz;
+
+   if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+       magic[0] != 0x1f || magic[1] != 0x8b) {
+      return 0;
+   }
+
+   gz = calloc(1, sizeof(struct gzImage));
+   if (!gz) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   gz->fd = fd;
+   pthread_mutex_init(&gz->lock, NULL);
+   pthread_cond_init(&gz->frameReady, NULL);
+   fs->gz = gz;
+
+   memset(&expect, 0, sizeof(expect));
+   memcpy(expect.magic, GZI_MAGIC, sizeof(expect.magic));
+   expect.compressedSize = st->st_size;
+   expect.mtimeSec = st->st_mtim.tv_sec;
+   expect.mtimeNsec = st->st_mtim.tv_nsec;
+   if (strcmp(imagefile, "-") &&
+       asprintf(&gziName, "%s%s", imagefile, GZI_SUFFIX) < 0) {
+      gziName = NULL;
+   }
+   if (!gziName || loadPoints(gz, gziName, &expect)) {
+      if (findPoints(fs)) {
+         free(gziName);
+         return -1;
+      }
+      if (gziName) {
+         savePoints(gz, gziName, &expect);
+      }
+   }
+   free(gziName);
+
+   /* as many frames as fit in the cache's budget */
+   for (i = 0; i < gz->numPoints; i++) {
+      uint64_t end = i + 1 < gz->numPoints ? gz->points[i + 1].out : gz->size;
+      if (end - gz->points[i].out > maxLen) {
+         maxLen = end - gz->points[i].out;
+      }
+   }
+   gz->numFrames = maxLen ? GZ_CACHE_BYTES / maxLen : GZ_CACHE_MIN;
+   if (gz->numFrames < GZ_CACHE_MIN) {
+      gz->numFrames = GZ_CACHE_MIN;
+   }
+   gz->frames = calloc(gz->numFrames, sizeof(struct gzFrame));
+   if (!gz->frames) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   return 1;
+}
+
+/* Frees what openCompressed set up, if anything */
+void closeCompressed(struct minfs *fs) {
+   struct gzImage *gz = fs->gz;
+   int i;
+
+   if (!gz) {
+      return;
+   }
+   for (i = 0; gz->frames && i < gz->numFrames; i++) {
+      free(gz->frames[i].data);
+   }
+   free(gz->frames);
+   if (gz->saved) {
+      munmap(gz->saved, gz->savedSize);
+   }
+   else {
+      free(gz->points);
+      free(gz->windows);
+   }
+   pthread_mutex_destroy(&gz->lock);
+   pthread_cond_destroy(&gz->frameReady);
+   free(gz);
+   fs->gz = NULL;
+}
+
+/* Inflates the frame starting at the given access point into data,
+ * which has room for exactly len bytes. Returns 0, or -1.
+ */
+static int inflateFrame(struct minfs *fs, uint64_t pointIdx,
+                        unsigned char *data, uint64_t len) {
+   struct gzPoint *point = fs->gz->points + pointIdx;
+   unsigned char *input = malloc(GZ_CHUNK);
+   uint64_t inPos = point->in;
+   z_stream strm;
+   int ret = Z_OK;
+
+   memset(&strm, 0, sizeof(strm));
+   if (!input || inflateInit2(&strm, point->member ? 15 + 16 : -15) != Z_OK) {
+      setError("Malloc is failing\n");
+      free(input);
+      return -1;
+   }
+
+   /* a restart mid-member picks up the bits left in the byte before,
+      and the history */
+   if (!point->member) {
+      if (point->bits) {
+         unsigned char byte;
+         if (readCompressed(fs, &byte, 1, --inPos) != 1) {
+            goto fail;
+         }
+         inPos++;
+         inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+      }
+      inflateSetDictionary(&strm, fs->gz->windows + point->window, GZ_WINDOW);
+   }
+
+   strm.next_out = data;
+   strm.avail_out = len;
+   while (strm.avail_out && ret != Z_STREAM_END) {
+      if (!strm.avail_in) {
+         ssize_t got = readCompressed(fs, input, GZ_CHUNK, inPos);
+         if (got <= 0) {
+            if (!got) {
+               setError("Compressed image is truncated\n");
+            }
+            goto fail;
+         }
+         inPos += got;
+         strm.next_in = input;
+         strm.avail_in = got;
+      }
+      ret = inflate(&strm, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+         setError("Compressed image is damaged (%d)\n", ret);
+         goto fail;
+      }
+   }
+   if (strm.avail_out) {
+      setError("Compressed image is truncated\n");
+      goto fail;
+   }
+   inflateEnd(&strm);
+   free(input);
+   COUNT(fs, frames, 1);
+   return 0;
+
+fail:
+   inflateEnd(&strm);
+   free(input);
+   return -1;
+}
+
+/* Returns the frame starting at the given access point from the cache,
+ * inflating it first if it isn't there, with a reference held until
+ * putFrame. Returns NULL if it can't be inflated. The slot is claimed
+ * before inflating, so readers missing on the same frame wait for the
+ * one inflate rather than each doing their own.
+ */
+static struct gzFrame *getFrame(struct minfs *fs, uint64_t pointIdx) {
+   struct gzImage *gz = fs->gz;
+   uint64_t end = pointIdx + 1 < gz->numPoints ?
+                  gz->points[pointIdx + 1].out : gz->size;
+   uint64_t len = end - gz->points[pointIdx].out;
+   struct gzFrame *frame;
+   unsigned char *data;
+   int i, sweeps, failed;
+
+   pthread_mutex_lock(&gz->lock);
+   for (i = 0; i < gz->numFrames; i++) {
+      frame = gz->frames + i;
+      if (frame->data && frame->point == pointIdx) {
+         frame->refs++;
+         frame->referenced = 1;
+         while (!frame->ready) {
+            pthread_cond_wait(&gz->frameReady, &gz->lock);
+         }
+         if (!frame->data) {
+            /* the inflate this was waiting on failed */
+            frame->refs--;
+            pthread_mutex_unlock(&gz->lock);
+            setError("error reading file (%d)\n", EIO);
+            return NULL;
+         }
+         pthread_mutex_unlock(&gz->lock);
+         return frame;
+      }
+   }
+
+   /* a slot for it: the first unreferenced, unused one past the hand */
+   for (sweeps = 0; sweeps < 2 * gz->numFrames + 1; sweeps++) {
+      frame = gz->frames + gz->clock;
+      gz->clock = (gz->clock + 1) % gz->numFrames;
+      if (frame->refs) {
+         continue;
+      }
+      if (frame->referenced) {
+         frame->referenced = 0;
+         continue;
+      }
+      free(frame->data);
+      frame->data = malloc(len ? len : 1);
+      if (!frame->data) {
+         pthread_mutex_unlock(&gz->lock);
+         setError("Malloc is failing\n");
+         return NULL;
+      }
+      frame->point = pointIdx;
+      frame->len = len;
+      frame->refs = 1;
+      frame->referenced = 1;
+      frame->ready = 0;
+      pthread_mutex_unlock(&gz->lock);
+
+      /* inflate without the lock, so other frames can be read meanwhile */
+      failed = inflateFrame(fs, pointIdx, frame->data, len);
+
+      /* a frame that couldn't be inflated leaves the cache again */
+      pthread_mutex_lock(&gz->lock);
+      frame->ready = 1;
+      if (failed) {
+         free(frame->data);
+         frame->data = NULL;
+         frame->refs--;
+      }
+      pthread_cond_broadcast(&gz->frameReady);
+      pthread_mutex_unlock(&gz->lock);
+      return failed ? NULL : frame;
+   }
+   pthread_mutex_unlock(&gz->lock);
+
+   data = malloc(len ? len : 1);
+   if (!data) {
+      setError("Malloc is failing\n");
+      return NULL;
+   }
+   if (inflateFrame(fs, pointIdx, data, len)) {
+      free(data);
+      return NULL;
+   }
+
+   /* every slot is in use: hand out a frame of its own */
+   frame = calloc(1, sizeof(struct gzFrame));
+   if (!frame) {
+      setError("Malloc is failing\n");
+      free(data);
+      return NULL;
+   }
+   frame->point = pointIdx;
+   frame->data = data;
+   frame->len = len;
+   frame->refs = 1;
+   frame->ready = 1;
+   frame->own = 1;
+   return frame;
+}
+
+/* Lets go of a frame from getFrame */
+static void putFrame(struct gzImage *gz, struct gzFrame *frame) {
+   if (frame->own) {
+      free(frame->data);
+      free(frame);
+      return;
+   }
+   pthread_mutex_lock(&gz->lock);
+   frame->refs--;
+   pthread_mutex_unlock(&gz->lock);
+}
+
+/* Reads len bytes at offset in the uncompressed image into buf,
+ * inflating only the frames they fall in. Returns 0, or -1.
+ */
+int readInflated(struct minfs *fs, void *buf, uint64_t offset, uint64_t len) {
+   struct gzImage *gz = fs->gz;
+   unsigned char *dst = buf;
+
+   while (len) {
+      /* the last access point at or before offset */
+      uint64_t low = 0, high = gz->numPoints;
+      while (high - low > 1) {
+         uint64_t mid = low + (high - low) / 2;
+         if (gz->points[mid].out <= offset) {
+            low = mid;
+         }
+         else {
+            high = mid;
+         }
+      }
+
+      struct gzFrame *frame = getFrame(fs, low);
+      if (!frame) {
+         return -1;
+      }
+      uint64_t skip = offset - gz->points[low].out;
+      uint64_t part = frame->len - skip < len ? frame->len - skip : len;
+      memcpy(dst, frame->data + skip, part);
+      putFrame(gz, frame);
+      dst += part;
+      offset += part;
+      len -= part;
+   }
+   return 0;
+}
+
+/* Returns the size of the uncompressed image */
+uint64_t inflatedSize(struct minfs *fs) {
+   return fs->gz->size;
+}
@@ -0,0 +1,184 @@
+#include "minCommon.h"
+
+/* CRC32C (the Castagnoli polynomial, as in iSCSI and ext4) of files in
+ * an image, computed straight from their zones. Where the CPU has
+ * SSE4.2 its crc32 instruction does the work, on three interleaved
+ * streams so the instructions don't wait on each other; otherwise a
+ * byte table does. Holes are folded in arithmetically: appending n zero
+ * bytes multiplies the CRC register by x^(8n) mod P, so nothing has to
+ * be read or even zeroed for them.
+ */
+
+#define CRC_POLY 0x82f63b78      /* the polynomial, bit-reversed */
+#define CRC_LANE 4096            /* bytes each interleaved stream takes */
+
+static uint32_t crcTable[256];
+static uint32_t x2nTable[32];    /* x^(2^k) mod P */
+static uint32_t laneShift;       /* x^(8 * CRC_LANE) mod P */
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/* Multiplies a and b modulo P, both bit-reversed polynomials */
+static uint32_t multModP(uint32_t a, uint32_t b) {
+   uint32_t m = (uint32_t)1 << 31, p = 0;
+
+   for (;;) {
+      if (a & m) {
+         p ^= b;
+         if (!(a & (m - 1))) {
+            break;
+         }
+      }
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+   }
+   return p;
+}
+
+/* Returns x^(n * 2^k) mod P */
+static uint32_t x2nModP(uint64_t n, int k) {
+   uint32_t p = (uint32_t)1 << 31;        /* x^0 */
+
+   while (n) {
+      if (n & 1) {
+         p = multModP(x2nTable[k & 31], p);
+      }
+      n >>= 1;
+      k++;
+   }
+   return p;
+}
+
+/* Fills in the tables, once */
+static void initCrc(void) {
+   uint32_t p = (uint32_t)1 << 30;        /* x^1 */
+   int i, bit;
+
+   for (i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (bit = 0; bit < 8; bit++) {
+         crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+      }
+      crcTable[i] = crc;
+   }
+   x2nTable[0] = p;
+   for (i = 1; i < 32; i++) {
+      x2nTable[i] = p = multModP(p, p);
+   }
+   laneShift = x2nModP(CRC_LANE, 3);
+}
+
+/* Runs the CRC register over len bytes a byte at a time */
+static uint32_t crcBytes(uint32_t reg, const uint8_t *buf, size_t len) {
+   while (len--) {
+      reg = (reg >> 8) ^ crcTable[(reg ^ *buf++) & 0xff];
+   }
+   return reg;
+}
+
+#if defined(__x86_64__)
+/* Runs the CRC register over len bytes with the crc32 instruction. Long
+ * runs are split into three lanes of CRC_LANE bytes whose registers
+ * are combined afterwards: the register for A then B is A's shifted
+ * past B's length, plus B's started from zero.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crcNative(uint32_t reg, const uint8_t *buf, size_t len) {
+   uint64_t crc0 = reg, crc1, crc2, word[3];
+   size_t i;
+
+   while (len >= 3 * CRC_LANE) {
+      crc1 = crc2 = 0;
+      for (i = 0; i < CRC_LANE; i += 8) {
+         memcpy(&word[0], buf + i, 8);
+         memcpy(&word[1], buf + CRC_LANE + i, 8);
+         memcpy(&word[2], buf + 2 * CRC_LANE + i, 8);
+         crc0 = __builtin_ia32_crc32di(crc0, word[0]);
+         crc1 = __builtin_ia32_crc32di(crc1, word[1]);
+         crc2 = __builtin_ia32_crc32di(crc2, word[2]);
+      }
+      crc0 = multModP(laneShift, crc0) ^ crc1;
+      crc0 = multModP(laneShift, crc0) ^ crc2;
+      buf += 3 * CRC_LANE;
+      len -= 3 * CRC_LANE;
+   }
+   while (len >= 8) {
+      memcpy(&word[0], buf, 8);
+      crc0 = __builtin_ia32_crc32di(crc0, word[0]);
+      buf += 8;
+      len -= 8;
+   }
+   while (len--) {
+      crc0 = __builtin_ia32_crc32qi(crc0, *buf++);
+   }
+   return crc0;
+}
+#endif
+
+/* Extends a CRC32C with len more bytes; start from 0 */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+   pthread_once(&crcOnce, initCrc);
+#if defined(__x86_64__)
+   if (__builtin_cpu_supports("sse4.2")) {
+      return ~crcNative(~crc, buf, len);
+   }
+#endif
+   return ~crcBytes(~crc, buf, len);
+}
+
+/* Extends a CRC32C with len zero bytes, without going through them */
+uint32_t crc32cZeros(uint32_t crc, uint64_t len) {
+   pthread_once(&crcOnce, initCrc);
+   return len ? ~multModP(x2nModP(len, 3), ~crc) : crc;
+}
+
+/* Works out the CRC32C of a file's contents, reading its zones in order
+ * a chunk at a time and folding its holes in without reading anything.
+ * Returns 0, or -1 if the file can't be read.
+ */
+int hashFile(struct minfs *fs, struct inode file, uint32_t *digest) {
+   struct readAhead ra;
+   struct extent *extents;
+   uint32_t crc = 0;
+   int numExtents, i;
+   char *buf;
+
+   numExtents = mapExtents(fs, file, &extents);
+   if (numExtents < 0) {
+      return -1;
+   }
+   buf = malloc(HASH_CHUNK);
+   if (!buf) {
+      setError("Malloc is failing\n");
+      free(extents);
+      return -1;
+   }
+
+   startReadahead(&ra, fs, extents, numExtents);
+   for (i = 0; i < numExtents; i++) {
+      uint64_t done = 0;
+      if (!extents[i].zone) {
+         crc = crc32cZeros(crc, extents[i].length);
+         COUNT(fs, holes, extents[i].length);
+         continue;
+      }
+      while (done < extents[i].length) {
+         uint64_t len = extents[i].length - done;
+         len = len < HASH_CHUNK ? len : HASH_CHUNK;
+         readAheadTo(&ra, extents[i].offset + done);
+         if (readImage(fs, buf,
+                       (uint64_t)extents[i].zone * fs->zoneSize + done,
+                       len)) {
+            free(buf);
+            free(extents);
+            return -1;
+         }
+         countData(fs, len);
+         crc = crc32c(crc, buf, len);
+         done += len;
+      }
+   }
+   free(buf);
+   free(extents);
+   *digest = crc;
+   return 0;
+}
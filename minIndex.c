@@ -0,0 +1,688 @@
+#include "minCommon.h"
+
+/* A sidecar index: everything lookups and extraction need from an
+ * immutable image, worked out once and kept in a file next to it.
+ * It is laid out to be mapped and used in place:
+ *
+ *    header | inode table | records | extents | directory contents |
+ *    path table | path strings
+ *
+ * The inode table is a straight copy of the image's. Each file or
+ * directory reachable from / has a record holding its extents and, for
+ * a directory, a copy of its contents. Records are found by the inode's
+ * first allocated zone, which no other inode can own. The path table is
+ * every reachable path, sorted, for binary search.
+ */
+
+#define INDEX_MAGIC "MINIDX1"
+#define INDEX_VERSION 1
+#define INDEX_ALIGN 8
+
+struct indexHeader {
+   char magic[8];
+   uint32_t version;
+   uint32_t pad;
+   /* what the index was built from, checked before every use */
+   uint64_t imageSize;
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint64_t partitionOffset;
+   uint64_t checksum;            /* of the superblock and both bitmaps */
+   /* where each section starts, and how many items it has */
+   uint64_t inodesOffset;
+   uint64_t numInodes;
+   uint64_t recordsOffset;
+   uint64_t numRecords;
+   uint64_t extentsOffset;
+   uint64_t numExtents;
+   uint64_t contentsOffset;
+   uint64_t contentsSize;
+   uint64_t pathsOffset;
+   uint64_t numPaths;
+   uint64_t stringsOffset;
+   uint64_t stringsSize;
+};
+
+/* one reachable file or directory */
+struct indexRecord {
+   uint32_t key;                 /* its first allocated zone */
+   uint32_t size;                /* to make sure it is the same inode */
+   uint64_t firstExtent;
+   uint64_t numExtents;
+   uint64_t contents;            /* directory contents offset, or -1 */
+};
+
+/* one reachable path */
+struct indexPath {
+   uint64_t name;                /* offset of the NUL-terminated path */
+   uint32_t inodeNum;
+   uint32_t pad;
+};
+
+/* an index being built in memory */
+struct indexBuild {
+   struct minfs *fs;
+   struct indexRecord *records;
+   uint64_t numRecords, maxRecords;
+   struct extent *extents;
+   uint64_t numExtents, maxExtents;
+   unsigned char *contents;
+   uint64_t contentsSize, maxContents;
+   struct { char *path; uint32_t inodeNum; } *paths;
+   uint64_t numPaths, maxPaths;
+   uint64_t stringsSize;
+   uint8_t *recorded;            /* inodes already recorded, one bit each */
+};
+
+/* Makes room for count more items of the given size in a growing array.
+ * Returns 0, or -1.
+ */
+static int reserve(void *arrayPtr, uint64_t used, uint64_t *max,
+                   uint64_t count, size_t size) {
+   void **array = arrayPtr;
+   uint64_t newMax = *max ? *max : 64;
+   void *grown;
+
+   if (used + count <= *max) {
+      return 0;
+   }
+   while (newMax < used + count) {
+      newMax *= 2;
+   }
+   grown = realloc(*array, newMax * size);
+   if (!grown) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   *array = grown;
+   *max = newMax;
+   return 0;
+}
+
+/* The key an inode's record is filed under: its first allocated zone,
+ * or 0 if it has none (and so nothing worth recording)
+ */
+static uint32_t recordKey(struct inode *in) {
+   int i;
+   for (i = 0; i < DIRECT_ZONES; i++) {
+      if (in->zone[i]) {
+         return in->zone[i];
+      }
+   }
+   return in->indirect ? in->indirect : in->two_indirect;
+}
+
+/* FNV-1a over a run of bytes, continuing from hash */
+static uint64_t hashBytes(uint64_t hash, const unsigned char *bytes,
+                          uint64_t len) {
+   while (len--) {
+      hash = (hash ^ *bytes++) * 0x100000001b3ull;
+   }
+   return hash;
+}
+
+/* Checksums the superblock and both bitmaps, which change whenever
+ * anything is allocated or freed. Returns 0, or -1.
+ */
+static int imageChecksum(struct minfs *fs, uint64_t *checksum) {
+   uint64_t hash = 0xcbf29ce484222325ull, bits;
+   uint8_t *inodeMap = getBitmap(fs, INODE_MAP, &bits);
+   uint8_t *zoneMap;
+
+   if (!inodeMap) {
+      return -1;
+   }
+   hash = hashBytes(hash, (unsigned char *)&fs->sb, sizeof(fs->sb));
+   hash = hashBytes(hash, inodeMap, (uint64_t)fs->sb.i_blocks * fs->blockSize);
+   zoneMap = getBitmap(fs, ZONE_MAP, &bits);
+   if (!zoneMap) {
+      return -1;
+   }
+   *checksum = hashBytes(hash, zoneMap,
+                         (uint64_t)fs->sb.z_blocks * fs->blockSize);
+   return 0;
+}
+
+/* Records one inode's extents, and a directory's contents, the first
+ * time it is reached. Returns 0, or -1.
+ */
+static int recordInode(struct indexBuild *build, uint32_t inodeNum,
+                       struct inode *in) {
+   struct minfs *fs = build->fs;
+   struct indexRecord *record;
+   struct extent *extents;
+   uint32_t key = recordKey(in);
+   uint8_t bit = 1 << (inodeNum % 8);
+   int numExtents;
+
+   if (!key || (build->recorded[inodeNum / 8] & bit)) {
+      return 0;
+   }
+   build->recorded[inodeNum / 8] |= bit;
+
+   numExtents = mapExtents(fs, *in, &extents);
+   if (numExtents < 0 ||
+       reserve(&build->records, build->numRecords, &build->maxRecords, 1,
+               sizeof(struct indexRecord)) ||
+       reserve(&build->extents, build->numExtents, &build->maxExtents,
+               numExtents, sizeof(struct extent))) {
+      free(numExtents < 0 ? NULL : extents);
+      return -1;
+   }
+   record = build->records + build->numRecords++;
+   record->key = key;
+   record->size = in->size;
+   record->firstExtent = build->numExtents;
+   record->numExtents = numExtents;
+   record->contents = UINT64_MAX;
+   memcpy(build->extents + build->numExtents, extents,
+          numExtents * sizeof(struct extent));
+   build->numExtents += numExtents;
+   free(extents);
+
+   if (MIN_ISDIR(in->mode)) {
+      void *contents = copyZones(fs, *in);
+      if (!contents ||
+          reserve(&build->contents, build->contentsSize, &build->maxContents,
+                  in->size + INDEX_ALIGN, 1)) {
+         free(contents);
+         return -1;
+      }
+      record->contents = build->contentsSize;
+      memcpy(build->contents + build->contentsSize, contents, in->size);
+      build->contentsSize += (in->size + INDEX_ALIGN - 1) /
+                             INDEX_ALIGN * INDEX_ALIGN;
+      free(contents);
+   }
+   return 0;
+}
+
+/* Adds a path to the table being built. Returns 0, or -1. */
+static int addPath(struct indexBuild *build, const char *path,
+                   uint32_t inodeNum) {
+   if (reserve(&build->paths, build->numPaths, &build->maxPaths, 1,
+               sizeof(*build->paths))) {
+      return -1;
+   }
+   build->paths[build->numPaths].path = strdup(path);
+   if (!build->paths[build->numPaths].path) {
+      setError("Malloc is failing\n");
+      return -1;
+   }
+   build->paths[build->numPaths++].inodeNum = inodeNum;
+   build->stringsSize += strlen(path) + 1;
+   return 0;
+}
+
+/* Walks the tree under a directory, recording every inode it reaches
+ * and every path to one. Each directory is only walked once, so cycles
+ * and extra links to directories end there. Returns 0, or -1.
+ */
+static int indexDir(struct indexBuild *build, uint32_t dirNum,
+                    struct inode *dir, const char *path, uint8_t *walked) {
+   struct minfs *fs = build->fs;
+   struct fileEntry *entries;
+   char childPath[PATH_MAX];
+   struct inode in;
+   int numEntries = dir->size / sizeof(struct fileEntry), i, ret = 0;
+
+   entries = getFileEntries(fs, *dir);
+   if (!entries) {
+      return -1;
+   }
+   for (i = 0; i < numEntries && !ret; i++) {
+      uint32_t inodeNum = entries[i].inode;
+      const char *name = entries[i].name;
+      if (!inodeNum || !strncmp(name, ".", DIRSIZ) ||
+          !strncmp(name, "..", DIRSIZ) || copyInode(fs, inodeNum, &in)) {
+         continue;
+      }
+      if (snprintf(childPath, sizeof(childPath), "%s/%.*s",
+                   strcmp(path, "/") ? path : "", DIRSIZ, name) >=
+          sizeof(childPath)) {
+         continue;               /* too deep to look up anyway */
+      }
+      ret = recordInode(build, inodeNum, &in) ||
+            addPath(build, childPath, inodeNum);
+      if (!ret && MIN_ISDIR(in.mode) &&
+          !(walked[inodeNum / 8] & (1 << (inodeNum % 8)))) {
+         walked[inodeNum / 8] |= 1 << (inodeNum % 8);
+         ret = indexDir(build, inodeNum, &in, childPath, walked);
+      }
+   }
+   free(entries);
+   return ret ? -1 : 0;
+}
+
+/* Orders records by key, for the binary search in findRecord */
+static int compareRecords(const void *a, const void *b) {
+   uint32_t ka = ((struct indexRecord *)a)->key;
+   uint32_t kb = ((struct indexRecord *)b)->key;
+   return ka < kb ? -1 : ka > kb;
+}
+
+/* Orders paths bytewise, for the binary search in lookupIndex */
+static int comparePaths(const void *a, const void *b) {
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Writes len bytes at the current end of a file, padded to INDEX_ALIGN.
+ * Returns 0, or -1.
+ */
+static int writeSection(int fd, const void *buf, uint64_t len,
+                        uint64_t *offset) {
+   static const char zeros[INDEX_ALIGN];
+   uint64_t pad = (INDEX_ALIGN - len % INDEX_ALIGN) % INDEX_ALIGN;
+
+   if (writeAll(fd, buf, len) || writeAll(fd, zeros, pad)) {
+      setError("error writing index (%d)\n", errno);
+      return -1;
+   }
+   *offset += len + pad;
+   return 0;
+}
+
+/* Writes a built index to a temporary file, then renames it into place
+ * so that readers only ever see a whole index. Returns 0, or -1.
+ */
+static int writeIndex(struct indexBuild *build, struct indexHeader *header,
+                      const char *indexFile) {
+   struct indexPath *paths = NULL;
+   char *strings = NULL, *tmpName = NULL;
+   uint64_t offset = 0, i, name = 0;
+   int fd = -1, ret = -1;
+
+   paths = calloc(build->numPaths ? build->numPaths : 1,
+                  sizeof(struct indexPath));
+   strings = malloc(build->stringsSize ? build->stringsSize : 1);
+   if (!paths || !strings ||
+       asprintf(&tmpName, "%s.%d.tmp", indexFile, (int)getpid()) < 0) {
+      setError("Malloc is failing\n");
+      tmpName = NULL;
+      goto done;
+   }
+   for (i = 0; i < build->numPaths; i++) {
+      paths[i].name = name;
+      paths[i].inodeNum = build->paths[i].inodeNum;
+      strcpy(strings + name, build->paths[i].path);
+      name += strlen(build->paths[i].path) + 1;
+   }
+
+   /* lay the sections out one after another */
+   offset = (sizeof(struct indexHeader) + INDEX_ALIGN - 1) /
+            INDEX_ALIGN * INDEX_ALIGN;
+   header->inodesOffset = offset;
+   offset += (uint64_t)build->fs->numInodes * sizeof(struct inode);
+   header->recordsOffset = offset;
+   offset += build->numRecords * sizeof(struct indexRecord);
+   header->extentsOffset = offset;
+   offset += build->numExtents * sizeof(struct extent);
+   header->contentsOffset = offset;
+   offset += build->contentsSize;
+   header->pathsOffset = offset;
+   offset += build->numPaths * sizeof(struct indexPath);
+   header->stringsOffset = offset;
+
+   fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      setError("Failed to create index %s (errno: %d)\n", tmpName, errno);
+      goto done;
+   }
+   offset = 0;
+   if (writeSection(fd, header, sizeof(struct indexHeader), &offset) ||
+       writeSection(fd, build->fs->iTable,
+                    (uint64_t)build->fs->numInodes * sizeof(struct inode),
+                    &offset) ||
+       writeSection(fd, build->records,
+                    build->numRecords * sizeof(struct indexRecord),
+                    &offset) ||
+       writeSection(fd, build->extents,
+                    build->numExtents * sizeof(struct extent), &offset) ||
+       writeSection(fd, build->contents, build->contentsSize, &offset) ||
+       writeSection(fd, paths, build->numPaths * sizeof(struct indexPath),
+                    &offset) ||
+       writeSection(fd, strings, build->stringsSize, &offset)) {
+      goto done;
+   }
+   if (close(fd) < 0) {
+      fd = -1;
+      setError("error writing index (%d)\n", errno);
+      goto done;
+   }
+   fd = -1;
+   if (rename(tmpName, indexFile) < 0) {
+      setError("Failed to create index %s (errno: %d)\n", indexFile, errno);
+      goto done;
+   }
+   ret = 0;
+
+done:
+   if (fd >= 0) {
+      close(fd);
+   }
+   if (ret && tmpName) {
+      unlink(tmpName);
+   }
+   free(tmpName);
+   free(paths);
+   free(strings);
+   return ret;
+}
+
+/* Builds the index for an open filesystem and writes it to indexFile.
+ * Returns 0, or -1.
+ */
+static int buildIndex(struct minfs *fs, struct indexHeader *header,
+                      const char *indexFile) {
+   struct indexBuild build;
+   struct inode root;
+   uint8_t *walked;
+   uint64_t i;
+   int ret = -1;
+
+   memset(&build, 0, sizeof(build));
+   build.fs = fs;
+   build.recorded = calloc(fs->numInodes / 8 + 1, 1);
+   walked = calloc(fs->numInodes / 8 + 1, 1);
+   if (!build.recorded || !walked) {
+      setError("Malloc is failing\n");
+      goto done;
+   }
+
+   /* the whole inode table goes in, so read it in one go */
+   if (!fs->iTable) {
+      uint64_t tableSize = (uint64_t)fs->numInodes * sizeof(struct inode);
+      fs->iTable = malloc(tableSize ? tableSize : 1);
+      if (!fs->iTable) {
+         setError("Malloc is failing\n");
+         goto done;
+      }
+      if (readImage(fs, fs->iTable, fs->inodeTableOffset, tableSize)) {
+         goto done;
+      }
+   }
+
+   if (copyInode(fs, ROOT_INODE, &root) ||
+       recordInode(&build, ROOT_INODE, &root) ||
+       addPath(&build, "/", ROOT_INODE)) {
+      goto done;
+   }
+   if (MIN_ISDIR(root.mode)) {
+      walked[ROOT_INODE / 8] |= 1 << (ROOT_INODE % 8);
+      if (indexDir(&build, ROOT_INODE, &root, "/", walked)) {
+         goto done;
+      }
+   }
+
+   qsort(build.records, build.numRecords, sizeof(struct indexRecord),
+         compareRecords);
+   qsort(build.paths, build.numPaths, sizeof(*build.paths), comparePaths);
+   header->numInodes = fs->numInodes;
+   header->numRecords = build.numRecords;
+   header->numExtents = build.numExtents;
+   header->contentsSize = build.contentsSize;
+   header->numPaths = build.numPaths;
+   header->stringsSize = build.stringsSize;
+   ret = writeIndex(&build, header, indexFile);
+
+done:
+   for (i = 0; i < build.numPaths; i++) {
+      free(build.paths[i].path);
+   }
+   free(build.paths);
+   free(build.records);
+   free(build.extents);
+   free(build.contents);
+   free(build.recorded);
+   free(walked);
+   return ret;
+}
+
+/* Maps an index file and checks that it was built from this image as it
+ * is now and that its sections fit. Returns 0, or -1 if it is missing,
+ * stale or damaged.
+ */
+static int mapIndex(struct minfs *fs, const char *indexFile,
+                    struct indexHeader *expect) {
+   struct indexHeader *header;
+   struct stat st;
+   void *index;
+   int fd = open(indexFile, O_RDONLY);
+
+   if (fd < 0) {
+      setError("Failed to open index %s (errno: %d)\n", indexFile, errno);
+      return -1;
+   }
+   if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct indexHeader)) {
+      setError("Index %s is damaged\n", indexFile);
+      close(fd);
+      return -1;
+   }
+   index = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (index == MAP_FAILED) {
+      setError("Failed to map index %s (errno: %d)\n", indexFile, errno);
+      return -1;
+   }
+
+   header = index;
+   if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) ||
+       header->version != INDEX_VERSION ||
+       header->imageSize != expect->imageSize ||
+       header->mtimeSec != expect->mtimeSec ||
+       header->mtimeNsec != expect->mtimeNsec ||
+       header->partitionOffset != expect->partitionOffset ||
+       header->checksum != expect->checksum) {
+      setError("Index %s is out of date\n", indexFile);
+      munmap(index, st.st_size);
+      return -1;
+   }
+   if (header->numInodes != fs->numInodes ||
+       header->inodesOffset + header->numInodes * sizeof(struct inode) >
+       header->recordsOffset ||
+       header->recordsOffset + header->numRecords *
+       sizeof(struct indexRecord) > header->extentsOffset ||
+       header->extentsOffset + header->numExtents * sizeof(struct extent) >
+       header->contentsOffset ||
+       header->contentsOffset + header->contentsSize > header->pathsOffset ||
+       header->pathsOffset + header->numPaths * sizeof(struct indexPath) >
+       header->stringsOffset ||
+       header->stringsOffset + header->stringsSize > st.st_size ||
+       (header->stringsSize &&
+        ((char *)index)[header->stringsOffset + header->stringsSize - 1])) {
+      setError("Index %s is damaged\n", indexFile);
+      munmap(index, st.st_size);
+      return -1;
+   }
+
+   fs->index = index;
+   fs->indexSize = st.st_size;
+   return 0;
+}
+
+/* Has an open filesystem use the sidecar index in indexFile, first
+ * building it if it is missing or doesn't match the image any more (a
+ * different size or mtime, or a changed superblock or bitmap). While
+ * it is in use, path lookups, inodes, zone lists and directory contents
+ * all come from the index. Returns 0, or -1 with the filesystem still
+ * usable without it.
+ */
+int minfsUseIndex(struct minfs *fs, const char *indexFile) {
+   struct indexHeader expect;
+   uint64_t start = phaseStart();
+
+   memset(&expect, 0, sizeof(expect));
+   memcpy(expect.magic, INDEX_MAGIC, sizeof(expect.magic));
+   expect.version = INDEX_VERSION;
+   expect.imageSize = fs->imageSize;
+   expect.mtimeSec = fs->imageMtime.tv_sec;
+   expect.mtimeNsec = fs->imageMtime.tv_nsec;
+   expect.partitionOffset = fs->partitionOffset;
+   if (imageChecksum(fs, &expect.checksum)) {
+      return -1;
+   }
+
+   if (mapIndex(fs, indexFile, &expect) &&
+       (buildIndex(fs, &expect, indexFile) ||
+        mapIndex(fs, indexFile, &expect))) {
+      return -1;
+   }
+
+   /* the index's copy of the inode table stands in for an eager one */
+   free(fs->iTable);
+   fs->iTable = (struct inode *)(fs->index +
+                ((struct indexHeader *)fs->index)->inodesOffset);
+   phaseEnd(fs, PHASE_INDEX, start);
+   return 0;
+}
+
+/* Unmaps a filesystem's index, if it has one */
+void closeIndex(struct minfs *fs) {
+   if (fs->index) {
+      munmap(fs->index, fs->indexSize);
+      fs->index = NULL;
+      fs->iTable = NULL;
+   }
+}
+
+/* Returns the index record for an inode, or NULL if the index has none
+ * (or the filesystem has no index)
+ */
+static struct indexRecord *findRecord(struct minfs *fs, struct inode *in) {
+   struct indexHeader *header = (struct indexHeader *)fs->index;
+   struct indexRecord *records;
+   uint32_t key;
+   uint64_t low = 0, high;
+
+   if (!header || !(key = recordKey(in))) {
+      return NULL;
+   }
+   records = (struct indexRecord *)(fs->index + header->recordsOffset);
+   high = header->numRecords;
+   while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      if (records[mid].key < key) {
+         low = mid + 1;
+      }
+      else {
+         high = mid;
+      }
+   }
+   if (low == header->numRecords || records[low].key != key ||
+       records[low].size != in->size) {
+      return NULL;
+   }
+   return records + low;
+}
+
+/* Copies a file's extents out of the index into *extents. Returns how
+ * many there are, or -1 if the index doesn't have them.
+ */
+int indexExtents(struct minfs *fs, struct inode *in,
+                 struct extent **extents) {
+   struct indexHeader *header = (struct indexHeader *)fs->index;
+   struct indexRecord *record = findRecord(fs, in);
+   struct extent *found;
+
+   if (!record || record->firstExtent + record->numExtents >
+                  header->numExtents) {
+      return -1;
+   }
+   *extents = malloc((record->numExtents ? record->numExtents : 1) *
+                     sizeof(struct extent));
+   if (!*extents) {
+      return -1;
+   }
+   found = (struct extent *)(fs->index + header->extentsOffset);
+   memcpy(*extents, found + record->firstExtent,
+          record->numExtents * sizeof(struct extent));
+   COUNT(fs, indexHits, 1);
+   return record->numExtents;
+}
+
+/* Copies a directory's contents out of the index, or returns NULL if the
+ * index doesn't have them
+ */
+void *indexContents(struct minfs *fs, struct inode *in) {
+   void *contents = malloc(in->size ? in->size : 1);
+
+   if (!contents) {
+      return NULL;
+   }
+   if (indexRead(fs, in, 0, contents, in->size)) {
+      free(contents);
+      return NULL;
+   }
+   return contents;
+}
+
+/* Copies len bytes at offset in a directory's contents out of the index.
+ * Returns 0, or -1 if the index doesn't have them.
+ */
+int indexRead(struct minfs *fs, struct inode *in, uint64_t offset, void *buf,
+              uint64_t len) {
+   struct indexHeader *header = (struct indexHeader *)fs->index;
+   struct indexRecord *record = findRecord(fs, in);
+
+   if (!record || record->contents == UINT64_MAX || offset > in->size ||
+       len > in->size - offset ||
+       record->contents + in->size > header->contentsSize) {
+      return -1;
+   }
+   memcpy(buf, fs->index + header->contentsOffset + record->contents + offset,
+          len);
+   if (!offset) {
+      COUNT(fs, indexHits, 1);
+   }
+   return 0;
+}
+
+/* Looks an absolute path up in the index's path table, ignoring repeated
+ * and trailing slashes. Returns its inode number, or 0 if the index
+ * doesn't have it.
+ */
+uint32_t lookupIndex(struct minfs *fs, const char *path) {
+   struct indexHeader *header = (struct indexHeader *)fs->index;
+   struct indexPath *paths;
+   const char *strings;
+   char clean[PATH_MAX];
+   uint64_t low = 0, high;
+   int len = 0;
+
+   if (!header) {
+      return 0;
+   }
+   for (; *path; path++) {
+      if (*path == '/' && len && clean[len - 1] == '/') {
+         continue;
+      }
+      if (len == sizeof(clean) - 1) {
+         return 0;
+      }
+      clean[len++] = *path;
+   }
+   if (len > 1 && clean[len - 1] == '/') {
+      len--;
+   }
+   clean[len] = '\0';
+
+   paths = (struct indexPath *)(fs->index + header->pathsOffset);
+   strings = (const char *)fs->index + header->stringsOffset;
+   high = header->numPaths;
+   while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      int cmp = paths[mid].name < header->stringsSize ?
+                strcmp(strings + paths[mid].name, clean) : 1;
+      if (!cmp) {
+         COUNT(fs, indexHits, 1);
+         return paths[mid].inodeNum;
+      }
+      if (cmp < 0) {
+         low = mid + 1;
+      }
+      else {
+         high = mid;
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,234 @@
+#include "minCommon.h"
+#include <sys/wait.h>
+
+/* Running a tool over every filesystem in an image (-p all). The
+ * partition tables are walked once, what is wrong with any entry is
+ * reported, and then each filesystem gets a child process of its own,
+ * with its own partition window, several at a time. Each child's output
+ * is caught in a temporary file and passed on whole, in partition order,
+ * as soon as everything before it is done, so nothing interleaves.
+ * Text listings are headed by the filesystem they are for; JSON ones are
+ * merged into one array, each entry saying which filesystem it is in.
+ */
+
+/* a child running the tool on one filesystem */
+struct partRun {
+   pid_t pid;                    /* 0 until started, -1 once reaped */
+   FILE *out;                    /* its stdout and stderr */
+   FILE *err;
+   int failed;
+};
+
+/* Writes how to pick a filesystem out on the command line */
+static void partLabel(char *buf, size_t len, struct minPart *part) {
+   if (part->subpartition >= 0) {
+      snprintf(buf, len, "-p %d -s %d", part->partition, part->subpartition);
+   }
+   else if (part->partition >= 0) {
+      snprintf(buf, len, "-p %d", part->partition);
+   }
+   else {
+      snprintf(buf, len, "whole image");
+   }
+}
+
+/* Says how many bytes a temporary file holds */
+static long outputSize(FILE *in) {
+   fseek(in, 0, SEEK_END);
+   return ftell(in);
+}
+
+/* Copies all of a temporary file to out */
+static void replay(FILE *in, FILE *out) {
+   char buf[65536];
+   size_t got;
+
+   rewind(in);
+   while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+      fwrite(buf, 1, got, out);
+   }
+   fclose(in);
+}
+
+/* Waits for one child to finish, noting how it went. Returns 0, or -1
+   if there are none left */
+static int reapOne(struct partRun *runs, int count) {
+   int status, i;
+   pid_t pid;
+
+   while ((pid = wait(&status)) < 0 && errno == EINTR) {
+   }
+   if (pid < 0) {
+      return -1;
+   }
+   for (i = 0; i < count; i++) {
+      if (runs[i].pid == pid) {
+         runs[i].pid = -1;
+         runs[i].failed = !WIFEXITED(status) ||
+                          WEXITSTATUS(status) != EXIT_SUCCESS;
+      }
+   }
+   return 0;
+}
+
+/* Starts a child for one filesystem. In the child, points the options
+ * at it and returns 1; in the parent, returns 0.
+ */
+static int startRun(struct partRun *run, struct minPart *part,
+                    struct minOptions *options, int format) {
+   run->out = tmpfile();
+   run->err = tmpfile();
+   if (!run->out || !run->err) {
+      fprintf(stderr, "Failed to create output file (errno: %d)\n", errno);
+      exit(EXIT_FAILURE);
+   }
+   fflush(stdout);
+   fflush(stderr);
+   run->pid = fork();
+   if (run->pid < 0) {
+      fprintf(stderr, "Failed to start a process (errno: %d)\n", errno);
+      exit(EXIT_FAILURE);
+   }
+   if (run->pid) {
+      return 0;
+   }
+
+   if (dup2(fileno(run->out), STDOUT_FILENO) < 0 ||
+       dup2(fileno(run->err), STDERR_FILENO) < 0) {
+      exit(EXIT_FAILURE);
+   }
+   options->partition = part->partition;
+   options->subpartition = part->subpartition;
+   if (format == FORMAT_JSON || format == FORMAT_NDJSON) {
+      formatPartition(part->partition, part->subpartition);
+   }
+   if (options->indexFile && !*options->indexFile) {
+      nameIndex(options);
+   }
+   /* each filesystem is extracted into a directory of its own */
+   if (options->destDir && part->partition >= 0) {
+      char *dest;
+      if (mkdir(options->destDir, 0777) < 0 && errno != EEXIST) {
+         fprintf(stderr, "Failed to create %s (errno: %d)\n",
+                 options->destDir, errno);
+         exit(EXIT_FAILURE);
+      }
+      if (part->subpartition >= 0 ?
+          asprintf(&dest, "%s/p%d.s%d", options->destDir, part->partition,
+                   part->subpartition) < 0 :
+          asprintf(&dest, "%s/p%d", options->destDir, part->partition) < 0) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+      options->destDir = dest;
+   }
+   return 1;
+}
+
+/* With -p all, runs the rest of the tool once for each filesystem in the
+ * image, up to one per CPU at a time (or -j of them). In each child this
+ * returns the filesystem to open with minfsOpenPart; the parent passes
+ * on the children's output and exits. format is what that output is:
+ * FORMAT_TEXT gets each child's output headed by which filesystem it is
+ * for, FORMAT_JSON has the children's entries merged into one array, and
+ * FORMAT_RAW is passed on as it is. Without -p all it returns NULL at
+ * once.
+ */
+struct minPart *eachPartition(struct minOptions *options, int format) {
+   struct minPart *parts;
+   struct partRun *runs;
+   int count, running = 0, usable = 0, next = 0, shown = 0, failed = 0;
+   int limit, i;
+   char label[32];
+
+   if (options->partition != ALL_PARTITIONS) {
+      return NULL;
+   }
+   if (!strcmp(options->imagefile, "-")) {
+      fprintf(stderr, "-p all needs an image file, not -\n");
+      exit(EXIT_FAILURE);
+   }
+   /* a bare path has nowhere to say which filesystem it is in */
+   if (format == FORMAT_NUL) {
+      fprintf(stderr, "-p all can't be used with --format=nul\n");
+      exit(EXIT_FAILURE);
+   }
+   count = findPartitions(options->imagefile, &parts);
+   if (count < 0) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+
+   /* what can't be used is reported, and the rest carries on */
+   for (i = 0; i < count; i++) {
+      if (parts[i].problem[0]) {
+         partLabel(label, sizeof(label), parts + i);
+         fprintf(stderr, "%s %s: %s\n", options->imagefile, label,
+                 parts[i].problem);
+      }
+      else {
+         usable++;
+      }
+   }
+   if (!usable) {
+      fprintf(stderr, "No Minix filesystems in %s\n", options->imagefile);
+      exit(EXIT_FAILURE);
+   }
+
+   runs = calloc(count, sizeof(struct partRun));
+   if (!runs) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   limit = options->threads ? options->threads
+                            : sysconf(_SC_NPROCESSORS_ONLN);
+   if (limit < 1) {
+      limit = 1;
+   }
+
+   for (i = 0; i <= count; i++) {
+      /* wait for a slot, or at the end for everything */
+      while (running && (running >= limit || i == count)) {
+         if (reapOne(runs, count)) {
+            running = 0;
+            break;
+         }
+         running--;
+
+         /* pass on whatever is done, in order */
+         while (next < count && (parts[next].problem[0] ||
+                                 runs[next].pid < 0)) {
+            if (!parts[next].problem[0]) {
+               if (format == FORMAT_TEXT) {
+                  partLabel(label, sizeof(label), parts + next);
+                  printf("%s%s %s:\n", shown++ ? "\n" : "",
+                         options->imagefile, label);
+               }
+               else if (format == FORMAT_JSON &&
+                        outputSize(runs[next].out) > 0) {
+                  fputs(shown++ ? ",\n" : "[\n", stdout);
+               }
+               fflush(stdout);
+               replay(runs[next].out, stdout);
+               fflush(stdout);
+               replay(runs[next].err, stderr);
+               failed |= runs[next].failed;
+            }
+            next++;
+         }
+      }
+      if (i < count && !parts[i].problem[0]) {
+         if (startRun(runs + i, parts + i, options, format)) {
+            return parts + i;
+         }
+         running++;
+      }
+   }
+
+   if (format == FORMAT_JSON) {
+      fputs(shown ? "\n]\n" : "[\n]\n", stdout);
+   }
+   free(runs);
+   free(parts);
+   exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,255 @@
+#include "minCommon.h"
+
+/* A worker's own tasks. The owner pushes and pops at the tail,
+ * thieves take from the head, so the oldest (biggest) work is stolen.
+ */
+struct taskDeque {
+   pthread_mutex_t lock;
+   void **tasks;
+   int head;
+   int tail;
+   int max;
+};
+
+struct taskPool {
+   taskFunc run;
+   int numWorkers;
+   struct taskDeque *deques;
+   pthread_t *threads;
+   long pending;           /* tasks submitted but not yet finished */
+   pthread_mutex_t idleLock;
+   pthread_cond_t idleWake;  /* a task was queued, or the last one ended */
+   uint64_t posted;        /* tasks queued so far, for idle workers */
+};
+
+/* which deque the calling thread owns, 0 outside the pool's workers */
+static __thread int workerId = 0;
+
+/* Makes a pool of the given number of workers (0 for one per CPU) that
+ * will hand each submitted task to run
+ */
+struct taskPool *createPool(int threads, taskFunc run) {
+   struct taskPool *pool = calloc(1, sizeof(struct taskPool));
+   int i;
+
+   if (threads <= 0) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (threads <= 0) {
+      threads = 1;
+   }
+
+   if (!pool) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   pool->run = run;
+   pool->numWorkers = threads;
+   pool->deques = calloc(threads, sizeof(struct taskDeque));
+   pool->threads = calloc(threads, sizeof(pthread_t));
+   if (!pool->deques || !pool->threads) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < threads; i++) {
+      pthread_mutex_init(&pool->deques[i].lock, NULL);
+   }
+   pthread_mutex_init(&pool->idleLock, NULL);
+   pthread_cond_init(&pool->idleWake, NULL);
+   return pool;
+}
+
+/* Queues a task. Workers push onto their own deque, anyone else
+ * onto the first worker's.
+ */
+void submitTask(struct taskPool *pool, void *task) {
+   struct taskDeque *deque = pool->deques + workerId;
+
+   __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_lock(&deque->lock);
+   if (deque->tail == deque->max) {
+      /* slide live tasks down before growing */
+      if (deque->head > 0) {
+         memmove(deque->tasks, deque->tasks + deque->head,
+                 (deque->tail - deque->head) * sizeof(void *));
+         deque->tail -= deque->head;
+         deque->head = 0;
+      }
+      if (deque->tail == deque->max) {
+         deque->max = deque->max ? deque->max * 2 : 64;
+         deque->tasks = realloc(deque->tasks, deque->max * sizeof(void *));
+         if (!deque->tasks) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+   }
+   deque->tasks[deque->tail++] = task;
+   pthread_mutex_unlock(&deque->lock);
+
+   /* wake a worker with nothing to do */
+   pthread_mutex_lock(&pool->idleLock);
+   __atomic_add_fetch(&pool->posted, 1, __ATOMIC_SEQ_CST);
+   pthread_cond_signal(&pool->idleWake);
+   pthread_mutex_unlock(&pool->idleLock);
+}
+
+/* Takes a task from the tail (own work) or head (stealing) of a deque */
+static void *takeTask(struct taskDeque *deque, int steal) {
+   void *task = NULL;
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->head < deque->tail) {
+      task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+   }
+   pthread_mutex_unlock(&deque->lock);
+   return task;
+}
+
+/* The argument each worker thread starts with */
+struct workerStart {
+   struct taskPool *pool;
+   int id;
+};
+
+/* Runs tasks from its own deque, stealing from the others when it runs
+ * dry, until every submitted task has finished. A worker that finds
+ * nothing sleeps until another task is queued or the last one ends.
+ */
+static void *workerMain(void *arg) {
+   struct workerStart *start = arg;
+   struct taskPool *pool = start->pool;
+   int victim;
+
+   workerId = start->id;
+   while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST)) {
+      /* anything queued after this is noticed before sleeping */
+      uint64_t posted = __atomic_load_n(&pool->posted, __ATOMIC_SEQ_CST);
+      void *task = takeTask(pool->deques + workerId, 0);
+
+      for (victim = 1; !task && victim < pool->numWorkers; victim++) {
+         task = takeTask(pool->deques +
+                         (workerId + victim) % pool->numWorkers, 1);
+      }
+      if (!task) {
+         pthread_mutex_lock(&pool->idleLock);
+         while (pool->posted == posted &&
+                __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&pool->idleWake, &pool->idleLock);
+         }
+         pthread_mutex_unlock(&pool->idleLock);
+         continue;
+      }
+
+      pool->run(pool, task);
+      if (!__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST)) {
+         /* everything is done, so the sleepers can finish */
+         pthread_mutex_lock(&pool->idleLock);
+         pthread_cond_broadcast(&pool->idleWake);
+         pthread_mutex_unlock(&pool->idleLock);
+      }
+   }
+   return NULL;
+}
+
+/* Starts the workers and waits until the submitted tasks, and any tasks
+ * they submit in turn, have all run
+ */
+void runPool(struct taskPool *pool) {
+   struct workerStart *starts = calloc(pool->numWorkers,
+                                       sizeof(struct workerStart));
+   int i;
+
+   if (!starts) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < pool->numWorkers; i++) {
+      starts[i].pool = pool;
+      starts[i].id = i;
+      if (pthread_create(pool->threads + i, NULL, workerMain, starts + i)) {
+         fprintf(stderr, "Failed to start worker thread\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   for (i = 0; i < pool->numWorkers; i++) {
+      pthread_join(pool->threads[i], NULL);
+   }
+   free(starts);
+}
+
+/* Frees a pool whose tasks have all run */
+void freePool(struct taskPool *pool) {
+   int i;
+   for (i = 0; i < pool->numWorkers; i++) {
+      pthread_mutex_destroy(&pool->deques[i].lock);
+      free(pool->deques[i].tasks);
+   }
+   pthread_mutex_destroy(&pool->idleLock);
+   pthread_cond_destroy(&pool->idleWake);
+   free(pool->deques);
+   free(pool->threads);
+   free(pool);
+}
+
+/* The shared cursor handing out indices for runOrdered */
+struct orderedRun {
+   void (*run)(int index, void *arg);
+   void *arg;
+   int count;
+   int next;
+};
+
+/* Claims indices in order until there are none left */
+static void *orderedMain(void *arg) {
+   struct orderedRun *ordered = arg;
+   int index;
+
+   while ((index = __atomic_fetch_add(&ordered->next, 1, __ATOMIC_RELAXED))
+          < ordered->count) {
+      ordered->run(index, ordered->arg);
+   }
+   return NULL;
+}
+
+/* Calls run(index, arg) for every index below count, spread over the
+ * given number of threads (0 for one per CPU). Indices are claimed
+ * strictly in order, so work starts in the order it was listed in.
+ */
+void runOrdered(int threads, int count, void (*run)(int index, void *arg),
+                void *arg) {
+   struct orderedRun ordered;
+   pthread_t *ids;
+   int i;
+
+   if (threads <= 0) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (threads <= 0) {
+      threads = 1;
+   }
+   if (threads > count) {
+      threads = count ? count : 1;
+   }
+
+   ordered.run = run;
+   ordered.arg = arg;
+   ordered.count = count;
+   ordered.next = 0;
+
+   ids = calloc(threads, sizeof(pthread_t));
+   if (!ids) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < threads; i++) {
+      if (pthread_create(ids + i, NULL, orderedMain, &ordered)) {
+         fprintf(stderr, "Failed to start worker thread\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   for (i = 0; i < threads; i++) {
+      pthread_join(ids[i], NULL);
+   }
+   free(ids);
+}
@@ -0,0 +1,797 @@
+#include "mindiff.h"
+
+/* the two sides being compared, for the workers */
+static struct diffSide *oldSide, *newSide;
+static struct diffPair *pairs = NULL;
+static int *candidates = NULL;
+
+/* what was looked at, for -v */
+static uint64_t entriesSkipped = 0, filesCompared = 0, filesHashed = 0;
+static uint64_t zonesCompared = 0, zonesDiffering = 0;
+
+int main(int argc, char *const argv[])
+{
+   int partition = INVALID_OPTION, subpartition = INVALID_OPTION;
+   int verbose = 0, threads = 0, count = 0, opt, i;
+   char *archive = NULL, *manifest = NULL;
+   struct minfs oldFs, newFs;
+   struct diffSide old, new;
+   struct outBuf out;
+
+   while ((opt = getopt(argc, argv, "vj:p:s:o:w:")) != -1) {
+      switch (opt) {
+         case 'v':
+            verbose = 1;
+         break;
+         case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+               fprintf(stderr, "Thread count %d must be at least 1.\n",
+                       threads);
+               fprintf(stderr, DIFF_USAGE, argv[0], argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+         case 'p':
+            partition = atoi(optarg);
+            if (partition < 0 || partition > 3) {
+               fprintf(stderr, "Partition %d out of range.  "
+                       "Must be 0..3.\n", partition);
+               fprintf(stderr, DIFF_USAGE, argv[0], argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+         case 's':
+            subpartition = atoi(optarg);
+            if (subpartition < 0 || subpartition > 3) {
+               fprintf(stderr, "Subpartition %d out of range.  "
+                       "Must be 0..3.\n", subpartition);
+               fprintf(stderr, DIFF_USAGE, argv[0], argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+         case 'o':
+            archive = optarg;
+         break;
+         case 'w':
+            manifest = optarg;
+         break;
+         default:
+            fprintf(stderr, DIFF_USAGE, argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+   /* one image is only for saving its manifest */
+   if (argc - optind < 1 || argc - optind > 2 ||
+       (argc - optind == 1 && (!manifest || archive))) {
+      fprintf(stderr, DIFF_USAGE, argv[0], argv[0]);
+      exit(EXIT_FAILURE);
+   }
+   const char *newFile = argv[argc - 1];
+   const char *oldFile = argc - optind > 1 ? argv[optind] : NULL;
+
+   memset(&old, 0, sizeof(old));
+   memset(&new, 0, sizeof(new));
+   if (oldFile && !readManifest(oldFile, &old)) {
+      if (minfsOpen(&oldFs, oldFile, partition, subpartition, 1)) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      collectImage(&oldFs, &old);
+   }
+   if (minfsOpen(&newFs, newFile, partition, subpartition, 1)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   collectImage(&newFs, &new);
+
+   if (oldFile) {
+      pairs = diffSides(&old, &new, threads, &count);
+      outInit(&out, STDOUT_FILENO, FORMAT_TEXT);
+      for (i = 0; i < count; i++) {
+         if (pairs[i].result != DIFF_SAME) {
+            char tag[3] = { pairs[i].result, ' ', '\0' };
+            outString(&out, tag);
+            outString(&out, pairs[i].new ? pairs[i].new->path
+                                         : pairs[i].old->path);
+            outWrite(&out, "\n", 1);
+         }
+      }
+      if (outFlush(&out)) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      outFree(&out);
+      if (archive) {
+         writeArchive(archive, &newFs, pairs, count);
+      }
+   }
+   if (manifest) {
+      writeManifest(manifest, &new, threads);
+   }
+
+   if (verbose) {
+      fprintf(stderr, "%llu unchanged by their inodes, %llu compared, "
+              "%llu hashed\n", (unsigned long long)entriesSkipped,
+              (unsigned long long)filesCompared,
+              (unsigned long long)filesHashed);
+      fprintf(stderr, "%llu zones compared, %llu differing\n",
+              (unsigned long long)zonesCompared,
+              (unsigned long long)zonesDiffering);
+   }
+   if (old.fs) {
+      minfsClose(old.fs);
+   }
+   minfsClose(&newFs);
+
+   exit(EXIT_SUCCESS);
+}
+
+/* Grows an array to hold one more element than count, or exits */
+static void *growArray(void *array, int count, int *max, size_t size) {
+   if (count < *max) {
+      return array;
+   }
+   *max = *max ? *max * 2 : 256;
+   array = realloc(array, *max * size);
+   if (!array) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   return array;
+}
+
+/* Adds an empty entry for path to one side, and returns it */
+static struct diffEntry *addEntry(struct diffSide *side, char *path) {
+   struct diffEntry *entry;
+
+   side->entries = growArray(side->entries, side->count, &side->max,
+                             sizeof(struct diffEntry));
+   entry = side->entries + side->count++;
+   memset(entry, 0, sizeof(*entry));
+   entry->path = path;
+   return entry;
+}
+
+/* Fills an entry in from an inode, with everything that says whether
+   it could have changed */
+static void fromInode(struct diffEntry *entry, uint32_t inodeNum,
+                      struct inode *in) {
+   entry->inodeNum = inodeNum;
+   entry->mode = in->mode;
+   entry->uid = in->uid;
+   entry->gid = in->gid;
+   entry->size = in->size;
+   entry->mtime = in->mtime;
+   entry->ctime = in->ctime;
+   entry->zoneSum = crc32c(0, in->zone, sizeof(in->zone));
+   entry->zoneSum = crc32c(entry->zoneSum, &in->indirect,
+                           sizeof(in->indirect));
+   entry->zoneSum = crc32c(entry->zoneSum, &in->two_indirect,
+                           sizeof(in->two_indirect));
+   entry->firstZone = in->zone[0];
+}
+
+/* Adds everything under a directory to one side. seen marks the
+   directories already walked, so a loop is only followed once. */
+static void collectTree(struct minfs *fs, struct diffSide *side,
+                        struct inode *dir, const char *path,
+                        uint8_t *seen) {
+   struct fileEntry *entry;
+   struct inode *in;
+   struct dirIter it;
+   int ret;
+
+   if (dirOpen(fs, *dir, &it)) {
+      fprintf(stderr, "%s: %s", *path ? path : "/", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   while ((ret = dirNext(&it, &entry, &in)) > 0) {
+      char *name = entry->name;
+      char *childPath;
+      if (!strncmp(name, ".", DIRSIZ) || !strncmp(name, "..", DIRSIZ)) {
+         continue;
+      }
+      if (asprintf(&childPath, "%s/%.*s", path, DIRSIZ, name) < 0) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+      fromInode(addEntry(side, childPath), entry->inode, in);
+
+      if (MIN_ISDIR(in->mode)) {
+         uint8_t bit = 1 << (entry->inode % 8);
+         if (!(seen[entry->inode / 8] & bit)) {
+            struct inode child = *in;
+            seen[entry->inode / 8] |= bit;
+            collectTree(fs, side, &child, childPath, seen);
+         }
+      }
+   }
+   dirClose(&it);
+   if (ret < 0) {
+      fprintf(stderr, "%s: %s", *path ? path : "/", minfsError());
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Orders entries by path */
+static int comparePath(const void *a, const void *b) {
+   return strcmp(((struct diffEntry *)a)->path,
+                 ((struct diffEntry *)b)->path);
+}
+
+/* Reads every file and directory in an image into one side, straight
+   from the directories and inode table; no file data is read */
+void collectImage(struct minfs *fs, struct diffSide *side) {
+   struct inode root;
+   uint8_t *seen;
+
+   side->fs = fs;
+   if (copyInode(fs, ROOT_INODE, &root)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   seen = calloc(fs->numInodes / 8 + 1, 1);
+   if (!seen) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   seen[ROOT_INODE / 8] |= 1 << (ROOT_INODE % 8);
+   fromInode(addEntry(side, strdup("/")), ROOT_INODE, &root);
+   collectTree(fs, side, &root, "", seen);
+   free(seen);
+   qsort(side->entries, side->count, sizeof(struct diffEntry), comparePath);
+}
+
+/* Undoes the escaping of a manifest path, in place */
+static void unescape(char *path) {
+   char *from = path, *to = path;
+
+   while (*from) {
+      if (*from == '\\' && from[1]) {
+         from++;
+         *to++ = *from == 'n' ? '\n' : *from;
+         from++;
+      }
+      else {
+         *to++ = *from++;
+      }
+   }
+   *to = '\0';
+}
+
+/* Loads a manifest saved by -w into one side. Returns 1, or 0 if file
+   isn't a manifest (so is taken to be an image). */
+int readManifest(const char *file, struct diffSide *side) {
+   char *line = NULL;
+   size_t lineMax = 0;
+   ssize_t len;
+   int lineNum = 1;
+   FILE *in;
+
+   if (!strcmp(file, "-") || !(in = fopen(file, "r"))) {
+      return 0;
+   }
+   len = getline(&line, &lineMax, in);
+   if (len < 0 || strcmp(line, MANIFEST_HEADER)) {
+      free(line);
+      fclose(in);
+      return 0;
+   }
+
+   while ((len = getline(&line, &lineMax, in)) > 0) {
+      struct diffEntry entry;
+      unsigned int mode, uid, gid;
+      int used = -1;
+
+      lineNum++;
+      if (line[len - 1] == '\n') {
+         line[--len] = '\0';
+      }
+      memset(&entry, 0, sizeof(entry));
+      sscanf(line, "%o\t%u\t%u\t%u\t%d\t%d\t%x\t%x\t%n", &mode, &uid, &gid,
+             &entry.size, &entry.mtime, &entry.ctime, &entry.zoneSum,
+             &entry.digest, &used);
+      if (used < 0 || line[used] != '/') {
+         fprintf(stderr, "%s: line %d is not a manifest entry\n", file,
+                 lineNum);
+         exit(EXIT_FAILURE);
+      }
+      unescape(line + used);
+      entry.path = strdup(line + used);
+      if (!entry.path) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+      entry.mode = mode;
+      entry.uid = uid;
+      entry.gid = gid;
+      entry.hashed = MIN_ISREG(entry.mode) || MIN_ISLNK(entry.mode);
+      *addEntry(side, entry.path) = entry;
+   }
+   if (ferror(in)) {
+      fprintf(stderr, "Failed to read %s (errno: %d)\n", file, errno);
+      exit(EXIT_FAILURE);
+   }
+   free(line);
+   fclose(in);
+   qsort(side->entries, side->count, sizeof(struct diffEntry), comparePath);
+   return 1;
+}
+
+/* Worker: works out the CRC32C of one entry of the new side */
+static void hashOne(int index, void *arg) {
+   struct diffEntry *entry = newSide->entries + candidates[index];
+   struct inode in;
+
+   if (copyInode(newSide->fs, entry->inodeNum, &in) ||
+       hashFile(newSide->fs, in, &entry->digest)) {
+      fprintf(stderr, "%s: %s", entry->path, minfsError());
+      exit(EXIT_FAILURE);
+   }
+   entry->hashed = 1;
+   __atomic_add_fetch(&filesHashed, 1, __ATOMIC_RELAXED);
+}
+
+/* Orders candidate entries of the new side by where their data starts */
+static int compareFirstZone(const void *a, const void *b) {
+   uint32_t za = newSide->entries[*(int *)a].firstZone;
+   uint32_t zb = newSide->entries[*(int *)b].firstZone;
+   return za < zb ? -1 : za > zb;
+}
+
+/* Saves a manifest of one side: a line per file or directory with what
+   its inode says and the CRC32C of its contents. Files not yet hashed
+   are hashed first, by a pool of threads in the order their data sits
+   in the image. */
+void writeManifest(const char *file, struct diffSide *side, int threads) {
+   struct outBuf out;
+   char *escaped = NULL;
+   size_t escapedMax = 0;
+   int count = 0, fd, i;
+
+   newSide = side;
+   candidates = realloc(candidates, (side->count + 1) * sizeof(int));
+   if (!candidates) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < side->count; i++) {
+      struct diffEntry *entry = side->entries + i;
+      if (!entry->hashed && (MIN_ISREG(entry->mode) ||
+                             MIN_ISLNK(entry->mode))) {
+         candidates[count++] = i;
+      }
+   }
+   if (count) {
+      qsort(candidates, count, sizeof(int), compareFirstZone);
+      runOrdered(threads, count, hashOne, NULL);
+   }
+
+   fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd < 0) {
+      fprintf(stderr, "Failed to create %s (errno: %d)\n", file, errno);
+      exit(EXIT_FAILURE);
+   }
+   outInit(&out, fd, FORMAT_TEXT);
+   outString(&out, MANIFEST_HEADER);
+   for (i = 0; i < side->count; i++) {
+      struct diffEntry *entry = side->entries + i;
+      char fields[128], *to;
+      const char *from;
+
+      /* a name may hold newlines, so they and backslashes are escaped */
+      if (strlen(entry->path) * 2 + 1 > escapedMax) {
+         escapedMax = strlen(entry->path) * 2 + 1;
+         escaped = realloc(escaped, escapedMax);
+         if (!escaped) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      for (from = entry->path, to = escaped; *from; from++) {
+         if (*from == '\\' || *from == '\n') {
+            *to++ = '\\';
+         }
+         *to++ = *from == '\n' ? 'n' : *from;
+      }
+      *to = '\0';
+
+      snprintf(fields, sizeof(fields), "%o\t%u\t%u\t%u\t%d\t%d\t%08x\t%08x\t",
+               entry->mode, entry->uid, entry->gid, entry->size,
+               entry->mtime, entry->ctime, entry->zoneSum, entry->digest);
+      outString(&out, fields);
+      outString(&out, escaped);
+      outWrite(&out, "\n", 1);
+   }
+   if (outFlush(&out) || close(fd) < 0) {
+      fprintf(stderr, "Failed to write %s\n", file);
+      exit(EXIT_FAILURE);
+   }
+   outFree(&out);
+   free(escaped);
+}
+
+/* Finds the extent of a file holding offset, moving on from *next.
+   Returns it, or NULL if offset is past them all (so is a hole). */
+static struct extent *extentAt(struct extent *extents, int count, int *next,
+                               uint64_t offset) {
+   while (*next < count &&
+          extents[*next].offset + extents[*next].length <= offset) {
+      (*next)++;
+   }
+   return *next < count && extents[*next].offset <= offset ?
+          extents + *next : NULL;
+}
+
+/* Reads len bytes at offset in a file, within the extent holding it,
+   or zeros for a hole. Returns 0, or -1. */
+static int readSpan(struct minfs *fs, struct extent *ext, uint64_t offset,
+                    void *buf, uint64_t len) {
+   if (!ext || !ext->zone) {
+      memset(buf, 0, len);
+      return 0;
+   }
+   return readImage(fs, buf, (uint64_t)ext->zone * fs->zoneSize +
+                    offset - ext->offset, len);
+}
+
+/* Compares the contents of a file in one image with one in another,
+   zone by zone, stopping at the first zone that differs. Holes on both
+   sides at once are skipped without reading. Returns 1 if they differ,
+   0 if not, or -1 if either can't be read. */
+int compareContents(struct minfs *oldFs, struct inode *old,
+                    struct minfs *newFs, struct inode *new) {
+   struct extent *oldExtents, *newExtents;
+   int oldCount, newCount, oldNext = 0, newNext = 0, ret = 0;
+   uint64_t offset = 0, zoneSize = newFs->zoneSize;
+   char *oldBuf, *newBuf;
+
+   if (old->size != new->size) {
+      return 1;
+   }
+   oldCount = mapExtents(oldFs, *old, &oldExtents);
+   if (oldCount < 0) {
+      return -1;
+   }
+   newCount = mapExtents(newFs, *new, &newExtents);
+   if (newCount < 0) {
+      free(oldExtents);
+      return -1;
+   }
+   oldBuf = malloc(COPY_CHUNK);
+   newBuf = malloc(COPY_CHUNK);
+   if (!oldBuf || !newBuf) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+
+   while (offset < new->size && !ret) {
+      struct extent *oldExt = extentAt(oldExtents, oldCount, &oldNext, offset);
+      struct extent *newExt = extentAt(newExtents, newCount, &newNext, offset);
+      uint64_t len = new->size - offset, zones, i;
+
+      /* as much as both sides have in one piece, a chunk at a time */
+      if (oldExt && oldExt->offset + oldExt->length - offset < len) {
+         len = oldExt->offset + oldExt->length - offset;
+      }
+      if (newExt && newExt->offset + newExt->length - offset < len) {
+         len = newExt->offset + newExt->length - offset;
+      }
+      len = len < COPY_CHUNK ? len : COPY_CHUNK;
+      if ((!oldExt || !oldExt->zone) && (!newExt || !newExt->zone)) {
+         offset += len;
+         continue;
+      }
+
+      if (readSpan(oldFs, oldExt, offset, oldBuf, len) ||
+          readSpan(newFs, newExt, offset, newBuf, len)) {
+         ret = -1;
+         break;
+      }
+      zones = (len + zoneSize - 1) / zoneSize;
+      for (i = 0; i < zones; i++) {
+         uint64_t at = i * zoneSize;
+         uint64_t part = len - at < zoneSize ? len - at : zoneSize;
+         if (memcmp(oldBuf + at, newBuf + at, part)) {
+            __atomic_add_fetch(&zonesDiffering, 1, __ATOMIC_RELAXED);
+            ret = 1;
+            i++;
+            break;
+         }
+      }
+      __atomic_add_fetch(&zonesCompared, i, __ATOMIC_RELAXED);
+      offset += len;
+   }
+
+   free(oldBuf);
+   free(newBuf);
+   free(oldExtents);
+   free(newExtents);
+   return ret;
+}
+
+/* Says how a path on both sides changed, given whether its contents
+   did. For a directory only its mode and owner count: the rest changes
+   whenever something in it does, and that is reported on its own. */
+static int classify(struct diffEntry *old, struct diffEntry *new,
+                    int contentsDiffer) {
+   if (MIN_TYPE(old->mode) != MIN_TYPE(new->mode) || contentsDiffer) {
+      return DIFF_MODIFIED;
+   }
+   if (old->mode != new->mode || old->uid != new->uid ||
+       old->gid != new->gid ||
+       (!MIN_ISDIR(new->mode) && old->mtime != new->mtime)) {
+      return DIFF_CHANGED;
+   }
+   return DIFF_SAME;
+}
+
+/* Worker: settles one pair whose inodes couldn't, by comparing the
+   files' zones against each other, or against the manifest's CRC32C */
+static void compareOne(int index, void *arg) {
+   struct diffPair *pair = pairs + candidates[index];
+   struct inode old, new;
+   int differ;
+
+   if (copyInode(newSide->fs, pair->new->inodeNum, &new)) {
+      fprintf(stderr, "%s: %s", pair->new->path, minfsError());
+      exit(EXIT_FAILURE);
+   }
+   if (!oldSide->fs) {
+      if (hashFile(newSide->fs, new, &pair->new->digest)) {
+         fprintf(stderr, "%s: %s", pair->new->path, minfsError());
+         exit(EXIT_FAILURE);
+      }
+      pair->new->hashed = 1;
+      __atomic_add_fetch(&filesHashed, 1, __ATOMIC_RELAXED);
+      differ = pair->new->digest != pair->old->digest;
+   }
+   else {
+      if (copyInode(oldSide->fs, pair->old->inodeNum, &old) ||
+          (differ = compareContents(oldSide->fs, &old, newSide->fs,
+                                    &new)) < 0) {
+         fprintf(stderr, "%s: %s", pair->new->path, minfsError());
+         exit(EXIT_FAILURE);
+      }
+      __atomic_add_fetch(&filesCompared, 1, __ATOMIC_RELAXED);
+   }
+   pair->result = classify(pair->old, pair->new, differ);
+}
+
+/* Orders candidate pairs by where the new file's data starts */
+static int comparePairZone(const void *a, const void *b) {
+   uint32_t za = pairs[*(int *)a].new->firstZone;
+   uint32_t zb = pairs[*(int *)b].new->firstZone;
+   return za < zb ? -1 : za > zb;
+}
+
+/* Matches the two sides up by path and works out what became of each
+   one. A path whose mode, owner, size, times and zone pointers are all
+   as they were is taken to be unchanged without reading anything; of
+   the rest, only files of the same type and size have their data
+   compared, by a pool of threads. Returns every path on either side,
+   in order, with *count set to how many. */
+struct diffPair *diffSides(struct diffSide *old, struct diffSide *new,
+                           int threads, int *count) {
+   int numPairs = 0, maxPairs = 0, numCandidates = 0, maxCandidates = 0;
+   int o = 0, n = 0;
+
+   oldSide = old;
+   newSide = new;
+   while (o < old->count || n < new->count) {
+      struct diffPair *pair;
+      int cmp = o == old->count ? 1 : n == new->count ? -1 :
+                strcmp(old->entries[o].path, new->entries[n].path);
+
+      pairs = growArray(pairs, numPairs, &maxPairs, sizeof(struct diffPair));
+      pair = pairs + numPairs++;
+      pair->old = cmp <= 0 ? old->entries + o++ : NULL;
+      pair->new = cmp >= 0 ? new->entries + n++ : NULL;
+      if (!pair->old || !pair->new) {
+         pair->result = pair->old ? DIFF_REMOVED : DIFF_ADDED;
+         continue;
+      }
+
+      struct diffEntry *was = pair->old, *is = pair->new;
+      if (was->mode == is->mode && was->uid == is->uid &&
+          was->gid == is->gid && was->size == is->size &&
+          was->mtime == is->mtime && was->ctime == is->ctime &&
+          was->zoneSum == is->zoneSum) {
+         entriesSkipped++;
+         pair->result = DIFF_SAME;
+         /* so a manifest saved from here needn't hash it again */
+         if (was->hashed) {
+            is->digest = was->digest;
+            is->hashed = 1;
+         }
+      }
+      else if (MIN_TYPE(was->mode) == MIN_TYPE(is->mode) &&
+               was->size == is->size &&
+               (MIN_ISREG(is->mode) || MIN_ISLNK(is->mode))) {
+         pair->result = DIFF_SAME;
+         candidates = growArray(candidates, numCandidates, &maxCandidates,
+                                sizeof(int));
+         candidates[numCandidates++] = numPairs - 1;
+      }
+      else {
+         /* devices keep their numbers in their zone pointers */
+         pair->result = classify(was, is, !MIN_ISDIR(is->mode) &&
+                                 (was->size != is->size ||
+                                  was->zoneSum != is->zoneSum));
+      }
+   }
+
+   if (numCandidates) {
+      qsort(candidates, numCandidates, sizeof(int), comparePairZone);
+      runOrdered(threads, numCandidates, compareOne, NULL);
+   }
+
+   *count = numPairs;
+   return pairs;
+}
+
+/* Writes a ustar header for one member to the archive. Returns 0, or
+   -1 if its name won't fit. */
+static int tarHeader(int fd, const char *path, struct diffEntry *entry,
+                     char type, uint32_t size, const char *link) {
+   unsigned char header[TAR_BLOCK];
+   const char *name = path;
+   size_t len = strlen(path), split = 0;
+   unsigned int sum = 0;
+   int i;
+
+   /* a long name is split at a slash, into a prefix and a name */
+   if (len > 100) {
+      for (split = len - 1; split > 0; split--) {
+         if (path[split] == '/' && len - split - 1 <= 100 && split <= 155) {
+            break;
+         }
+      }
+      if (!split) {
+         return -1;
+      }
+      name = path + split + 1;
+   }
+   if (link && strlen(link) > 100) {
+      return -1;
+   }
+
+   memset(header, 0, sizeof(header));
+   memcpy(header, name, strlen(name));
+   snprintf((char *)header + 100, 8, "%07o", entry->mode & 07777);
+   snprintf((char *)header + 108, 8, "%07o", entry->uid);
+   snprintf((char *)header + 116, 8, "%07o", entry->gid);
+   snprintf((char *)header + 124, 12, "%011o", size);
+   snprintf((char *)header + 136, 12, "%011o",
+            entry->mtime > 0 ? entry->mtime : 0);
+   header[156] = type;
+   if (link) {
+      memcpy(header + 157, link, strlen(link));
+   }
+   memcpy(header + 257, "ustar", 6);
+   memcpy(header + 263, "00", 2);
+   memcpy(header + 345, path, split);
+
+   memset(header + 148, ' ', 8);
+   for (i = 0; i < TAR_BLOCK; i++) {
+      sum += header[i];
+   }
+   snprintf((char *)header + 148, 8, "%06o", sum);
+   if (writeAll(fd, header, sizeof(header))) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   return 0;
+}
+
+/* Pads a member's data out to a whole number of tar blocks */
+static void tarPad(int fd, uint64_t size) {
+   static const char zeros[TAR_BLOCK];
+
+   if (size % TAR_BLOCK &&
+       writeAll(fd, zeros, TAR_BLOCK - size % TAR_BLOCK)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Writes what changed to a tar archive: the added and modified files
+   and symbolic links, with their data, the added directories and those
+   whose mode or owner changed, and, if anything was removed, a member
+   named REMOVED_NAME listing the removed paths a line each */
+void writeArchive(const char *file, struct minfs *fs, struct diffPair *pairs,
+                  int count) {
+   static const char zeros[2 * TAR_BLOCK];
+   struct diffEntry removedEntry;
+   char *removed = NULL;
+   size_t removedLen = 0;
+   FILE *list;
+   int fd, i;
+
+   fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd < 0) {
+      fprintf(stderr, "Failed to create %s (errno: %d)\n", file, errno);
+      exit(EXIT_FAILURE);
+   }
+   list = open_memstream(&removed, &removedLen);
+   if (!list) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for (i = 0; i < count; i++) {
+      struct diffEntry *entry = pairs[i].new;
+      const char *path = entry ? entry->path + 1 : NULL;
+      struct inode in;
+      char *name;
+
+      if (pairs[i].result == DIFF_REMOVED) {
+         fprintf(list, "%s\n", pairs[i].old->path);
+         continue;
+      }
+      if (pairs[i].result == DIFF_SAME || !*path ||
+          (pairs[i].result == DIFF_CHANGED && !MIN_ISDIR(entry->mode))) {
+         continue;
+      }
+      if (copyInode(fs, entry->inodeNum, &in)) {
+         fprintf(stderr, "%s: %s", entry->path, minfsError());
+         exit(EXIT_FAILURE);
+      }
+
+      if (MIN_ISDIR(entry->mode)) {
+         if (asprintf(&name, "%s/", path) < 0) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+         if (tarHeader(fd, name, entry, '5', 0, NULL)) {
+            fprintf(stderr, "%s: name too long to archive\n", entry->path);
+         }
+         free(name);
+      }
+      else if (MIN_ISREG(entry->mode)) {
+         if (tarHeader(fd, path, entry, '0', entry->size, NULL)) {
+            fprintf(stderr, "%s: name too long to archive\n", entry->path);
+            continue;
+         }
+         if (streamFile(fs, in, fd)) {
+            fprintf(stderr, "%s: %s", entry->path, minfsError());
+            exit(EXIT_FAILURE);
+         }
+         tarPad(fd, entry->size);
+      }
+      else if (MIN_ISLNK(entry->mode) && in.size <= 100 && in.zone[0]) {
+         char link[101];
+         if (readImage(fs, link, (uint64_t)in.zone[0] * fs->zoneSize,
+                       in.size)) {
+            fprintf(stderr, "%s: %s", entry->path, minfsError());
+            exit(EXIT_FAILURE);
+         }
+         link[in.size] = '\0';
+         if (tarHeader(fd, path, entry, '2', 0, link)) {
+            fprintf(stderr, "%s: name too long to archive\n", entry->path);
+         }
+      }
+      else {
+         fprintf(stderr, "%s: can't be archived\n", entry->path);
+      }
+   }
+
+   fclose(list);
+   if (removedLen) {
+      memset(&removedEntry, 0, sizeof(removedEntry));
+      removedEntry.mode = 0644;
+      removedEntry.mtime = time(NULL);
+      tarHeader(fd, REMOVED_NAME, &removedEntry, '0', removedLen, NULL);
+      if (writeAll(fd, removed, removedLen)) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      tarPad(fd, removedLen);
+   }
+   free(removed);
+   if (writeAll(fd, zeros, sizeof(zeros)) || close(fd) < 0) {
+      fprintf(stderr, "Failed to write %s\n", file);
+      exit(EXIT_FAILURE);
+   }
+}
@@ -0,0 +1,74 @@
+#include "minCommon.h"
+
+#define DIFF_USAGE \
+"usage: %s [ -v ] [ -j num ] [ -p num [ -s num ] ] [ -o archive ] \
+[ -w manifest ] old new\n\
+       %s [ -v ] [ -j num ] [ -p num [ -s num ] ] -w manifest image\n\
+Lists what changed between two images, or between a manifest saved with\n\
+-w and an image: A added, D removed, M contents changed, C attributes\n\
+changed only.\n\
+Options:\n\
+\t-p\t part     --- select partition for filesystem (default: none)\n\
+\t-s\t sub      --- select subpartition for filesystem (default: none)\n\
+\t-j\t jobs     --- worker threads comparing and hashing files\n\
+\t\t\t\t(default: one per CPU)\n\
+\t-o\t archive  --- write the added and changed files, and a list of the\n\
+\t\t\t\tremoved ones, to a tar archive\n\
+\t-w\t manifest --- save a manifest of the new image to compare against\n\
+\t-v\t verbose  --- report how much was compared on stderr\n"
+
+#define MANIFEST_HEADER "mindiff manifest 1\n"
+#define REMOVED_NAME ".mindiff-removed"  /* the removals, in an archive */
+#define TAR_BLOCK 512
+#define MIN_TYPE(m) ((m)&0170000)
+#define MIN_ISLNK(m) (((m)&0170000)==0120000)
+
+/* what mindiff reports about a path */
+#define DIFF_SAME 0
+#define DIFF_ADDED 'A'
+#define DIFF_REMOVED 'D'
+#define DIFF_MODIFIED 'M'
+#define DIFF_CHANGED 'C'
+
+/* A file or directory on one side of the comparison, from an image's
+ * inode table or from a manifest line
+ */
+struct diffEntry {
+   char *path;
+   uint32_t inodeNum;            /* 0 if it came from a manifest */
+   uint16_t mode;
+   uint16_t uid;
+   uint16_t gid;
+   uint32_t size;
+   int32_t mtime;
+   int32_t ctime;
+   uint32_t zoneSum;             /* CRC32C of its zone pointers */
+   uint32_t firstZone;           /* where its data starts, for ordering */
+   uint32_t digest;              /* CRC32C of its contents, once known */
+   int hashed;                   /* digest is known */
+};
+
+/* every file and directory on one side, sorted by path */
+struct diffSide {
+   struct minfs *fs;             /* NULL for a manifest */
+   struct diffEntry *entries;
+   int count;
+   int max;
+};
+
+/* a path on one side or both, and what became of it */
+struct diffPair {
+   struct diffEntry *old;        /* NULL if it was added */
+   struct diffEntry *new;        /* NULL if it was removed */
+   int result;                   /* DIFF_SAME, DIFF_ADDED and so on */
+};
+
+void collectImage(struct minfs *fs, struct diffSide *side);
+int readManifest(const char *file, struct diffSide *side);
+void writeManifest(const char *file, struct diffSide *side, int threads);
+int compareContents(struct minfs *oldFs, struct inode *old,
+                    struct minfs *newFs, struct inode *new);
+struct diffPair *diffSides(struct diffSide *old, struct diffSide *new,
+                           int threads, int *count);
+void writeArchive(const char *file, struct minfs *fs, struct diffPair *pairs,
+                  int count);
@@ -0,0 +1,536 @@
+#include "minfind.h"
+
+/* the words that start a predicate, and so end the options */
+static const char *predicates[] = {
+   "-name", "-type", "-size", "-perm", "-mtime", "-uid", "-gid", NULL
+};
+
+int main(int argc, char *const argv[])
+{
+   /* This code allocates space for the path names
+      and sets all integer options to default values */
+   struct minOptions options;
+   options.verbose = 0;
+   options.eager = 0;
+   options.recursive = 0;
+   options.threads = 0;
+   options.nulDelim = 0;
+   options.socketPath = NULL;
+   options.destDir = NULL;
+   options.budget = DEFAULT_BUDGET;
+   options.rangeOffset = 0;
+   options.rangeLength = RANGE_TO_END;
+   options.stats = STATS_NONE;
+   options.indexFile = NULL;
+   options.format = FORMAT_TEXT;
+   options.readahead = DEFAULT_READAHEAD;
+   options.checksum = 0;
+   options.partition = -1;
+   options.subpartition = -1;
+   options.imagefile = malloc(NAME_MAX);
+   if (!options.imagefile) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+   options.path = malloc(PATH_MAX);
+   if (!options.path) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+   options.fullPath = malloc(PATH_MAX);
+   if (!options.fullPath) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+
+   /* options and operands come first, then the predicates */
+   int first, i;
+   for (first = 1; first < argc; first++) {
+      for (i = 0; predicates[i] && strcmp(argv[first], predicates[i]); i++) {
+      }
+      if (predicates[i]) {
+         break;
+      }
+   }
+   struct findQuery query;
+   parseQuery(argc, argv, first, &query);
+   parseArgs(first, argv, &options);
+
+   /* with -p all, the rest runs once per filesystem in the image */
+   struct minPart *part = eachPartition(&options, options.format);
+
+   /* every inode gets looked at, so read the whole table at once */
+   struct minfs fs;
+   if (part ? minfsOpenPart(&fs, options.imagefile, part, 1)
+            : minfsOpen(&fs, options.imagefile, options.partition,
+                        options.subpartition, 1)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   fs.readahead = options.readahead;
+
+   /* an index that can't be used is only a slower start */
+   if (options.indexFile && minfsUseIndex(&fs, options.indexFile)) {
+      fprintf(stderr, "%s", minfsError());
+   }
+
+   uint64_t start = phaseStart();
+   int64_t topNum = lookupPath(&fs, options.path);
+   if (topNum < 0) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   if (!topNum) {
+      fprintf(stderr, "%s: File not found.\n", options.fullPath);
+      exit(EXIT_FAILURE);
+   }
+   phaseEnd(&fs, PHASE_TRAVERSE, start);
+
+   /* one pass down the inode table picks out the matching inodes */
+   uint64_t inodeBits;
+   uint8_t *inodeMap = getBitmap(&fs, INODE_MAP, &inodeBits);
+   if (!inodeMap) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   start = phaseStart();
+   struct inodeColumns cols;
+   uint8_t *match = calloc(fs.numInodes + 1, 1);
+   if (!match) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   loadColumns(&fs, &cols);
+   if (cols.count > inodeBits - 1) {
+      cols.count = inodeBits - 1;
+   }
+   filterColumns(&cols, &query, inodeMap, match);
+   phaseEnd(&fs, PHASE_INODES, start);
+
+   /* and one pass over the directories names them */
+   findPaths(&fs, topNum, options.fullPath, &query, match, options.format);
+
+   if (options.stats) {
+      printIoStats(&fs, stderr, options.stats);
+   }
+   free(cols.mode);
+   free(cols.size);
+   free(cols.mtime);
+   free(cols.uid);
+   free(cols.gid);
+   free(match);
+   minfsClose(&fs);
+
+   exit(EXIT_SUCCESS);
+}
+
+/* Reads a predicate's number: decimal, or octal if octal is set, with
+ * an optional leading + or - saying how to compare, and for -size a K,
+ * M or G suffix. Returns 0, or -1 if it isn't one.
+ */
+static int parseNumber(const char *arg, int *cmp, int octal, int suffix,
+                       uint64_t *n) {
+   char *end;
+
+   *cmp = CMP_EQ;
+   if (*arg == '+' || *arg == '-') {
+      *cmp = *arg++ == '+' ? CMP_GT : CMP_LT;
+   }
+   if (*arg < '0' || *arg > '9') {
+      return -1;
+   }
+   *n = strtoull(arg, &end, octal ? 8 : 10);
+   if (suffix) {
+      switch (*end) {
+         case 'G': case 'g':
+            *n <<= 10;
+         /* fall through */
+         case 'M': case 'm':
+            *n <<= 10;
+         /* fall through */
+         case 'K': case 'k':
+            *n <<= 10;
+            end++;
+         break;
+      }
+   }
+   return *end ? -1 : 0;
+}
+
+/* Parses the predicates from argv[first] on into query, exiting with
+   the usage message on one it doesn't know */
+int parseQuery(int argc, char *const argv[], int first,
+               struct findQuery *query) {
+   int i;
+
+   memset(query, 0, sizeof(struct findQuery));
+   for (i = first; i < argc; i += 2) {
+      const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+      uint64_t n;
+      int cmp;
+
+      if (!arg) {
+         fprintf(stderr, "%s needs an argument\n", argv[i]);
+         fprintf(stderr, FIND_USAGE, argv[0]);
+         exit(EXIT_FAILURE);
+      }
+      if (!strcmp(argv[i], "-name")) {
+         query->name = arg;
+      }
+      else if (!strcmp(argv[i], "-type") &&
+               (!strcmp(arg, "f") || !strcmp(arg, "d"))) {
+         query->hasType = 1;
+         query->type = *arg == 'f' ? 0100000 : 0040000;
+      }
+      else if (!strcmp(argv[i], "-size") &&
+               !parseNumber(arg, &cmp, 0, 1, &n)) {
+         query->hasSize = 1;
+         query->sizeCmp = cmp;
+         query->size = n;
+      }
+      else if (!strcmp(argv[i], "-perm") &&
+               !parseNumber(arg + (*arg == '/'), &cmp, 1, 0, &n) &&
+               cmp != CMP_GT && n <= 07777) {
+         /* -mode is all of the bits, /mode any of them */
+         query->hasPerm = 1;
+         query->permCmp = *arg == '/' ? CMP_LT : *arg == '-' ? CMP_GT
+                                                             : CMP_EQ;
+         query->perm = n;
+      }
+      else if (!strcmp(argv[i], "-mtime") &&
+               !parseNumber(arg, &cmp, 0, 0, &n)) {
+         query->hasMtime = 1;
+         query->mtimeCmp = cmp;
+         query->mtimeDays = n;
+      }
+      else if (!strcmp(argv[i], "-uid") &&
+               !parseNumber(arg, &cmp, 0, 0, &n) && cmp == CMP_EQ) {
+         query->hasUid = 1;
+         query->uid = n;
+      }
+      else if (!strcmp(argv[i], "-gid") &&
+               !parseNumber(arg, &cmp, 0, 0, &n) && cmp == CMP_EQ) {
+         query->hasGid = 1;
+         query->gid = n;
+      }
+      else {
+         fprintf(stderr, "Bad predicate %s %s\n", argv[i], arg);
+         fprintf(stderr, FIND_USAGE, argv[0]);
+         exit(EXIT_FAILURE);
+      }
+   }
+   return 0;
+}
+
+/* Copies the attributes the predicates look at out of the inode table,
+   a column each */
+void loadColumns(struct minfs *fs, struct inodeColumns *cols) {
+   uint32_t i;
+
+   cols->count = fs->numInodes;
+   cols->mode = malloc(cols->count * sizeof(uint16_t) + 1);
+   cols->size = malloc(cols->count * sizeof(uint32_t) + 1);
+   cols->mtime = malloc(cols->count * sizeof(uint32_t) + 1);
+   cols->uid = malloc(cols->count * sizeof(uint16_t) + 1);
+   cols->gid = malloc(cols->count * sizeof(uint16_t) + 1);
+   if (!cols->mode || !cols->size || !cols->mtime || !cols->uid ||
+       !cols->gid) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < cols->count; i++) {
+      struct inode *in = fs->iTable + i;
+      cols->mode[i] = in->mode;
+      cols->size[i] = in->size;
+      cols->mtime[i] = in->mtime;
+      cols->uid[i] = in->uid;
+      cols->gid[i] = in->gid;
+   }
+}
+
+/* Marks match[n] for each inode n that is in use and meets every
+ * predicate but -name, which needs the directories. Each predicate is
+ * a branch-free pass down one column, so the compiler can vectorize it.
+ */
+void filterColumns(struct inodeColumns *cols, struct findQuery *query,
+                   uint8_t *inodeMap, uint8_t *match) {
+   uint8_t *m = match + 1;        /* m[i] is inode i + 1 */
+   uint32_t n = cols->count, i;
+
+   for (i = 0; i < n; i++) {
+      m[i] = (inodeMap[(i + 1) / 8] >> ((i + 1) % 8) & 1) &
+             (cols->mode[i] != 0);
+   }
+   if (query->hasType) {
+      uint16_t type = query->type;
+      for (i = 0; i < n; i++) {
+         m[i] &= (cols->mode[i] & 0170000) == type;
+      }
+   }
+   if (query->hasSize) {
+      uint64_t size = query->size;
+      if (query->sizeCmp == CMP_GT) {
+         for (i = 0; i < n; i++) {
+            m[i] &= cols->size[i] > size;
+         }
+      }
+      else if (query->sizeCmp == CMP_LT) {
+         for (i = 0; i < n; i++) {
+            m[i] &= cols->size[i] < size;
+         }
+      }
+      else {
+         for (i = 0; i < n; i++) {
+            m[i] &= cols->size[i] == size;
+         }
+      }
+   }
+   if (query->hasPerm) {
+      uint16_t perm = query->perm;
+      if (query->permCmp == CMP_GT) {
+         for (i = 0; i < n; i++) {
+            m[i] &= (cols->mode[i] & perm) == perm;
+         }
+      }
+      else if (query->permCmp == CMP_LT) {
+         for (i = 0; i < n; i++) {
+            m[i] &= (cols->mode[i] & perm) != 0;
+         }
+      }
+      else {
+         for (i = 0; i < n; i++) {
+            m[i] &= (cols->mode[i] & 07777) == perm;
+         }
+      }
+   }
+   if (query->hasMtime) {
+      /* whole days old: more than n days is at least n + 1 */
+      int64_t now = time(NULL);
+      int64_t newest = now - query->mtimeDays * 86400;
+      int64_t oldest = newest - 86400;
+      if (query->mtimeCmp == CMP_GT) {
+         for (i = 0; i < n; i++) {
+            m[i] &= (int64_t)cols->mtime[i] <= oldest;
+         }
+      }
+      else if (query->mtimeCmp == CMP_LT) {
+         for (i = 0; i < n; i++) {
+            m[i] &= (int64_t)cols->mtime[i] > newest;
+         }
+      }
+      else {
+         for (i = 0; i < n; i++) {
+            m[i] &= ((int64_t)cols->mtime[i] <= newest) &
+                    ((int64_t)cols->mtime[i] > oldest);
+         }
+      }
+   }
+   if (query->hasUid) {
+      uint16_t uid = query->uid;
+      for (i = 0; i < n; i++) {
+         m[i] &= cols->uid[i] == uid;
+      }
+   }
+   if (query->hasGid) {
+      uint16_t gid = query->gid;
+      for (i = 0; i < n; i++) {
+         m[i] &= cols->gid[i] == gid;
+      }
+   }
+}
+
+/* Builds the path of an entry called name in directory dir by following
+ * parents up to the search's top directory, whose path is topPath.
+ * Returns it, or NULL if dir isn't under the top.
+ */
+char *placePath(struct dirPlace *places, const char *names, uint32_t dir,
+                uint32_t top, const char *topPath, const char *name) {
+   size_t topLen = strlen(topPath), len = topLen + strlen(name) + 2;
+   uint32_t up = dir;
+   int depth = 0;
+
+   /* how long the path is, and that it leads to the top */
+   while (up != top) {
+      if (!places[up].parent || depth++ > PATH_MAX / 2) {
+         return NULL;
+      }
+      len += strlen(names + places[up].name) + 1;
+      up = places[up].parent;
+   }
+
+   /* fill it in from the end */
+   char *path = malloc(len);
+   if (!path) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   char *end = path + len - 1;
+   size_t part = strlen(name);
+   *end = '\0';
+   end -= part;
+   memcpy(end, name, part);
+   *--end = '/';
+   for (up = dir; up != top; up = places[up].parent) {
+      part = strlen(names + places[up].name);
+      end -= part;
+      memcpy(end, names + places[up].name, part);
+      *--end = '/';
+   }
+   /* the top's own path, less a trailing slash */
+   while (topLen && topPath[topLen - 1] == '/') {
+      topLen--;
+   }
+   end -= topLen;
+   memcpy(end, topPath, topLen);
+   if (end > path) {
+      memmove(path, end, strlen(end) + 1);
+   }
+   return path;
+}
+
+/* Orders matches by path */
+static int comparePaths(const void *a, const void *b) {
+   return strcmp(((const struct findPath *)a)->path,
+                 ((const struct findPath *)b)->path);
+}
+
+/* Reads every directory once, in inode order, noting where each
+ * directory sits and which entries are matching inodes (whose names
+ * match -name, if given). The matches under the top directory are then
+ * printed with their paths, sorted, in the given format.
+ */
+void findPaths(struct minfs *fs, uint32_t topNum, const char *topPath,
+               struct findQuery *query, uint8_t *match, int format) {
+   struct dirPlace *places = calloc(fs->numInodes + 1,
+                                    sizeof(struct dirPlace));
+   struct findMatch *matches = NULL;
+   struct findPath *paths;
+   char *names = NULL;
+   uint64_t namesLen = 0, namesMax = 0;
+   int numMatches = 0, maxMatches = 0, numPaths = 0, i;
+   uint32_t dirNum, any = 0;
+
+   if (!places) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (dirNum = 1; dirNum <= fs->numInodes && !any; dirNum++) {
+      any = match[dirNum];
+   }
+
+   uint64_t start = phaseStart();
+   for (dirNum = 1; any && dirNum <= fs->numInodes; dirNum++) {
+      struct inode *dir = fs->iTable + dirNum - 1;
+      struct fileEntry *entry;
+      struct inode *in;
+      struct dirIter it;
+      int ret;
+
+      if (!MIN_ISDIR(dir->mode) || !dir->links ||
+          dirOpen(fs, *dir, &it)) {
+         continue;
+      }
+      while ((ret = dirNext(&it, &entry, &in)) > 0) {
+         char name[DIRSIZ + 1];
+         uint32_t num = entry->inode;
+         memcpy(name, entry->name, DIRSIZ);
+         name[DIRSIZ] = '\0';
+         if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            continue;
+         }
+
+         /* the first directory to name a directory is its parent */
+         if (MIN_ISDIR(in->mode) && num != ROOT_INODE &&
+             !places[num].parent) {
+            size_t len = strlen(name) + 1;
+            if (namesLen + len > namesMax) {
+               namesMax = namesMax ? namesMax * 2 : 65536;
+               names = realloc(names, namesMax);
+               if (!names) {
+                  fprintf(stderr, "Malloc is failing\n");
+                  exit(EXIT_FAILURE);
+               }
+            }
+            memcpy(names + namesLen, name, len);
+            places[num].parent = dirNum;
+            places[num].name = namesLen;
+            namesLen += len;
+         }
+
+         if (match[num] &&
+             (!query->name || !fnmatch(query->name, name, 0))) {
+            if (numMatches == maxMatches) {
+               maxMatches = maxMatches ? maxMatches * 2 : 64;
+               matches = realloc(matches,
+                                 maxMatches * sizeof(struct findMatch));
+               if (!matches) {
+                  fprintf(stderr, "Malloc is failing\n");
+                  exit(EXIT_FAILURE);
+               }
+            }
+            matches[numMatches].dir = dirNum;
+            matches[numMatches].inodeNum = num;
+            strcpy(matches[numMatches++].name, name);
+         }
+      }
+      dirClose(&it);
+      if (ret < 0) {
+         fprintf(stderr, "inode %u: %s", dirNum, minfsError());
+      }
+   }
+
+   /* the matches under the top, with the top itself if it matches */
+   paths = malloc((numMatches + 1) * sizeof(struct findPath));
+   if (!paths) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   const char *topName = strrchr(topPath, '/');
+   topName = topName && topName[1] ? topName + 1 : topPath;
+   if (match[topNum] &&
+       (!query->name || !fnmatch(query->name, topName, 0))) {
+      paths[numPaths].inodeNum = topNum;
+      paths[numPaths].path = strdup(topPath);
+      if (!paths[numPaths++].path) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   for (i = 0; i < numMatches; i++) {
+      char *path = placePath(places, names, matches[i].dir, topNum,
+                             topPath, matches[i].name);
+      if (path) {
+         paths[numPaths].inodeNum = matches[i].inodeNum;
+         paths[numPaths++].path = path;
+      }
+   }
+   qsort(paths, numPaths, sizeof(struct findPath), comparePaths);
+   phaseEnd(fs, PHASE_TRAVERSE, start);
+
+   start = phaseStart();
+   struct outBuf out;
+   outInit(&out, STDOUT_FILENO, format);
+   formatStart(&out);
+   for (i = 0; i < numPaths; i++) {
+      if (format == FORMAT_TEXT) {
+         outString(&out, paths[i].path);
+         outWrite(&out, "\n", 1);
+      }
+      else {
+         struct inode in;
+         if (!copyInode(fs, paths[i].inodeNum, &in)) {
+            formatEntry(&out, &in, paths[i].inodeNum, NULL, paths[i].path,
+                        PATH_MAX);
+         }
+      }
+      free(paths[i].path);
+   }
+   formatEnd(&out);
+   if (outFlush(&out)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   outFree(&out);
+   phaseEnd(fs, PHASE_OUTPUT, start);
+   free(paths);
+   free(matches);
+   free(names);
+   free(places);
+}
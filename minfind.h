@@ -0,0 +1,81 @@
+#include "minCommon.h"
+#include <fnmatch.h>
+
+#define FIND_USAGE \
+"usage: %s [ -v ] [ --format=text|json|ndjson|nul ] \
+[ -p num [ -s num ] ] imagefile [ path ] [ predicate ... ]\n\
+Predicates (all must hold):\n\
+\t-name glob\t the entry's name matches the glob\n\
+\t-type f|d\t a regular file, or a directory\n\
+\t-size [+-]n[kMG]\t more than (+), less than (-) or exactly n bytes\n\
+\t-perm [-/]mode\t exactly these permission bits (octal), all of them\n\
+\t\t\t (-), or any of them (/)\n\
+\t-mtime [+-]n\t modified more than (+), less than (-) or exactly n\n\
+\t\t\t whole days ago\n\
+\t-uid n\t\t owned by user n\n\
+\t-gid n\t\t owned by group n\n"
+
+/* how a number in a predicate compares */
+#define CMP_EQ 0
+#define CMP_GT 1
+#define CMP_LT 2
+
+/* the predicates a search was given; fields not asked for are unset */
+struct findQuery {
+   const char *name;             /* -name glob, NULL for any */
+   int hasType;
+   uint16_t type;                /* -type, as the mode's format bits */
+   int hasSize;
+   int sizeCmp;
+   uint64_t size;
+   int hasPerm;
+   int permCmp;                  /* CMP_EQ exact, CMP_GT all, CMP_LT any */
+   uint16_t perm;
+   int hasMtime;
+   int mtimeCmp;
+   int64_t mtimeDays;
+   int hasUid;
+   uint16_t uid;
+   int hasGid;
+   uint16_t gid;
+};
+
+/* the inode table as a structure of arrays, one column per attribute
+   the predicates look at, so each filter runs down a single array */
+struct inodeColumns {
+   uint32_t count;               /* inodes 1..count */
+   uint16_t *mode;
+   uint32_t *size;
+   uint32_t *mtime;
+   uint16_t *uid;
+   uint16_t *gid;
+};
+
+/* where a directory sits: its parent and its name there */
+struct dirPlace {
+   uint32_t parent;              /* 0 until some directory names it */
+   uint32_t name;                /* offset of its name in the name pool */
+};
+
+/* an entry that matched, found on the directory pass */
+struct findMatch {
+   uint32_t dir;                 /* the directory it was found in */
+   uint32_t inodeNum;
+   char name[DIRSIZ + 1];
+};
+
+/* a match under the top directory, ready to print */
+struct findPath {
+   char *path;
+   uint32_t inodeNum;
+};
+
+int parseQuery(int argc, char *const argv[], int first,
+               struct findQuery *query);
+void loadColumns(struct minfs *fs, struct inodeColumns *cols);
+void filterColumns(struct inodeColumns *cols, struct findQuery *query,
+                   uint8_t *inodeMap, uint8_t *match);
+char *placePath(struct dirPlace *places, const char *names, uint32_t dir,
+                uint32_t top, const char *topPath, const char *name);
+void findPaths(struct minfs *fs, uint32_t topNum, const char *topPath,
+               struct findQuery *query, uint8_t *match, int format);
@@ -2,12 +2,45 @@
 
 char fullPath[PATH_MAX] = "";
 
+/* what -r has found to extract */
+static struct extractFile *files = NULL;
+static int numFiles = 0, maxFiles = 0;
+static struct extractDir *dirs = NULL;
+static int numDirs = 0, maxDirs = 0;
+static uint8_t *extracted;          /* directory inodes seen, one bit each */
+static struct minfs *srcFs;         /* the filesystem -r is copying from */
+static int hashing = 0;             /* collecting for --checksum, not -r */
+
+/* bytes -r may still put in flight before workers have to wait */
+static uint64_t budgetLeft;
+static uint64_t chunkSize;
+static pthread_mutex_t budgetLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budgetFreed = PTHREAD_COND_INITIALIZER;
+
+/* what -r wrote: file sizes, and the host space they ended up taking */
+static uint64_t logicalBytes = 0;
+static uint64_t allocatedBytes = 0;
+
 int main(int argc, char *const argv[])
 {
    /* This code allocates space for the path names
       and sets all integer options to default values */
    struct minOptions options;
    options.verbose = 0;
+   options.eager = 0;
+   options.recursive = 0;
+   options.threads = 0;
+   options.nulDelim = 0;
+   options.socketPath = NULL;
+   options.destDir = NULL;
+   options.budget = DEFAULT_BUDGET;
+   options.rangeOffset = 0;
+   options.rangeLength = RANGE_TO_END;
+   options.stats = STATS_NONE;
+   options.indexFile = NULL;
+   options.format = FORMAT_TEXT;
+   options.readahead = DEFAULT_READAHEAD;
+   options.checksum = 0;
    options.partition = INVALID_OPTION;
    options.subpartition = INVALID_OPTION;
    options.imagefile = malloc(NAME_MAX);
@@ -27,45 +60,531 @@ int main(int argc, char *const argv[])
    that parses the arguments */
 
    parseArgs(argc, argv, &options);
+
+   /* with -p all, the rest runs once per filesystem in the image; the
+      copies of one file would run together on stdout */
+   if (options.partition == ALL_PARTITIONS && !options.destDir &&
+       !options.checksum) {
+      fprintf(stderr, "-p all needs -r or --checksum\n");
+      exit(EXIT_FAILURE);
+   }
+   struct minPart *part = eachPartition(&options,
+                                        options.checksum ? FORMAT_TEXT
+                                                         : FORMAT_RAW);
    strcpy(fullPath, options.fullPath);
 
-   struct minixConfig config;
-   config.image = NULL;
+   struct minfs fs;
 
+   /* gets the image. inode-table blocks are read as lookups 
+      need them, unless asked to read the whole table */
+   if (part ? minfsOpenPart(&fs, options.imagefile, part, options.eager)
+            : minfsOpen(&fs, options.imagefile, options.partition,
+                        options.subpartition, options.eager)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
 
-   /* gets the image */
-   getMinixConfig(options, &config);
-   image = config.image;
-   zone_size = config.zone_size;
-   numInodes = config.sb.ninodes;
+   fs.readahead = options.readahead;
 
-   /* Read the root directory table */
-   fseekPartition(image, (2 + config.sb.i_blocks + config.sb.z_blocks) 
-                         * config.sb.blocksize, 
-                  SEEK_SET);
+   /* an index that can't be used is only a slower start */
+   if (options.indexFile && minfsUseIndex(&fs, options.indexFile)) {
+      fprintf(stderr, "%s", minfsError());
+   }
 
-   iTable = (struct inode*) malloc(numInodes * sizeof(struct inode));
-   size_t result = fread(iTable, sizeof(struct inode), numInodes, image);
-   if (result != numInodes) {
-      fprintf(stderr, "Error reading in the image to the iNode table\n");
+   if (options.checksum && (options.destDir || options.rangeOffset ||
+                            options.rangeLength != RANGE_TO_END)) {
+      fprintf(stderr, "--checksum doesn't go with -r, --offset or --length\n");
+      exit(EXIT_FAILURE);
    }
 
-   /* traverses through the root to find the file
-      user searched for */ 
-   struct inode destFile = traversePath(iTable, 
-   	config.sb.ninodes, options.path);
+   /* with --checksum, a CRC32C for the file or each file under
+      the directory, instead of the contents */
+   if (options.checksum) {
+      uint64_t start = phaseStart();
+      int64_t srcNum = lookupPath(&fs, options.path);
+      if (srcNum < 0) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      if (!srcNum) {
+         fprintf(stderr, "%s: File not found.\n", fullPath);
+         exit(EXIT_FAILURE);
+      }
+      phaseEnd(&fs, PHASE_TRAVERSE, start);
+      hashTree(&fs, srcNum, options.path, options.threads);
+   }
+   /* with -r, recreates the whole tree under the path
+      in the destination directory */
+   else if (options.destDir) {
+      char *srcPath = strdup(options.path);
+      if (options.rangeOffset || options.rangeLength != RANGE_TO_END) {
+         fprintf(stderr, "--offset and --length don't go with -r\n");
+         exit(EXIT_FAILURE);
+      }
+      uint64_t start = phaseStart();
+      int64_t srcNum = lookupPath(&fs, options.path);
+      if (srcNum < 0) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      if (!srcNum) {
+         fprintf(stderr, "%s: File not found.\n", srcPath);
+         exit(EXIT_FAILURE);
+      }
+      phaseEnd(&fs, PHASE_TRAVERSE, start);
+      extractTree(&fs, srcNum, srcPath, options.destDir,
+                  options.threads, options.budget);
+   }
+   else {
+      /* traverses through the root to find the file
+         user searched for */ 
+      struct inode destFile;
+      uint64_t start = phaseStart();
+      if (traversePath(&fs, options.path, &destFile)) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      phaseEnd(&fs, PHASE_TRAVERSE, start);
 
+      /* streams all the contents of the zones 
+         (including direct, indirect, and double)
+         for the file the user is searching for,
+         straight from the image to stdout */
+      if (MIN_ISREG(destFile.mode)) {
+         int ret;
+         start = phaseStart();
+         if (options.rangeOffset || options.rangeLength != RANGE_TO_END) {
+            /* only the zones in the range, and the pointer
+               blocks leading to them, are read */
+            uint64_t offset = options.rangeOffset;
+            if (options.rangeOffset < 0) {
+               offset = -options.rangeOffset < destFile.size ? 
+                        destFile.size + options.rangeOffset : 0;
+            }
+            ret = streamRange(&fs, destFile, offset, options.rangeLength, 
+                              STDOUT_FILENO);
+         }
+         else {
+            ret = streamFile(&fs, destFile, STDOUT_FILENO);
+         }
+         if (ret) {
+            fprintf(stderr, "%s", minfsError());
+            exit(EXIT_FAILURE);
+         }
+         phaseEnd(&fs, PHASE_COPY, start);
+      }
+      else {
+         printf("%s: Not a regular file\n", fullPath);
+      }
+   }
 
-   /* gets the all the contents of the zones 
-      (including direct, indirect, and double)
-      for the file the user is searching for */
-   char *data = copyZones(destFile);
-   if (MIN_ISREG(destFile.mode)) {
-   	printf("%s", data);
+   if (options.stats) {
+      printIoStats(&fs, stderr, options.stats);
    }
-   else {
-   	printf("%s: Not a regular file\n", fullPath);
+   if (options.verbose) {
+      if (options.destDir) {
+         fprintf(stderr, "%d files: %llu bytes logical, %llu allocated\n",
+                 numFiles,
+                 (unsigned long long)logicalBytes,
+                 (unsigned long long)allocatedBytes);
+      }
    }
+   minfsClose(&fs);
 
    exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
+
+/* Grows an array by doubling so that it has room for one more item */
+static void *growArray(void *array, int count, int *max, size_t size) {
+   if (count < *max) {
+      return array;
+   }
+   *max = *max ? *max * 2 : 64;
+   array = realloc(array, *max * size);
+   if (!array) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   return array;
+}
+
+/* Resolves a file's extents for -r, giving up on an unreadable image */
+static int mapFile(struct inode *in, struct extent **extents) {
+   int numExtents = mapExtents(srcFs, *in, extents);
+   if (numExtents < 0) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   return numExtents;
+}
+
+/* Physical address of a file's first data zone, 0 if it has none */
+static uint32_t firstZone(struct inode *in) {
+   struct extent *extents;
+   int numExtents = mapFile(in, &extents), i;
+   uint32_t zone = 0;
+
+   for (i = 0; i < numExtents && !zone; i++) {
+      zone = extents[i].zone;
+   }
+   free(extents);
+   return zone;
+}
+
+/* Orders files by where their data starts on disk */
+static int compareFirstZone(const void *a, const void *b) {
+   uint32_t za = ((struct extractFile *)a)->firstZone;
+   uint32_t zb = ((struct extractFile *)b)->firstZone;
+   return za < zb ? -1 : za > zb;
+}
+
+/* Creates the host directory for an image directory, then walks its
+   entries, recording regular files to extract and descending into
+   real subdirectories (never . or .., never one seen before). For
+   --checksum nothing is created, and the paths are image paths. */
+void collectTree(struct inode *dir, char *hostPath) {
+   struct fileEntry *entry;
+   struct inode *in;
+   struct dirIter it;
+   int ret;
+
+   /* owner-writable until the real mode is set at the end */
+   if (!hashing) {
+      if (mkdir(hostPath, 0700) < 0 && errno != EEXIST) {
+         fprintf(stderr, "Failed to create %s (errno: %d)\n", 
+                 hostPath, errno);
+         exit(EXIT_FAILURE);
+      }
+      dirs = growArray(dirs, numDirs, &maxDirs, sizeof(struct extractDir));
+      dirs[numDirs].hostPath = hostPath;
+      dirs[numDirs++].in = *dir;
+   }
+
+   if (dirOpen(srcFs, *dir, &it)) {
+      fprintf(stderr, "%s: %s", hostPath, minfsError());
+      exit(EXIT_FAILURE);
+   }
+   while ((ret = dirNext(&it, &entry, &in)) > 0) {
+      char *name = entry->name;
+      char *childPath;
+      if (!strncmp(name, ".", DIRSIZ) || !strncmp(name, "..", DIRSIZ)) {
+         continue;
+      }
+      if (asprintf(&childPath, "%s/%.*s", hostPath, DIRSIZ, name) < 0) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+
+      if (MIN_ISDIR(in->mode)) {
+         uint8_t bit = 1 << (entry->inode % 8);
+         if (!(extracted[entry->inode / 8] & bit)) {
+            extracted[entry->inode / 8] |= bit;
+            collectTree(in, childPath);
+            continue;
+         }
+      }
+      else if (MIN_ISREG(in->mode)) {
+         files = growArray(files, numFiles, &maxFiles, 
+                           sizeof(struct extractFile));
+         files[numFiles].hostPath = childPath;
+         files[numFiles].in = *in;
+         files[numFiles++].firstZone = firstZone(in);
+         continue;
+      }
+      free(childPath);
+   }
+   dirClose(&it);
+   if (ret < 0) {
+      fprintf(stderr, "%s: %s", hostPath, minfsError());
+      exit(EXIT_FAILURE);
+   }
+   if (hashing) {
+      free(hostPath);
+   }
+}
+
+/* Waits until len more bytes may be in flight, then claims them */
+static void claimBudget(uint64_t len) {
+   pthread_mutex_lock(&budgetLock);
+   while (budgetLeft < len) {
+      pthread_cond_wait(&budgetFreed, &budgetLock);
+   }
+   budgetLeft -= len;
+   pthread_mutex_unlock(&budgetLock);
+}
+
+/* Gives back bytes claimed with claimBudget */
+static void releaseBudget(uint64_t len) {
+   pthread_mutex_lock(&budgetLock);
+   budgetLeft += len;
+   pthread_cond_broadcast(&budgetFreed);
+   pthread_mutex_unlock(&budgetLock);
+}
+
+/* Writes len bytes of buf at offset in fd, riding out short writes */
+static void pwriteAll(int fd, const char *buf, uint64_t len, 
+                      uint64_t offset, const char *hostPath) {
+   while (len) {
+      ssize_t put = pwrite(fd, buf, len, offset);
+      if (put < 0 && errno == EINTR) {
+         continue;
+      }
+      if (put < 0) {
+         fprintf(stderr, "error writing %s (%d)\n", hostPath, errno);
+         exit(EXIT_FAILURE);
+      }
+      buf += put;
+      len -= put;
+      offset += put;
+   }
+}
+
+/* Sets a host file's permissions and times from its inode */
+static void setAttributes(int fd, struct inode *in, const char *hostPath) {
+   struct timespec times[2];
+   times[0].tv_sec = in->atime;
+   times[0].tv_nsec = 0;
+   times[1].tv_sec = in->mtime;
+   times[1].tv_nsec = 0;
+   if (fchmod(fd, in->mode & 07777) < 0 || futimens(fd, times) < 0) {
+      fprintf(stderr, "Failed to set attributes of %s (errno: %d)\n", 
+              hostPath, errno);
+   }
+}
+
+/* Worker for -r: copies one file out of the image in budget-sized
+   chunks, pread from the image and pwrite into the host file. Holes
+   are never written, so the host file stays sparse. */
+static void extractOne(int index, void *arg) {
+   struct extractFile *file = files + index;
+   struct readAhead ra;
+   struct extent *extents;
+   struct stat st;
+   int numExtents, i;
+   int fd = open(file->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd < 0) {
+      fprintf(stderr, "Failed to create %s (errno: %d)\n", 
+              file->hostPath, errno);
+      exit(EXIT_FAILURE);
+   }
+
+   numExtents = mapFile(&file->in, &extents);
+   startReadahead(&ra, srcFs, extents, numExtents);
+   for (i = 0; i < numExtents; i++) {
+      uint64_t done = 0;
+      if (!extents[i].zone) {
+         __atomic_add_fetch(&srcFs->stats.holes, extents[i].length, 
+                            __ATOMIC_RELAXED);
+         continue;
+      }
+      while (done < extents[i].length) {
+         uint64_t len = extents[i].length - done;
+         len = len < chunkSize ? len : chunkSize;
+
+         readAheadTo(&ra, extents[i].offset + done);
+         claimBudget(len);
+         char *buf = malloc(len);
+         if (!buf) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+         if (readImage(srcFs, buf, 
+                       (uint64_t)extents[i].zone * srcFs->zoneSize + done, 
+                       len)) {
+            fprintf(stderr, "%s", minfsError());
+            exit(EXIT_FAILURE);
+         }
+         countData(srcFs, len);
+         pwriteAll(fd, buf, len, extents[i].offset + done, file->hostPath);
+         free(buf);
+         releaseBudget(len);
+         done += len;
+      }
+   }
+   free(extents);
+
+   /* a trailing hole still counts toward the size */
+   if (ftruncate(fd, file->in.size) < 0) {
+      fprintf(stderr, "error writing %s (%d)\n", file->hostPath, errno);
+      exit(EXIT_FAILURE);
+   }
+   if (fstat(fd, &st) == 0) {
+      __atomic_add_fetch(&allocatedBytes, (uint64_t)st.st_blocks * 512,
+                         __ATOMIC_RELAXED);
+   }
+   __atomic_add_fetch(&logicalBytes, file->in.size, __ATOMIC_RELAXED);
+
+   setAttributes(fd, &file->in, file->hostPath);
+   close(fd);
+}
+
+/* Recreates the tree under an image path (a directory, or a single
+   file) inside destDir on the host. Files are copied by a pool of
+   threads in the order their data sits in the image, keeping image
+   reads sequential, with no more than budget bytes in flight. Modes
+   and times are carried over from the inodes. */
+void extractTree(struct minfs *fs, uint32_t srcNum, char *srcPath, 
+                 char *destDir, int threads, uint64_t budget) {
+   struct inode src;
+   int i;
+
+   srcFs = fs;
+   if (copyInode(fs, srcNum, &src)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   extracted = calloc(fs->numInodes / 8 + 1, 1);
+   if (!extracted) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+
+   uint64_t start = phaseStart();
+   if (MIN_ISDIR(src.mode)) {
+      extracted[srcNum / 8] |= 1 << (srcNum % 8);
+      collectTree(&src, strdup(destDir));
+   }
+   else if (MIN_ISREG(src.mode)) {
+      /* the file keeps its own name, whatever trails the path */
+      char base[PATH_MAX], *name;
+      size_t len;
+      snprintf(base, sizeof(base), "%s", srcPath);
+      len = strlen(base);
+      while (len > 1 && base[len - 1] == '/') {
+         base[--len] = '\0';
+      }
+      name = strrchr(base, '/') ? strrchr(base, '/') + 1 : base;
+      if (mkdir(destDir, 0777) < 0 && errno != EEXIST) {
+         fprintf(stderr, "Failed to create %s (errno: %d)\n", 
+                 destDir, errno);
+         exit(EXIT_FAILURE);
+      }
+      files = growArray(files, 0, &maxFiles, sizeof(struct extractFile));
+      if (asprintf(&files[0].hostPath, "%s/%s", destDir, name) < 0) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+      files[0].in = src;
+      numFiles = 1;
+   }
+   else {
+      fprintf(stderr, "%s: Not a regular file\n", srcPath);
+      exit(EXIT_FAILURE);
+   }
+
+   /* sequential image reads: copy files in on-disk order */
+   qsort(files, numFiles, sizeof(struct extractFile), compareFirstZone);
+   phaseEnd(fs, PHASE_TRAVERSE, start);
+
+   start = phaseStart();
+   budgetLeft = budget;
+   chunkSize = budget < EXTRACT_CHUNK ? budget : EXTRACT_CHUNK;
+   runOrdered(threads, numFiles, extractOne, NULL);
+   phaseEnd(fs, PHASE_COPY, start);
+
+   /* directories last, deepest first, so that writing into them
+      doesn't disturb the times just set */
+   start = phaseStart();
+   for (i = numDirs - 1; i >= 0; i--) {
+      int fd = open(dirs[i].hostPath, O_RDONLY | O_DIRECTORY);
+      if (fd >= 0) {
+         setAttributes(fd, &dirs[i].in, dirs[i].hostPath);
+         close(fd);
+      }
+      free(dirs[i].hostPath);
+   }
+   phaseEnd(fs, PHASE_OUTPUT, start);
+   for (i = 0; i < numFiles; i++) {
+      free(files[i].hostPath);
+   }
+   free(files);
+   free(dirs);
+   free(extracted);
+}
+
+/* Worker for --checksum: works out one file's CRC32C */
+static void hashOne(int index, void *arg) {
+   struct extractFile *file = files + index;
+   if (hashFile(srcFs, file->in, &file->digest)) {
+      fprintf(stderr, "%s: %s", file->hostPath, minfsError());
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Orders files by path, for the --checksum manifest */
+static int comparePath(const void *a, const void *b) {
+   return strcmp(((struct extractFile *)a)->hostPath,
+                 ((struct extractFile *)b)->hostPath);
+}
+
+/* Prints the CRC32C of the file at an image path, or a manifest of
+   the CRC32C of every regular file under it, sorted by path. Files
+   are hashed by a pool of threads in the order their data sits in
+   the image. */
+void hashTree(struct minfs *fs, uint32_t srcNum, char *srcPath,
+              int threads) {
+   struct outBuf out;
+   struct inode src;
+   char digest[16];
+   int i;
+
+   srcFs = fs;
+   hashing = 1;
+   if (copyInode(fs, srcNum, &src)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   extracted = calloc(fs->numInodes / 8 + 1, 1);
+   if (!extracted) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+
+   uint64_t start = phaseStart();
+   if (MIN_ISDIR(src.mode)) {
+      /* paths under / start with a single slash */
+      char *prefix = strdup(srcPath);
+      size_t len = prefix ? strlen(prefix) : 0;
+      while (len && prefix[len - 1] == '/') {
+         prefix[--len] = '\0';
+      }
+      extracted[srcNum / 8] |= 1 << (srcNum % 8);
+      collectTree(&src, prefix);
+   }
+   else if (MIN_ISREG(src.mode)) {
+      files = growArray(files, 0, &maxFiles, sizeof(struct extractFile));
+      files[0].hostPath = strdup(fullPath);
+      files[0].in = src;
+      files[0].firstZone = 0;
+      numFiles = 1;
+   }
+   else {
+      fprintf(stderr, "%s: Not a regular file\n", fullPath);
+      exit(EXIT_FAILURE);
+   }
+   qsort(files, numFiles, sizeof(struct extractFile), compareFirstZone);
+   phaseEnd(fs, PHASE_TRAVERSE, start);
+
+   start = phaseStart();
+   runOrdered(threads, numFiles, hashOne, NULL);
+   phaseEnd(fs, PHASE_COPY, start);
+
+   start = phaseStart();
+   qsort(files, numFiles, sizeof(struct extractFile), comparePath);
+   outInit(&out, STDOUT_FILENO, FORMAT_TEXT);
+   for (i = 0; i < numFiles; i++) {
+      snprintf(digest, sizeof(digest), "%08x  ", files[i].digest);
+      outString(&out, digest);
+      outString(&out, files[i].hostPath);
+      outWrite(&out, "\n", 1);
+      free(files[i].hostPath);
+   }
+   if (outFlush(&out)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   outFree(&out);
+   phaseEnd(fs, PHASE_OUTPUT, start);
+   free(files);
+   free(extracted);
+}
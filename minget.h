@@ -1 +1,23 @@
-#include "minCommon.h"
\ No newline at end of file
+#include "minCommon.h"
+
+#define EXTRACT_CHUNK (1 << 20)  /* most bytes -r copies in one go */
+
+/* a regular file for minget -r to copy out */
+struct extractFile {
+   char *hostPath;
+   struct inode in;
+   uint32_t firstZone;           /* where its data starts on disk */
+   uint32_t digest;              /* its CRC32C, for --checksum */
+};
+
+/* a directory minget -r has created, to get its attributes at the end */
+struct extractDir {
+   char *hostPath;
+   struct inode in;
+};
+
+void collectTree(struct inode *dir, char *hostPath);
+void extractTree(struct minfs *fs, uint32_t srcNum, char *srcPath,
+                 char *destDir, int threads, uint64_t budget);
+void hashTree(struct minfs *fs, uint32_t srcNum, char *srcPath,
+              int threads);
\ No newline at end of file
@@ -2,10 +2,33 @@
 
 char fullPath[PATH_MAX] = "";
 
+/* directory inodes already listed by -R, one bit each */
+static uint8_t *listed;
+
+/* the filesystem -R is listing, for its worker tasks */
+static struct minfs *treeFs;
+
+/* the listing on its way to stdout */
+static struct outBuf out;
+
 int main(int argc, char *const argv[])
 {
    struct minOptions options;
    options.verbose = 0;
+   options.eager = 0;
+   options.recursive = 0;
+   options.threads = 0;
+   options.nulDelim = 0;
+   options.socketPath = NULL;
+   options.destDir = NULL;
+   options.budget = DEFAULT_BUDGET;
+   options.rangeOffset = 0;
+   options.rangeLength = RANGE_TO_END;
+   options.stats = STATS_NONE;
+   options.indexFile = NULL;
+   options.format = FORMAT_TEXT;
+   options.readahead = DEFAULT_READAHEAD;
+   options.checksum = 0;
    options.partition = -1;
    options.subpartition = -1;
    options.imagefile = malloc(NAME_MAX);
@@ -25,34 +48,73 @@ int main(int argc, char *const argv[])
    }
 
    parseArgs(argc, argv, &options);
+
+   /* with -p all, the rest runs once per filesystem in the image */
+   struct minPart *part = eachPartition(&options, options.format);
    strcpy(fullPath, options.fullPath);
 
 
-   struct minixConfig config;
-   config.image = NULL;
+   struct minfs fs;
 
-   getMinixConfig(options, &config);
-   image = config.image;
-   zone_size = config.zone_size;
-   numInodes = config.sb.ninodes;
+   /* inode-table blocks are read as lookups need them, 
+      unless asked to read the whole table */
+   if (part ? minfsOpenPart(&fs, options.imagefile, part, options.eager)
+            : minfsOpen(&fs, options.imagefile, options.partition,
+                        options.subpartition, options.eager)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
 
-   /* Read the root directory table */
-   fseekPartition(image, (2 + config.sb.i_blocks + config.sb.z_blocks) 
-                         * config.sb.blocksize, 
-                  SEEK_SET);
+   fs.readahead = options.readahead;
 
-   iTable = (struct inode*) malloc(numInodes * sizeof(struct inode));
-   size_t result = fread(iTable, sizeof(struct inode), numInodes, image);
-   if (result != numInodes) {
-      fprintf(stderr, "Error reading in the image to the iNode table\n");
+   /* an index that can't be used is only a slower start */
+   if (options.indexFile && minfsUseIndex(&fs, options.indexFile)) {
+      fprintf(stderr, "%s", minfsError());
    }
 
-   struct inode destFile = traversePath(iTable, 
-      config.sb.ninodes, options.path);
-   if (MIN_ISDIR(destFile.mode)) {
-      printf("%s:\n", options.path);
+   char *listPath = strdup(options.path);
+   struct inode destFile;
+   uint64_t start = phaseStart();
+   int64_t destNum = lookupPath(&fs, options.path);
+   if (!destNum) {
+      fprintf(stderr, "%s: File not found.\n", listPath);
+      exit(EXIT_FAILURE);
+   }
+   if (destNum < 0 || copyInode(&fs, destNum, &destFile)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   phaseEnd(&fs, PHASE_TRAVERSE, start);
+
+   outInit(&out, STDOUT_FILENO, options.format);
+   formatStart(&out);
+   if (options.recursive && MIN_ISDIR(destFile.mode)) {
+      listTree(&fs, destNum, listPath, options.threads);
+   }
+   else {
+      start = phaseStart();
+      if (MIN_ISDIR(destFile.mode)) {
+         formatDirHeader(&out, listPath);
+      }
+      if (printInodeFiles(&fs, &destFile, destNum, listPath)) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      phaseEnd(&fs, PHASE_OUTPUT, start);
+   }
+   start = phaseStart();
+   formatEnd(&out);
+   if (outFlush(&out)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
    }
-   printInodeFiles(&destFile);
+   outFree(&out);
+   phaseEnd(&fs, PHASE_OUTPUT, start);
+
+   if (options.stats) {
+      printIoStats(&fs, stderr, options.stats);
+   }
+   minfsClose(&fs);
 
    exit(EXIT_SUCCESS);
 }
@@ -60,79 +122,170 @@ int main(int argc, char *const argv[])
 /* Given an inode, if the inode is a file,
    it prints the permissions, size and name of the file.
    If the file is a directory, then this function prints
-   all the contents of the directory 
+   all the contents of the directory. Returns 0, or -1 if the
+   directory can't be read.
 */ 
-void printInodeFiles(struct inode *in) {
+int printInodeFiles(struct minfs *fs, struct inode *in, uint32_t inodeNum,
+                    const char *path) {
    if (MIN_ISREG(in->mode)) {
-      printPermissions(in->mode);
-      printf("%10u ", in->size);
-      printf("%s\n", fullPath);
+      formatEntry(&out, in, inodeNum, NULL, fullPath, PATH_MAX);
    }
 
    if (MIN_ISDIR(in->mode)) {
-      struct fileEntry *fileEntries = getFileEntries(*in);
-      int numFiles = in->size/sizeof(struct fileEntry);
-      printFiles(fileEntries, numFiles);
+      return formatDirEntries(fs, &out, *in, path);
    }
+   return 0;
 }
 
-/* Given a point to a list of file entries in a directory,
-   this function traverses through those file entries
-   and calls a function that prints information about 
-   each file 
+/* 
+   Orders directory entries by name for the recursive listing
 */
-void printFiles(struct fileEntry *fileEntries, int numFiles) {
-   int i;
-   for(i = 0; i < numFiles; i++) {
-      /* only print the contents of the file if the inode
-         is valid (if the inode is zero, it signifies a
-         deleted file which we don't want to print) */
-      if (fileEntries[i].inode) {
-         printFile(&fileEntries[i]);
-      }
-   }
+static int compareEntries(const void *a, const void *b) {
+   return strncmp(((struct liveEntry *)a)->entry.name, 
+                  ((struct liveEntry *)b)->entry.name, DIRSIZ);
 }
 
-/* This function takes in a pointer to a single 
-   file entry in a directory and prints out the 
-   permissions, size, and name of the file 
+/* 
+   Marks a directory inode as listed, returning nonzero if it
+   already was (a cycle, or a second link to the same directory)
 */
-void printFile(struct fileEntry *file) {
-   struct inode *iNode = (struct inode *) getInode(file->inode);
-   if (iNode != NULL) {   
-      printPermissions(iNode->mode);
-      printf("%10u ", iNode->size);
-      printf("%s\n", file->name);
-   }
+static int markListed(uint32_t inodeNum) {
+   uint8_t bit = 1 << (inodeNum % 8);
+   return __atomic_fetch_or(listed + inodeNum / 8, bit, 
+                            __ATOMIC_RELAXED) & bit;
 }
 
 /*
-   This function prints out the permissions
-   of a file given the mode of the inode. 
+   Worker task for the recursive listing: reads one directory,
+   formats its sorted entries into the node's listing, and
+   queues a task for each real subdirectory found
 */
-void printPermissions(uint16_t mode) {
-   printSinglePerm(MIN_ISDIR(mode), 'd');
-   printSinglePerm(mode & MIN_IRUSR, 'r');
-   printSinglePerm(mode & MIN_IWUSR, 'w');
-   printSinglePerm(mode & MIN_IXUSR, 'x');
-   printSinglePerm(mode & MIN_IRGRP, 'r');
-   printSinglePerm(mode & MIN_IWGRP, 'w');
-   printSinglePerm(mode & MIN_IXGRP, 'x');
-   printSinglePerm(mode & MIN_IROTH, 'r');
-   printSinglePerm(mode & MIN_IWOTH, 'w');
-   printSinglePerm(mode & MIN_IXOTH, 'x');
+static void listDirTask(struct taskPool *pool, void *task) {
+   struct dirNode *node = task;
+   struct liveEntry *entries = NULL;
+   struct fileEntry *entry;
+   struct inode dir, *in;
+   struct dirIter it;
+   int numLive = 0, maxLive = 0, i, ret;
+
+   if (copyInode(treeFs, node->inodeNum, &dir) || !MIN_ISDIR(dir.mode)) {
+      return;
+   }
+
+   /* gather the live entries with their inodes, then sort by name */
+   if (dirOpen(treeFs, dir, &it)) {
+      fprintf(stderr, "%s: %s", node->path, minfsError());
+      return;
+   }
+   while ((ret = dirNext(&it, &entry, &in)) > 0) {
+      if (numLive == maxLive) {
+         maxLive = maxLive ? maxLive * 2 : 16;
+         entries = realloc(entries, maxLive * sizeof(struct liveEntry));
+         if (!entries) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      entries[numLive].entry = *entry;
+      entries[numLive++].in = *in;
+   }
+   dirClose(&it);
+   if (ret < 0) {
+      fprintf(stderr, "%s: %s", node->path, minfsError());
+      free(entries);
+      return;
+   }
+   qsort(entries, numLive, sizeof(struct liveEntry), compareEntries);
+
+   node->children = malloc(numLive * sizeof(struct dirNode *) + 1);
+   if (!node->children) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+
+   outInit(&node->listing, -1, out.format);
+   formatDirHeader(&node->listing, node->path);
+   for (i = 0; i < numLive; i++) {
+      char *name = entries[i].entry.name;
+      in = &entries[i].in;
+      formatEntry(&node->listing, in, entries[i].entry.inode, node->path,
+                  name, DIRSIZ);
+
+      /* only descend into real directories, never back up 
+         through . or .., and never into one already listed */
+      if (!MIN_ISDIR(in->mode) || !strncmp(name, ".", DIRSIZ) || 
+          !strncmp(name, "..", DIRSIZ) ||
+          markListed(entries[i].entry.inode)) {
+         continue;
+      }
+
+      struct dirNode *child = calloc(1, sizeof(struct dirNode));
+      if (!child || asprintf(&child->path, "%s%s%.*s", node->path,
+          node->path[strlen(node->path) - 1] == '/' ? "" : "/",
+          DIRSIZ, name) < 0) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+      child->inodeNum = entries[i].entry.inode;
+      node->children[node->numChildren++] = child;
+   }
+   free(entries);
+
+   for (i = 0; i < node->numChildren; i++) {
+      submitTask(pool, node->children[i]);
+   }
 }
 
 /*
-   Prints out a single permission. 
+   Prints a finished listing tree depth first, each directory
+   followed by its subdirectories in name order, then frees it
 */
-void printSinglePerm(int print, char c) {
-   if (print) {
-      printf("%c", c);
+static void printTree(struct dirNode *node) {
+   int i;
+   outAppend(&out, &node->listing);
+   for (i = 0; i < node->numChildren; i++) {
+      if (out.format == FORMAT_TEXT) {
+         outWrite(&out, "\n", 1);
+      }
+      printTree(node->children[i]);
    }
-   else {
-      printf("-");
+   free(node->children);
+   outFree(&node->listing);
+   free(node->path);
+   free(node);
+}
+
+/*
+   Lists the directory tree under the given directory inode.
+   Directories are read in parallel by a pool of worker threads
+   that steal subdirectories from each other, but the output is
+   always the same: each directory's entries sorted by name, and
+   subdirectories listed depth first in name order.
+*/
+void listTree(struct minfs *fs, uint32_t inodeNum, char *path, 
+              int threads) {
+   struct dirNode *root = calloc(1, sizeof(struct dirNode));
+   treeFs = fs;
+   listed = calloc(fs->numInodes / 8 + 1, 1);
+   if (!root || !listed) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
    }
+   root->inodeNum = inodeNum;
+   root->path = path;
+   markListed(inodeNum);
+
+   uint64_t start = phaseStart();
+   struct taskPool *pool = createPool(threads, listDirTask);
+   submitTask(pool, root);
+   runPool(pool);
+   freePool(pool);
+   phaseEnd(fs, PHASE_TRAVERSE, start);
+
+   start = phaseStart();
+   printTree(root);
+   phaseEnd(fs, PHASE_OUTPUT, start);
+   free(listed);
 }
 
 /* 
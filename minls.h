@@ -1,10 +1,24 @@
 #include "minCommon.h"
 
+/* one directory of a recursive listing */
+struct dirNode {
+   uint32_t inodeNum;
+   char *path;
+   struct outBuf listing;        /* formatted entries, filled by a worker */
+   struct dirNode **children;    /* subdirectories, in name order */
+   int numChildren;
+};
+
+/* a live directory entry and its inode, sorted by name for -R */
+struct liveEntry {
+   struct fileEntry entry;
+   struct inode in;
+};
+
 void printPartition(struct part_entry partitionPtr);
 void printSuperblock(struct superblock sb);
-void printFile(struct fileEntry *file);
-void printFiles(struct fileEntry *fileEntries, int numFiles);
 void printInode(struct inode in);
-void printInodeFiles(struct inode *in);
-void printPermissions(uint16_t mode);
-void printSinglePerm(int print, char c);
\ No newline at end of file
+int printInodeFiles(struct minfs *fs, struct inode *in, uint32_t inodeNum,
+                    const char *path);
+void listTree(struct minfs *fs, uint32_t inodeNum, char *path,
+              int threads);
\ No newline at end of file
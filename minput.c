@@ -0,0 +1,848 @@
+#include "minput.h"
+
+/* the image being added to, read through the library and written
+   through a descriptor of its own */
+static struct minfs fs;
+static int imageFd = -1;
+static uint32_t zoneSize, perZone;
+
+/* the bitmaps and inode table, changed in memory and written back at
+   the end, a run of changed blocks at a time */
+static uint8_t *inodeMap, *zoneMap;
+static uint64_t inodeBits, zoneBits;
+static uint8_t *inodeMapDirty, *zoneMapDirty, *inodeTableDirty;
+static uint64_t inodeCursor = 1, zoneCursor = 1;  /* where searches start */
+
+/* directories added to so far */
+static struct putDir **dirs = NULL;
+static int numDirs = 0, maxDirs = 0;
+
+/* what was written, for -v */
+static uint64_t filesPut = 0, dirsPut = 0, bytesPut = 0;
+static uint64_t zonesPut = 0, extentsPut = 0, metaBlocks = 0, writes = 0;
+
+int main(int argc, char *const argv[])
+{
+   int partition = INVALID_OPTION, subpartition = INVALID_OPTION;
+   int verbose = 0, opt;
+
+   while ((opt = getopt(argc, argv, "vp:s:")) != -1) {
+      switch (opt) {
+         case 'v':
+            verbose = 1;
+         break;
+         case 'p':
+            partition = atoi(optarg);
+            if (partition < 0 || partition > 3) {
+               fprintf(stderr, "Partition %d out of range.  "
+                       "Must be 0..3.\n", partition);
+               fprintf(stderr, PUT_USAGE, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+         case 's':
+            subpartition = atoi(optarg);
+            if (subpartition < 0 || subpartition > 3) {
+               fprintf(stderr, "Subpartition %d out of range.  "
+                       "Must be 0..3.\n", subpartition);
+               fprintf(stderr, PUT_USAGE, argv[0]);
+               exit(EXIT_FAILURE);
+            }
+         break;
+         default:
+            fprintf(stderr, PUT_USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+   if (argc - optind < 2 || argc - optind > 3) {
+      fprintf(stderr, PUT_USAGE, argv[0]);
+      exit(EXIT_FAILURE);
+   }
+   const char *imagefile = argv[optind];
+   const char *source = argv[optind + 1];
+   const char *dest = argc - optind > 2 ? argv[optind + 2] : "/";
+
+   openTarget(imagefile, partition, subpartition);
+
+   /* dest is either a directory to put source in, or a new name in
+      one; paths are from / either way */
+   char destPath[PATH_MAX], *name;
+   snprintf(destPath, sizeof(destPath), "%s%s", *dest == '/' ? "" : "/",
+            dest);
+   while (strlen(destPath) > 1 && destPath[strlen(destPath) - 1] == '/') {
+      destPath[strlen(destPath) - 1] = '\0';
+   }
+   int64_t destNum = lookupPath(&fs, destPath);
+   if (destNum < 0) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   if (destNum && MIN_ISDIR(fs.iTable[destNum - 1].mode)) {
+      char base[PATH_MAX];
+      snprintf(base, sizeof(base), "%s", source);
+      while (strlen(base) > 1 && base[strlen(base) - 1] == '/') {
+         base[strlen(base) - 1] = '\0';
+      }
+      name = strrchr(base, '/') ? strrchr(base, '/') + 1 : base;
+      putFile(source, getDir(destNum), name);
+   }
+   else if (destNum) {
+      fprintf(stderr, "%s: already exists\n", destPath);
+      exit(EXIT_FAILURE);
+   }
+   else {
+      name = strrchr(destPath, '/');
+      *name++ = '\0';
+      int64_t parentNum = lookupPath(&fs, *destPath ? destPath : "/");
+      if (parentNum < 0) {
+         fprintf(stderr, "%s", minfsError());
+         exit(EXIT_FAILURE);
+      }
+      if (!parentNum || !MIN_ISDIR(fs.iTable[parentNum - 1].mode)) {
+         fprintf(stderr, "%s: No such directory\n",
+                 *destPath ? destPath : "/");
+         exit(EXIT_FAILURE);
+      }
+      putFile(source, getDir(parentNum), name);
+   }
+
+   finishPut();
+   if (verbose) {
+      fprintf(stderr, "%llu files and %llu directories, %llu bytes\n",
+              (unsigned long long)filesPut, (unsigned long long)dirsPut,
+              (unsigned long long)bytesPut);
+      fprintf(stderr, "%llu zones allocated in %llu extents\n",
+              (unsigned long long)zonesPut, (unsigned long long)extentsPut);
+      fprintf(stderr, "%llu metadata blocks written in %llu writes\n",
+              (unsigned long long)metaBlocks, (unsigned long long)writes);
+   }
+   minfsClose(&fs);
+
+   exit(EXIT_SUCCESS);
+}
+
+/* Writes len bytes at offset within the filesystem's partition, or
+   exits */
+static void writeImage(const void *buf, uint64_t len, uint64_t offset) {
+   const char *next = buf;
+   offset += fs.partitionOffset;
+   writes++;
+   while (len) {
+      ssize_t put = pwrite(imageFd, next, len, offset);
+      if (put < 0 && errno == EINTR) {
+         continue;
+      }
+      if (put <= 0) {
+         fprintf(stderr, "error writing image (%d)\n", errno);
+         exit(EXIT_FAILURE);
+      }
+      next += put;
+      len -= put;
+      offset += put;
+   }
+}
+
+/* Reads len bytes at offset within the partition, or exits */
+static void readTarget(void *buf, uint64_t len, uint64_t offset) {
+   if (readImage(&fs, buf, offset, len)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Allocates zeroed memory, or exits */
+static void *zalloc(size_t len) {
+   void *mem = calloc(1, len ? len : 1);
+   if (!mem) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   return mem;
+}
+
+/* Opens the filesystem to be added to: reads it through the library,
+ * takes copies of its bitmaps to change, and opens it for writing
+ */
+void openTarget(const char *imagefile, int partition, int subpartition) {
+   uint8_t *map;
+
+   if (!strcmp(imagefile, "-")) {
+      fprintf(stderr, "minput needs an image file, not -\n");
+      exit(EXIT_FAILURE);
+   }
+   if (minfsOpen(&fs, imagefile, partition, subpartition, 1)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   if (fs.gz) {
+      fprintf(stderr, "Compressed images can't be written\n");
+      exit(EXIT_FAILURE);
+   }
+   imageFd = open(imagefile, O_WRONLY);
+   if (imageFd < 0) {
+      fprintf(stderr, "Failed to open %s for writing (errno: %d)\n",
+              imagefile, errno);
+      exit(EXIT_FAILURE);
+   }
+   zoneSize = fs.zoneSize;
+   perZone = zoneSize / sizeof(uint32_t);
+
+   map = getBitmap(&fs, INODE_MAP, &inodeBits);
+   if (!map) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   inodeMap = zalloc((uint64_t)fs.sb.i_blocks * fs.blockSize);
+   memcpy(inodeMap, map, (uint64_t)fs.sb.i_blocks * fs.blockSize);
+   map = getBitmap(&fs, ZONE_MAP, &zoneBits);
+   if (!map) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   zoneMap = zalloc((uint64_t)fs.sb.z_blocks * fs.blockSize);
+   memcpy(zoneMap, map, (uint64_t)fs.sb.z_blocks * fs.blockSize);
+
+   /* bits past the inodes the table holds can't be handed out */
+   if (inodeBits > (uint64_t)fs.numInodes + 1) {
+      inodeBits = (uint64_t)fs.numInodes + 1;
+   }
+   inodeMapDirty = zalloc(fs.sb.i_blocks);
+   zoneMapDirty = zalloc(fs.sb.z_blocks);
+   inodeTableDirty = zalloc(fs.numInodes / fs.inodesPerBlock + 1);
+}
+
+/* Notes that an inode has changed */
+static void touchInode(uint32_t inodeNum) {
+   inodeTableDirty[(inodeNum - 1) / fs.inodesPerBlock] = 1;
+}
+
+/* Sets len bits of a bitmap from bit start, noting the blocks changed */
+static void setBits(uint8_t *map, uint8_t *dirty, uint64_t start,
+                    uint64_t len) {
+   uint64_t bitsPerBlock = (uint64_t)fs.blockSize * 8, bit;
+
+   for (bit = start; bit < start + len; bit++) {
+      map[bit / 8] |= 1 << (bit % 8);
+   }
+   for (bit = start / bitsPerBlock; bit <= (start + len - 1) / bitsPerBlock;
+        bit++) {
+      dirty[bit] = 1;
+   }
+}
+
+/* Hands out a free inode, searching on from the last one handed out */
+uint32_t allocInode(void) {
+   uint64_t len, bit;
+
+   bit = findRun(inodeMap, inodeCursor, inodeBits, 0, &len);
+   if (bit >= inodeBits) {
+      bit = findRun(inodeMap, 1, inodeBits, 0, &len);
+   }
+   if (bit >= inodeBits) {
+      fprintf(stderr, "Out of inodes\n");
+      exit(EXIT_FAILURE);
+   }
+   setBits(inodeMap, inodeMapDirty, bit, 1);
+   inodeCursor = bit + 1;
+   return bit;
+}
+
+/* Allocates up to want zones in one contiguous run, returning the first
+ * with how many there are in *got. A run straight after hint (the
+ * file's last zone, or 0) is taken first, so a file grows in place;
+ * then the first free run that holds all of them, searching on from the
+ * last allocation so files put one after another sit one after another;
+ * failing that, the longest run there is. The zone map is searched a
+ * word at a time by findRun, skipping whole words of zones in use.
+ */
+uint32_t allocZones(uint32_t want, uint32_t hint, uint32_t *got) {
+   uint64_t bestBit = 0, bestLen = 0, bit, len, from, to;
+   int pass, grown = 0;
+
+   /* the zones straight after hint, if they're free */
+   if (hint >= fs.sb.firstdata) {
+      bit = (uint64_t)hint - fs.sb.firstdata + 2;
+      if (bit < zoneBits && findRun(zoneMap, bit, zoneBits, 0, &len) == bit) {
+         bestBit = bit;
+         bestLen = len;
+         grown = 1;
+      }
+   }
+   /* otherwise from the cursor to the end, then from the start */
+   for (pass = 0; pass < 2 && !grown && bestLen < want; pass++) {
+      from = pass ? 1 : zoneCursor;
+      to = pass ? zoneCursor : zoneBits;
+      while (bestLen < want &&
+             (bit = findRun(zoneMap, from, to, 0, &len)) < to) {
+         if (len > bestLen) {
+            bestBit = bit;
+            bestLen = len;
+         }
+         from = bit + len;
+      }
+   }
+   if (!bestLen) {
+      fprintf(stderr, "Out of zones\n");
+      exit(EXIT_FAILURE);
+   }
+   if (bestLen > want) {
+      bestLen = want;
+   }
+   setBits(zoneMap, zoneMapDirty, bestBit, bestLen);
+   zoneCursor = bestBit + bestLen;
+   zonesPut += bestLen;
+   extentsPut += !grown;
+   *got = bestLen;
+   return bestBit + fs.sb.firstdata - 1;
+}
+
+/* Reads the zone table at zone, or if there isn't one yet allocates a
+ * zone for it, noting in *dirty that it has to be written. Returns the
+ * table, with its zone in *zone.
+ */
+static uint32_t *openTable(uint32_t *zone, int *dirty) {
+   uint32_t *table = zalloc(zoneSize), got;
+
+   if (*zone) {
+      readTarget(table, zoneSize, (uint64_t)*zone * zoneSize);
+   }
+   else {
+      *zone = allocZones(1, 0, &got);
+      *dirty = 1;
+   }
+   return table;
+}
+
+/* Finds where a file records which zone holds its zone index, reading
+ * the indirect tables on the way. With create set, tables the file
+ * hasn't got are allocated; otherwise NULL is returned for a zone no
+ * table covers. *dirty is set to the flag to raise when the slot
+ * changes, or NULL if the slot is in the inode itself.
+ */
+static uint32_t *zoneSlot(struct zoneTables *tables, uint64_t index,
+                          int create, int **dirty) {
+   struct inode *in = fs.iTable + tables->inodeNum - 1;
+   uint64_t second;
+   uint32_t before;
+
+   *dirty = NULL;
+   if (index < DIRECT_ZONES) {
+      return in->zone + index;
+   }
+   index -= DIRECT_ZONES;
+   if (index < perZone) {
+      if (!tables->indirect) {
+         if (!in->indirect && !create) {
+            return NULL;
+         }
+         before = in->indirect;
+         tables->indirect = openTable(&in->indirect, &tables->dirtyIndirect);
+         if (in->indirect != before) {
+            touchInode(tables->inodeNum);
+         }
+      }
+      *dirty = &tables->dirtyIndirect;
+      return tables->indirect + index;
+   }
+   index -= perZone;
+   second = index / perZone;
+   if (second >= perZone) {
+      fprintf(stderr, "File too big for %u-byte zones\n", zoneSize);
+      exit(EXIT_FAILURE);
+   }
+   if (!tables->doubleIndirect) {
+      if (!in->two_indirect && !create) {
+         return NULL;
+      }
+      before = in->two_indirect;
+      tables->doubleIndirect = openTable(&in->two_indirect,
+                                         &tables->dirtyDouble);
+      if (in->two_indirect != before) {
+         touchInode(tables->inodeNum);
+      }
+      tables->second = zalloc(perZone * sizeof(uint32_t *));
+      tables->dirtySecond = zalloc(perZone * sizeof(int));
+   }
+   if (!tables->second[second]) {
+      if (!tables->doubleIndirect[second] && !create) {
+         return NULL;
+      }
+      before = tables->doubleIndirect[second];
+      tables->second[second] = openTable(tables->doubleIndirect + second,
+                                         tables->dirtySecond + second);
+      if (tables->doubleIndirect[second] != before) {
+         tables->dirtyDouble = 1;
+      }
+   }
+   *dirty = tables->dirtySecond + second;
+   return tables->second[second] + index % perZone;
+}
+
+/* Returns the zone holding zone index of a file, 0 for none */
+static uint32_t getZone(struct zoneTables *tables, uint64_t index) {
+   int *dirty;
+   uint32_t *slot = zoneSlot(tables, index, 0, &dirty);
+   return slot ? *slot : 0;
+}
+
+/* Records that zone index of a file is in zone */
+static void setZone(struct zoneTables *tables, uint64_t index,
+                    uint32_t zone) {
+   int *dirty;
+   uint32_t *slot = zoneSlot(tables, index, 1, &dirty);
+   *slot = zone;
+   if (dirty) {
+      *dirty = 1;
+   }
+   else {
+      touchInode(tables->inodeNum);
+   }
+}
+
+/* Writes out the zone tables of a file that have changed */
+static void writeTables(struct zoneTables *tables) {
+   struct inode *in = fs.iTable + tables->inodeNum - 1;
+   uint64_t i;
+
+   if (tables->dirtyIndirect) {
+      writeImage(tables->indirect, zoneSize, (uint64_t)in->indirect * zoneSize);
+      metaBlocks += zoneSize / fs.blockSize;
+      tables->dirtyIndirect = 0;
+   }
+   if (tables->dirtyDouble) {
+      writeImage(tables->doubleIndirect, zoneSize,
+                 (uint64_t)in->two_indirect * zoneSize);
+      metaBlocks += zoneSize / fs.blockSize;
+      tables->dirtyDouble = 0;
+   }
+   for (i = 0; tables->second && i < perZone; i++) {
+      if (tables->dirtySecond[i]) {
+         writeImage(tables->second[i], zoneSize,
+                    (uint64_t)tables->doubleIndirect[i] * zoneSize);
+         metaBlocks += zoneSize / fs.blockSize;
+         tables->dirtySecond[i] = 0;
+      }
+   }
+}
+
+/* Lets go of a file's zone tables */
+static void freeTables(struct zoneTables *tables) {
+   uint64_t i;
+
+   for (i = 0; tables->second && i < perZone; i++) {
+      free(tables->second[i]);
+   }
+   free(tables->indirect);
+   free(tables->doubleIndirect);
+   free(tables->second);
+   free(tables->dirtySecond);
+   memset(tables, 0, sizeof(struct zoneTables));
+}
+
+/* Allocates count zones for a file, from zone index first on, in as few
+ * runs as there are free: all of its data first, so that the indirect
+ * tables allocated as the zones are recorded go after it rather than
+ * splitting it up. hint is the zone before, 0 for none.
+ */
+static void allocFileZones(struct zoneTables *tables, uint64_t first,
+                           uint64_t count, uint32_t hint) {
+   uint32_t *starts = zalloc(count * sizeof(uint32_t));
+   uint32_t *lengths = zalloc(count * sizeof(uint32_t));
+   uint64_t done = 0, runs = 0, i, j;
+
+   while (done < count) {
+      uint64_t want = count - done;
+      starts[runs] = allocZones(want > UINT32_MAX ? UINT32_MAX : want, hint,
+                                lengths + runs);
+      done += lengths[runs];
+      hint = starts[runs] + lengths[runs] - 1;
+      runs++;
+   }
+   for (i = 0, done = first; i < runs; i++) {
+      for (j = 0; j < lengths[i]; j++) {
+         setZone(tables, done++, starts[i] + j);
+      }
+   }
+   free(starts);
+   free(lengths);
+}
+
+/* Sets up a new inode from what the host says about the file */
+static struct inode *newInode(uint32_t inodeNum, struct stat *st,
+                              uint16_t type) {
+   struct inode *in = fs.iTable + inodeNum - 1;
+
+   memset(in, 0, sizeof(struct inode));
+   in->mode = type | (st->st_mode & 07777);
+   in->links = 1;
+   in->uid = st->st_uid;
+   in->gid = st->st_gid;
+   in->atime = st->st_atime;
+   in->mtime = st->st_mtime;
+   in->ctime = time(NULL);
+   touchInode(inodeNum);
+   return in;
+}
+
+/* Adds a directory to those being added to, with its contents in a
+   buffer of whole zones */
+static struct putDir *addDir(uint32_t inodeNum, void *data, uint64_t size,
+                             int created) {
+   struct putDir *dir = zalloc(sizeof(struct putDir));
+
+   dir->inodeNum = inodeNum;
+   dir->max = (size / zoneSize + 1) * zoneSize;
+   dir->data = zalloc(dir->max);
+   memcpy(dir->data, data, size);
+   dir->created = created;
+   dir->tables.inodeNum = inodeNum;
+
+   if (numDirs == maxDirs) {
+      maxDirs = maxDirs ? maxDirs * 2 : 16;
+      dirs = realloc(dirs, maxDirs * sizeof(struct putDir *));
+      if (!dirs) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   dirs[numDirs++] = dir;
+   return dir;
+}
+
+/* Returns an existing directory, read into memory the first time */
+struct putDir *getDir(uint32_t inodeNum) {
+   struct inode *in = fs.iTable + inodeNum - 1;
+   int i;
+
+   for (i = 0; i < numDirs; i++) {
+      if (dirs[i]->inodeNum == inodeNum) {
+         return dirs[i];
+      }
+   }
+   void *data = copyZones(&fs, *in);
+   if (!data) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   struct putDir *dir = addDir(inodeNum, data, in->size, 0);
+   free(data);
+   return dir;
+}
+
+/* Adds an entry to a directory in memory, in the first free slot or at
+   the end. A name the directory already has is an error. */
+static void addEntry(struct putDir *dir, const char *name,
+                     uint32_t inodeNum) {
+   struct inode *in = fs.iTable + dir->inodeNum - 1;
+   struct fileEntry *entries = (struct fileEntry *)dir->data;
+   uint64_t count = in->size / sizeof(struct fileEntry), slot = count, i;
+
+   /* one minput made itself has only names from one host directory */
+   for (i = 0; !dir->created && i < count; i++) {
+      if (entries[i].inode && !strncmp(entries[i].name, name, DIRSIZ)) {
+         fprintf(stderr, "%.*s: already exists\n", DIRSIZ, name);
+         exit(EXIT_FAILURE);
+      }
+      if (!entries[i].inode && slot == count) {
+         slot = i;
+      }
+   }
+   if (slot == count) {
+      if ((count + 1) * sizeof(struct fileEntry) > dir->max) {
+         dir->data = realloc(dir->data, dir->max * 2);
+         if (!dir->data) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+         memset(dir->data + dir->max, 0, dir->max);
+         dir->max *= 2;
+         entries = (struct fileEntry *)dir->data;
+      }
+      in->size += sizeof(struct fileEntry);
+   }
+   entries[slot].inode = inodeNum;
+   memset(entries[slot].name, 0, DIRSIZ);
+   strncpy(entries[slot].name, name, DIRSIZ);
+
+   uint64_t from = slot * sizeof(struct fileEntry);
+   uint64_t to = from + sizeof(struct fileEntry);
+   if (!dir->dirtyTo || from < dir->dirtyFrom) {
+      dir->dirtyFrom = from;
+   }
+   if (to > dir->dirtyTo) {
+      dir->dirtyTo = to;
+   }
+   in->mtime = in->ctime = time(NULL);
+   touchInode(dir->inodeNum);
+}
+
+/* Copies a host file's contents into newly allocated zones, a chunk at
+   a time, padding the last zone with zeros */
+static void copyData(int fd, const char *hostPath, struct inode *in,
+                     struct zoneTables *tables) {
+   static uint8_t *buf = NULL;
+   uint64_t numZones = ((uint64_t)in->size + zoneSize - 1) / zoneSize;
+   uint64_t index = 0;
+
+   if (!buf) {
+      buf = zalloc(COPY_CHUNK);
+   }
+   allocFileZones(tables, 0, numZones, 0);
+   while (index < numZones) {
+      /* a run of consecutive zones goes in one write */
+      uint32_t zone = getZone(tables, index);
+      uint64_t run = 1, len, got = 0;
+      while (index + run < numZones && run < COPY_CHUNK / zoneSize &&
+             getZone(tables, index + run) == zone + run) {
+         run++;
+      }
+      len = run * zoneSize;
+      while (got < len) {
+         ssize_t n = read(fd, buf + got, len - got);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         }
+         if (n < 0) {
+            fprintf(stderr, "error reading %s (%d)\n", hostPath, errno);
+            exit(EXIT_FAILURE);
+         }
+         if (!n) {
+            break;
+         }
+         got += n;
+      }
+      memset(buf + got, 0, len - got);
+      writeImage(buf, len, (uint64_t)zone * zoneSize);
+      index += run;
+   }
+}
+
+/* Orders host directory entries by name */
+static int compareNames(const struct dirent **a, const struct dirent **b) {
+   return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/* Puts the host file or directory at hostPath into dir as name, and
+ * everything under a directory after it. Anything else (a symlink, a
+ * device) is skipped with a warning. Nothing on the image refers to
+ * what has been written until finishPut, so exiting part way leaves the
+ * filesystem as it was. Returns the new inode, or 0 if skipped.
+ */
+uint32_t putFile(const char *hostPath, struct putDir *dir, const char *name) {
+   struct stat st;
+   uint32_t inodeNum;
+
+   if (lstat(hostPath, &st) < 0) {
+      fprintf(stderr, "Failed to stat %s (errno: %d)\n", hostPath, errno);
+      exit(EXIT_FAILURE);
+   }
+   if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+      fprintf(stderr, "%s: not a regular file or directory, skipped\n",
+              hostPath);
+      return 0;
+   }
+   if (!*name || strlen(name) > DIRSIZ || strchr(name, '/')) {
+      fprintf(stderr, "%s: bad name for an entry\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if (S_ISREG(st.st_mode)) {
+      if ((uint64_t)st.st_size > fs.sb.max_file ||
+          (uint64_t)st.st_size > UINT32_MAX) {
+         fprintf(stderr, "%s: too big for the filesystem\n", hostPath);
+         exit(EXIT_FAILURE);
+      }
+      int fd = open(hostPath, O_RDONLY);
+      if (fd < 0) {
+         fprintf(stderr, "Failed to open file %s (errno: %d)\n", hostPath,
+                 errno);
+         exit(EXIT_FAILURE);
+      }
+      inodeNum = allocInode();
+      struct inode *in = newInode(inodeNum, &st, 0100000);
+      in->size = st.st_size;
+      addEntry(dir, name, inodeNum);
+
+      /* a file's tables are done with once it is */
+      struct zoneTables tables;
+      memset(&tables, 0, sizeof(tables));
+      tables.inodeNum = inodeNum;
+      copyData(fd, hostPath, in, &tables);
+      writeTables(&tables);
+      freeTables(&tables);
+      close(fd);
+      filesPut++;
+      bytesPut += st.st_size;
+      return inodeNum;
+   }
+
+   /* a directory starts with . and .., and holds its parent's link */
+   struct fileEntry dots[2];
+   inodeNum = allocInode();
+   struct inode *in = newInode(inodeNum, &st, 0040000);
+   in->links = 2;
+   in->size = sizeof(dots);
+   memset(dots, 0, sizeof(dots));
+   dots[0].inode = inodeNum;
+   strcpy(dots[0].name, ".");
+   dots[1].inode = dir->inodeNum;
+   strcpy(dots[1].name, "..");
+   addEntry(dir, name, inodeNum);
+   fs.iTable[dir->inodeNum - 1].links++;
+   struct putDir *sub = addDir(inodeNum, dots, sizeof(dots), 1);
+   sub->dirtyFrom = 0;
+   sub->dirtyTo = sizeof(dots);
+   dirsPut++;
+
+   struct dirent **names;
+   int count = scandir(hostPath, &names, NULL, compareNames), i;
+   if (count < 0) {
+      fprintf(stderr, "Failed to read directory %s (errno: %d)\n", hostPath,
+              errno);
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < count; i++) {
+      char *childPath;
+      if (strcmp(names[i]->d_name, ".") && strcmp(names[i]->d_name, "..")) {
+         if (asprintf(&childPath, "%s/%s", hostPath, names[i]->d_name) < 0) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+         putFile(childPath, sub, names[i]->d_name);
+         free(childPath);
+      }
+      free(names[i]);
+   }
+   free(names);
+   return inodeNum;
+}
+
+/* Writes the changed zones of a directory from index up to (not
+   including) end, a run of consecutive ones at a time */
+static void writeDirZones(struct putDir *dir, uint64_t index, uint64_t end) {
+   while (index < end) {
+      uint32_t zone = getZone(&dir->tables, index);
+      uint64_t run = 1;
+      while (index + run < end &&
+             getZone(&dir->tables, index + run) == zone + run) {
+         run++;
+      }
+      writeImage(dir->data + index * zoneSize, run * zoneSize,
+                 (uint64_t)zone * zoneSize);
+      metaBlocks += run * zoneSize / fs.blockSize;
+      index += run;
+   }
+}
+
+/* Writes the zones a directory holding changed entries has grown into,
+   allocating them straight after the ones it has, and its zone tables.
+   Changes to the zones it already had are left to writeOldZones. */
+static void writeDir(struct putDir *dir) {
+   uint64_t first = dir->dirtyFrom / zoneSize;
+   uint64_t last = (dir->dirtyTo - 1) / zoneSize, index, missing = 0;
+   uint32_t hint = first ? getZone(&dir->tables, first - 1) : 0;
+
+   if (!dir->dirtyTo) {
+      return;
+   }
+   for (index = first; index <= last; index++) {
+      if (!getZone(&dir->tables, index)) {
+         missing++;
+      }
+   }
+   /* a directory only grows at its end, so what's missing is the tail */
+   if (missing) {
+      allocFileZones(&dir->tables, last + 1 - missing, missing,
+                     last + 1 - missing ?
+                     getZone(&dir->tables, last - missing) : hint);
+   }
+   dir->zonesHad = last + 1 - missing;
+   writeDirZones(dir, first > dir->zonesHad ? first : dir->zonesHad,
+                 last + 1);
+   writeTables(&dir->tables);
+}
+
+/* Writes the changes to the zones a directory already had: the entries
+   that make what was added reachable. Then lets go of its tables. */
+static void writeOldZones(struct putDir *dir) {
+   uint64_t first = dir->dirtyFrom / zoneSize;
+
+   if (dir->dirtyTo && first < dir->zonesHad) {
+      writeDirZones(dir, first, dir->zonesHad);
+   }
+   freeTables(&dir->tables);
+}
+
+/* Writes the changed blocks of a table held in memory, a run of
+   consecutive ones at a time */
+static void writeDirty(const uint8_t *buf, const uint8_t *dirty,
+                       uint64_t blocks, uint64_t len, uint64_t offset) {
+   uint64_t block = 0, end;
+
+   while (block < blocks) {
+      if (!dirty[block]) {
+         block++;
+         continue;
+      }
+      for (end = block; end < blocks && dirty[end]; end++) {
+      }
+      uint64_t from = block * fs.blockSize;
+      uint64_t to = end * fs.blockSize < len ? end * fs.blockSize : len;
+      writeImage(buf + from, to - from, offset + from);
+      metaBlocks += end - block;
+      block = end;
+   }
+}
+
+/* Waits for everything written so far to reach the disk, or exits */
+static void syncImage(void) {
+   if (fsync(imageFd) < 0) {
+      fprintf(stderr, "error writing image (%d)\n", errno);
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Writes back everything changed in memory: new directory zones and
+ * zone tables first, then the bitmaps, then the inode table, and last
+ * the zones existing directories already had, which hold the entries
+ * naming what was added. An interrupted write can leave inodes and zones
+ * marked in use that nothing refers to, and a directory's size or link
+ * count ahead of its entries, but never an inode pointing at free zones
+ * or an entry naming an inode that wasn't written. Each stage is synced
+ * before the next, so the disk can't reorder them.
+ */
+void finishPut(void) {
+   uint64_t offset = 2 * (uint64_t)fs.blockSize;
+   int i;
+
+   for (i = 0; i < numDirs; i++) {
+      writeDir(dirs[i]);
+   }
+   writeDirty(inodeMap, inodeMapDirty, fs.sb.i_blocks,
+              (uint64_t)fs.sb.i_blocks * fs.blockSize, offset);
+   offset += (uint64_t)fs.sb.i_blocks * fs.blockSize;
+   writeDirty(zoneMap, zoneMapDirty, fs.sb.z_blocks,
+              (uint64_t)fs.sb.z_blocks * fs.blockSize, offset);
+   syncImage();
+   writeDirty((uint8_t *)fs.iTable, inodeTableDirty,
+              fs.numInodes / fs.inodesPerBlock + 1,
+              (uint64_t)fs.numInodes * sizeof(struct inode),
+              fs.inodeTableOffset);
+   syncImage();
+   for (i = 0; i < numDirs; i++) {
+      writeOldZones(dirs[i]);
+      free(dirs[i]->data);
+      free(dirs[i]);
+   }
+   free(dirs);
+   syncImage();
+   if (close(imageFd) < 0) {
+      fprintf(stderr, "error writing image (%d)\n", errno);
+      exit(EXIT_FAILURE);
+   }
+   free(inodeMap);
+   free(zoneMap);
+   free(inodeMapDirty);
+   free(zoneMapDirty);
+   free(inodeTableDirty);
+}
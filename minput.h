@@ -0,0 +1,45 @@
+#include "minCommon.h"
+#include <dirent.h>
+
+#define PUT_USAGE \
+"usage: %s [ -v ] [ -p num [ -s num ] ] imagefile source [ dest ]\n\
+Copies the host file or directory source (and everything under it) into\n\
+the image: into dest if that is a directory, as dest otherwise\n\
+(default: /).\n\
+Options:\n\
+\t-p\t part    --- select partition for filesystem (default: none)\n\
+\t-s\t sub     --- select subpartition for filesystem (default: none)\n\
+\t-v\t verbose --- report what was written on stderr\n"
+
+/* A file's zone pointers while they are filled in. Tables the file
+ * already had are read the first time they're needed; all of them are
+ * written back once, at the end.
+ */
+struct zoneTables {
+   uint32_t inodeNum;
+   uint32_t *indirect;           /* the single-indirect table */
+   uint32_t *doubleIndirect;     /* the double-indirect table */
+   uint32_t **second;            /* the second-level tables, as needed */
+   int dirtyIndirect;
+   int dirtyDouble;
+   int *dirtySecond;             /* one flag per second-level table */
+};
+
+/* a directory being added to, held whole in memory until written back */
+struct putDir {
+   uint32_t inodeNum;
+   uint8_t *data;                /* its entries, zero past the end */
+   uint64_t max;                 /* bytes data has room for */
+   uint64_t dirtyFrom;           /* the bytes changed, if dirtyTo isn't 0 */
+   uint64_t dirtyTo;
+   int created;                  /* made by minput, so no names to check */
+   uint64_t zonesHad;            /* zones it already had before growing */
+   struct zoneTables tables;
+};
+
+void openTarget(const char *imagefile, int partition, int subpartition);
+uint32_t allocInode(void);
+uint32_t allocZones(uint32_t want, uint32_t hint, uint32_t *got);
+struct putDir *getDir(uint32_t inodeNum);
+uint32_t putFile(const char *hostPath, struct putDir *dir, const char *name);
+void finishPut(void);
@@ -0,0 +1,278 @@
+#include "minserve.h"
+
+/* what ends each request: newline, or NUL with -0 */
+static int delim = '\n';
+
+/* the socket to remove when the daemon is stopped */
+static char *socketName = NULL;
+
+/* the filesystem every request is served from */
+static struct minfs fs;
+
+int main(int argc, char *const argv[])
+{
+   /* This code allocates space for the path names
+      and sets all integer options to default values */
+   struct minOptions options;
+   options.verbose = 0;
+   options.eager = 0;
+   options.recursive = 0;
+   options.threads = 0;
+   options.nulDelim = 0;
+   options.socketPath = NULL;
+   options.destDir = NULL;
+   options.budget = DEFAULT_BUDGET;
+   options.rangeOffset = 0;
+   options.rangeLength = RANGE_TO_END;
+   options.stats = STATS_NONE;
+   options.indexFile = NULL;
+   options.format = FORMAT_TEXT;
+   options.readahead = DEFAULT_READAHEAD;
+   options.checksum = 0;
+   options.partition = INVALID_OPTION;
+   options.subpartition = INVALID_OPTION;
+   options.imagefile = malloc(NAME_MAX);
+   if (!options.imagefile) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+   options.path = malloc(PATH_MAX);
+   if (!options.path) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+   options.fullPath = malloc(PATH_MAX);
+   if (!options.fullPath) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+
+   parseArgs(argc, argv, &options);
+   if (options.partition == ALL_PARTITIONS) {
+      fprintf(stderr, "minserve serves one filesystem; -p all won't do\n");
+      exit(EXIT_FAILURE);
+   }
+   if (options.nulDelim) {
+      delim = '\0';
+   }
+
+   /* the image, inode cache and directory cache
+      stay open for every request */
+   if (minfsOpen(&fs, options.imagefile, options.partition,
+                 options.subpartition, options.eager)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+
+   fs.readahead = options.readahead;
+
+   /* an index that can't be used is only a slower start */
+   if (options.indexFile && minfsUseIndex(&fs, options.indexFile)) {
+      fprintf(stderr, "%s", minfsError());
+   }
+
+   if (options.socketPath) {
+      runDaemon(options.socketPath);
+   }
+   else {
+      serveStream(stdin, STDOUT_FILENO);
+   }
+
+   if (options.stats) {
+      printIoStats(&fs, stderr, options.stats);
+   }
+   minfsClose(&fs);
+
+   exit(EXIT_SUCCESS);
+}
+
+/* Reads requests from in until it runs out, answering each one on outFd.
+   Returns 0, or -1 if outFd stops taking responses. */
+int serveStream(FILE *in, int outFd) {
+   char *request = NULL;
+   size_t max = 0;
+   ssize_t len;
+   int ret = 0;
+
+   while (!ret && (len = getdelim(&request, &max, delim, in)) > 0) {
+      if (request[len - 1] == delim) {
+         request[--len] = '\0';
+      }
+      if (len) {
+         ret = serveRequest(request, outFd);
+      }
+   }
+   free(request);
+   return ret;
+}
+
+/* Sends a response header: the status, then the number of payload
+   bytes that follow it */
+int sendHeader(int fd, const char *status, uint64_t len) {
+   char header[64];
+   int headerLen = snprintf(header, sizeof(header), "%s %llu\n",
+                            status, (unsigned long long)len);
+   return writeAll(fd, header, headerLen);
+}
+
+/* Sends a whole response, header and payload */
+int sendResponse(int fd, const char *status, const char *payload,
+                 uint64_t len) {
+   if (sendHeader(fd, status, len)) {
+      return -1;
+   }
+   return writeAll(fd, payload, len);
+}
+
+/* Sends an error response carrying a printf-style message */
+int sendError(int fd, const char *format, const char *arg) {
+   char message[PATH_MAX + 64];
+   int len = snprintf(message, sizeof(message), format, arg);
+   if (len >= sizeof(message)) {
+      len = sizeof(message) - 1;
+   }
+   return sendResponse(fd, "error", message, len);
+}
+
+/* Answers one request, "ls path" or "get path". ls answers with what
+   minls would print, get with the contents of a regular file.
+   Returns 0, or -1 if outFd stops taking responses. */
+int serveRequest(char *request, int outFd) {
+   char path[PATH_MAX] = "/";
+   struct inode in;
+   int64_t inodeNum;
+
+   char *name = strchr(request, ' ');
+   if (!name) {
+      return sendError(outFd, "bad request: %s\n", request);
+   }
+   *name++ = '\0';
+   if (strcmp(request, "ls") && strcmp(request, "get")) {
+      return sendError(outFd, "unknown command: %s\n", request);
+   }
+
+   /* relative paths become absolute from / */
+   if (strlen(name) + 2 > PATH_MAX) {
+      return sendError(outFd, "%s: Path too long.\n", name);
+   }
+   strcat(path, name + (name[0] == '/'));
+
+   uint64_t start = phaseStart();
+   inodeNum = lookupPath(&fs, path);
+   if (!inodeNum) {
+      return sendError(outFd, "%s: File not found.\n", path);
+   }
+   if (inodeNum < 0 || copyInode(&fs, inodeNum, &in)) {
+      return sendError(outFd, "%s", minfsError());
+   }
+   phaseEnd(&fs, PHASE_TRAVERSE, start);
+
+   start = phaseStart();
+   if (!strcmp(request, "get")) {
+      int ret;
+      if (!MIN_ISREG(in.mode)) {
+         return sendError(outFd, "%s: Not a regular file\n", path);
+      }
+      if (sendHeader(outFd, "ok", in.size)) {
+         return -1;
+      }
+      ret = streamFile(&fs, in, outFd);
+      phaseEnd(&fs, PHASE_COPY, start);
+      return ret;
+   }
+
+   /* ls: format the listing, then send it whole */
+   struct outBuf out;
+   int ret;
+   outInit(&out, -1, FORMAT_TEXT);
+   if (MIN_ISDIR(in.mode)) {
+      formatDirHeader(&out, path);
+      if (formatDirEntries(&fs, &out, in, path)) {
+         outFree(&out);
+         return sendError(outFd, "%s", minfsError());
+      }
+   }
+   else if (MIN_ISREG(in.mode)) {
+      formatEntry(&out, &in, inodeNum, NULL, name, PATH_MAX);
+   }
+   if (outFlush(&out)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   ret = sendResponse(outFd, "ok", out.data, out.len);
+   outFree(&out);
+   phaseEnd(&fs, PHASE_OUTPUT, start);
+   return ret;
+}
+
+/* Serves one daemon client until it hangs up */
+void *serveClient(void *arg) {
+   int fd = (intptr_t)arg;
+   FILE *in = fdopen(fd, "r");
+   if (!in) {
+      close(fd);
+      return NULL;
+   }
+   serveStream(in, fd);
+   fclose(in);
+   return NULL;
+}
+
+/* Removes the socket when the daemon is told to stop */
+void stopDaemon(int sig) {
+   unlink(socketName);
+   _exit(EXIT_SUCCESS);
+}
+
+/* Listens on a Unix socket, serving each client on its own thread.
+   All clients share the open image and its caches. */
+void runDaemon(char *socketPath) {
+   struct sockaddr_un addr;
+   struct stat st;
+   int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   if (sock < 0) {
+      fprintf(stderr, "Failed to create socket (errno: %d)\n", errno);
+      exit(EXIT_FAILURE);
+   }
+   if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path %s is too long\n", socketPath);
+      exit(EXIT_FAILURE);
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, socketPath);
+
+   /* clear out a socket left behind by an earlier daemon */
+   if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(socketPath);
+   }
+   if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(sock, SOMAXCONN) < 0) {
+      fprintf(stderr, "Failed to listen on %s (errno: %d)\n",
+                      socketPath,
+                      errno);
+      exit(EXIT_FAILURE);
+   }
+
+   /* a client hanging up mid-response must not kill the daemon */
+   socketName = socketPath;
+   signal(SIGPIPE, SIG_IGN);
+   signal(SIGINT, stopDaemon);
+   signal(SIGTERM, stopDaemon);
+
+   for (;;) {
+      pthread_t thread;
+      int client = accept(sock, NULL, NULL);
+      if (client < 0) {
+         if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+         }
+         fprintf(stderr, "Failed to accept client (errno: %d)\n", errno);
+         exit(EXIT_FAILURE);
+      }
+      if (pthread_create(&thread, NULL, serveClient,
+                         (void *)(intptr_t)client)) {
+         close(client);
+         continue;
+      }
+      pthread_detach(thread);
+   }
+}
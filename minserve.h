@@ -0,0 +1,11 @@
+#include "minCommon.h"
+
+int serveStream(FILE *in, int outFd);
+int serveRequest(char *request, int outFd);
+int sendHeader(int fd, const char *status, uint64_t len);
+int sendResponse(int fd, const char *status, const char *payload,
+                 uint64_t len);
+int sendError(int fd, const char *format, const char *arg);
+void *serveClient(void *arg);
+void stopDaemon(int sig);
+void runDaemon(char *socketPath);
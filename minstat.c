@@ -0,0 +1,243 @@
+#include "minstat.h"
+
+int main(int argc, char *const argv[])
+{
+   /* This code allocates space for the path names
+      and sets all integer options to default values */
+   struct minOptions options;
+   options.verbose = 0;
+   options.eager = 0;
+   options.recursive = 0;
+   options.threads = 0;
+   options.nulDelim = 0;
+   options.socketPath = NULL;
+   options.destDir = NULL;
+   options.budget = DEFAULT_BUDGET;
+   options.rangeOffset = 0;
+   options.rangeLength = RANGE_TO_END;
+   options.stats = STATS_NONE;
+   options.indexFile = NULL;
+   options.format = FORMAT_TEXT;
+   options.readahead = DEFAULT_READAHEAD;
+   options.checksum = 0;
+   options.partition = INVALID_OPTION;
+   options.subpartition = INVALID_OPTION;
+   options.imagefile = malloc(NAME_MAX);
+   if (!options.imagefile) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+   options.path = malloc(PATH_MAX);
+   if (!options.path) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+   options.fullPath = malloc(PATH_MAX);
+   if (!options.fullPath) {
+      fprintf(stderr, "Malloc is failing\n");
+   }
+
+   parseArgs(argc, argv, &options);
+
+   /* with -p all, the rest runs once per filesystem in the image */
+   struct minPart *part = eachPartition(&options, FORMAT_TEXT);
+
+   /* every inode gets looked at, so read the whole table at once */
+   struct minfs fs;
+   if (part ? minfsOpenPart(&fs, options.imagefile, part, 1)
+            : minfsOpen(&fs, options.imagefile, options.partition,
+                        options.subpartition, 1)) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+
+   /* an index that can't be used is only a slower start */
+   if (options.indexFile && minfsUseIndex(&fs, options.indexFile)) {
+      fprintf(stderr, "%s", minfsError());
+   }
+
+   /* the bitmaps say what is in use; the inode table says what it is */
+   uint64_t inodeBits;
+   uint8_t *inodeMap = getBitmap(&fs, INODE_MAP, &inodeBits);
+   if (!inodeMap) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   uint64_t start = phaseStart();
+   uint64_t inodesUsed = countBits(inodeMap, 1, inodeBits);
+   struct zoneCounts zones;
+   scanZoneMap(&fs, &zones);
+   phaseEnd(&fs, PHASE_TRAVERSE, start);
+
+   struct inodeCounts inodes;
+   scanInodes(&fs, &inodes);
+
+   start = phaseStart();
+   printStats(&fs, options.imagefile, inodesUsed, inodeBits - 1,
+              &zones, &inodes);
+   fflush(stdout);
+   phaseEnd(&fs, PHASE_OUTPUT, start);
+
+   if (options.stats) {
+      printIoStats(&fs, stderr, options.stats);
+   }
+   minfsClose(&fs);
+
+   exit(EXIT_SUCCESS);
+}
+
+/* Returns the size class of n: 0 for 0, otherwise k + 1 where
+   2^k <= n < 2^(k+1) */
+int sizeClass(uint64_t n) {
+   int class = n ? 64 - __builtin_clzll(n) : 0;
+   return class < SIZE_CLASSES ? class : SIZE_CLASSES - 1;
+}
+
+/* Writes a byte count as a short figure with a K, M or G suffix */
+void formatSize(char *buf, size_t len, uint64_t bytes) {
+   const char *suffix = " KMGT";
+   while (bytes >= 1024 && bytes % 1024 == 0 && suffix[1]) {
+      bytes /= 1024;
+      suffix++;
+   }
+   snprintf(buf, len, "%llu%.*s", (unsigned long long)bytes,
+            *suffix != ' ', suffix);
+}
+
+/* Counts used and free zones from the zone bitmap, and measures the runs
+   of free zones between the used ones */
+void scanZoneMap(struct minfs *fs, struct zoneCounts *zones) {
+   uint64_t bits, pos = 1, len;
+   uint8_t *zoneMap = getBitmap(fs, ZONE_MAP, &bits);
+
+   memset(zones, 0, sizeof(struct zoneCounts));
+   if (!zoneMap) {
+      fprintf(stderr, "%s", minfsError());
+      exit(EXIT_FAILURE);
+   }
+   zones->total = bits - 1;
+   zones->used = countBits(zoneMap, 1, bits);
+
+   while ((pos = findRun(zoneMap, pos, bits, 0, &len)) < bits) {
+      zones->freeExtents++;
+      zones->freeClasses[sizeClass(len)]++;
+      if (len > zones->largestFree) {
+         zones->largestFree = len;
+      }
+      pos += len;
+   }
+}
+
+/* Walks the inode table from start to end, counting files by type and
+   regular files by size, and how many pieces their data is in */
+void scanInodes(struct minfs *fs, struct inodeCounts *inodes) {
+   uint32_t inodeNum;
+
+   memset(inodes, 0, sizeof(struct inodeCounts));
+   for (inodeNum = 1; inodeNum <= fs->numInodes; inodeNum++) {
+      struct inode *in = fs->iTable + inodeNum - 1;
+      struct extent *extents;
+      int numExtents, i, pieces = 0;
+
+      if (!in->mode) {
+         continue;
+      }
+      inodes->used++;
+      if (MIN_ISDIR(in->mode)) {
+         inodes->directories++;
+         continue;
+      }
+      if (!MIN_ISREG(in->mode)) {
+         inodes->other++;
+         continue;
+      }
+      inodes->regular++;
+      inodes->bytes += in->size;
+      inodes->sizeClasses[sizeClass(in->size)]++;
+
+      /* holes don't count as pieces */
+      uint64_t start = phaseStart();
+      numExtents = mapExtents(fs, *in, &extents);
+      phaseEnd(fs, PHASE_TRAVERSE, start);
+      if (numExtents < 0) {
+         fprintf(stderr, "inode %u: %s", inodeNum, minfsError());
+         continue;
+      }
+      for (i = 0; i < numExtents; i++) {
+         pieces += extents[i].zone != 0;
+      }
+      free(extents);
+      inodes->extents += pieces;
+      inodes->fragmented += pieces > 1;
+   }
+}
+
+/* Prints one histogram, a line for each non-empty class. Bounds in
+   bytes get a K, M or G suffix. */
+static void printClasses(uint64_t *classes, int inBytes, const char *what) {
+   char low[32], high[32];
+   int class;
+
+   for (class = 0; class < SIZE_CLASSES; class++) {
+      if (!classes[class]) {
+         continue;
+      }
+      if (!class) {
+         printf("  %19s %10llu %s\n", "0",
+                (unsigned long long)classes[class], what);
+         continue;
+      }
+      if (inBytes) {
+         formatSize(low, sizeof(low), 1ull << (class - 1));
+         formatSize(high, sizeof(high), 1ull << class);
+      }
+      else {
+         snprintf(low, sizeof(low), "%llu", 1ull << (class - 1));
+         snprintf(high, sizeof(high), "%llu", 1ull << class);
+      }
+      printf("  %8s .. %-7s %10llu %s\n", low, high,
+             (unsigned long long)classes[class], what);
+   }
+}
+
+/* Prints the whole report on stdout */
+void printStats(struct minfs *fs, const char *imagefile,
+                uint64_t inodesUsed, uint64_t inodesTotal,
+                struct zoneCounts *zones, struct inodeCounts *inodes) {
+   uint64_t freeZones = zones->total - zones->used;
+   char size[32];
+
+   formatSize(size, sizeof(size), fs->zoneSize);
+   printf("%s:\n", imagefile);
+   printf("inodes: %llu used, %llu free of %llu (%.1f%% used)\n",
+          (unsigned long long)inodesUsed,
+          (unsigned long long)(inodesTotal - inodesUsed),
+          (unsigned long long)inodesTotal,
+          inodesTotal ? 100.0 * inodesUsed / inodesTotal : 0.0);
+   printf("zones: %llu used, %llu free of %llu (%.1f%% used), %s each\n",
+          (unsigned long long)zones->used,
+          (unsigned long long)freeZones,
+          (unsigned long long)zones->total,
+          zones->total ? 100.0 * zones->used / zones->total : 0.0, size);
+   printf("free space: %llu extents, largest %llu zones, "
+          "%.1f%% fragmented\n",
+          (unsigned long long)zones->freeExtents,
+          (unsigned long long)zones->largestFree,
+          freeZones ? 100.0 * (freeZones - zones->largestFree) / freeZones
+                    : 0.0);
+   printf("files: %llu regular, %llu directories, %llu other "
+          "(%llu inodes in the table)\n",
+          (unsigned long long)inodes->regular,
+          (unsigned long long)inodes->directories,
+          (unsigned long long)inodes->other,
+          (unsigned long long)inodes->used);
+   printf("file data: %llu bytes in %llu extents, %llu files fragmented "
+          "(%.2f extents per file)\n",
+          (unsigned long long)inodes->bytes,
+          (unsigned long long)inodes->extents,
+          (unsigned long long)inodes->fragmented,
+          inodes->regular ? (double)inodes->extents / inodes->regular : 0.0);
+
+   printf("free extents by length in zones:\n");
+   printClasses(zones->freeClasses, 0, "extents");
+   printf("regular files by size in bytes:\n");
+   printClasses(inodes->sizeClasses, 1, "files");
+}
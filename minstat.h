@@ -0,0 +1,32 @@
+#include "minCommon.h"
+
+#define SIZE_CLASSES 34          /* 0, then [2^k, 2^(k+1)) for k < 33 */
+
+/* what a scan of the inode table found */
+struct inodeCounts {
+   uint64_t used;                /* inodes with a mode */
+   uint64_t regular;
+   uint64_t directories;
+   uint64_t other;
+   uint64_t bytes;               /* total size of the regular files */
+   uint64_t extents;             /* data extents across regular files */
+   uint64_t fragmented;          /* regular files in more than one extent */
+   uint64_t sizeClasses[SIZE_CLASSES];
+};
+
+/* what a scan of the zone bitmap found */
+struct zoneCounts {
+   uint64_t total;
+   uint64_t used;
+   uint64_t freeExtents;
+   uint64_t largestFree;
+   uint64_t freeClasses[SIZE_CLASSES];   /* free extents by length */
+};
+
+int sizeClass(uint64_t n);
+void formatSize(char *buf, size_t len, uint64_t bytes);
+void scanZoneMap(struct minfs *fs, struct zoneCounts *zones);
+void scanInodes(struct minfs *fs, struct inodeCounts *inodes);
+void printStats(struct minfs *fs, const char *imagefile,
+                uint64_t inodesUsed, uint64_t inodesTotal,
+                struct zoneCounts *zones, struct inodeCounts *inodes);
@@ -0,0 +1,522 @@
+#include "mkminix.h"
+
+#define USAGE_MSG \
+"usage: %s [ -b bytes ] [ -z bytes ] [ -f num ] [ -d num ] [ -n num ] \
+[ -m bytes ] [ -L num ] [ -H percent ] [ -x seed ] imagefile\n\
+Options:\n\
+\t-b\t block   --- block size, 1K to 32K (default: 4K)\n\
+\t-z\t zone    --- zone size, the block size times a power of two\n\
+\t\t\t       (default: the block size)\n\
+\t-f\t fanout  --- subdirectories in each directory (default: 4)\n\
+\t-d\t depth   --- levels of subdirectories under / (default: 3)\n\
+\t-n\t files   --- regular files in each directory (default: 16)\n\
+\t-m\t bytes   --- largest ordinary file; sizes are spread evenly over\n\
+\t\t\t       each power of two up to it (default: 1M)\n\
+\t-L\t large   --- files big enough to need double-indirect zones\n\
+\t\t\t       (default: 2)\n\
+\t-H\t holes   --- percent of file zones left as holes (default: 0)\n\
+\t-x\t seed    --- seed for sizes, holes and contents (default: 1)\n"
+
+/* the tree being generated, one node per inode (node i is inode i + 1) */
+static struct genNode *nodes = NULL;
+static int numNodes = 0, maxNodes = 0;
+
+/* the image being written, and where its pieces go */
+static int imageFd = -1;
+static uint32_t blockSize = 4096;
+static uint32_t zoneSize = 0;
+static uint32_t nextZone;        /* next free zone, handed out in order */
+static uint8_t *inodeMap, *zoneMap;
+static struct inode *inodeTable;
+static struct superblock sb;
+
+/* generator settings */
+static int fanout = 4, depth = 3, filesPerDir = 16, largeFiles = 2;
+static int holePercent = 0;
+static uint64_t maxSize = 1 << 20;
+static uint64_t seed = 1;
+
+int main(int argc, char *const argv[])
+{
+   int opt;
+
+   while ((opt = getopt(argc, argv, "b:z:f:d:n:m:L:H:x:")) != -1) {
+      switch (opt) {
+         case 'b':
+            blockSize = parseCount(argv[0], optarg);
+         break;
+         case 'z':
+            zoneSize = parseCount(argv[0], optarg);
+         break;
+         case 'f':
+            fanout = parseCount(argv[0], optarg);
+         break;
+         case 'd':
+            depth = parseCount(argv[0], optarg);
+         break;
+         case 'n':
+            filesPerDir = parseCount(argv[0], optarg);
+         break;
+         case 'm':
+            maxSize = parseCount(argv[0], optarg);
+         break;
+         case 'L':
+            largeFiles = parseCount(argv[0], optarg);
+         break;
+         case 'H':
+            holePercent = parseCount(argv[0], optarg);
+         break;
+         case 'x':
+            seed = parseCount(argv[0], optarg);
+         break;
+         default:
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+   if (optind != argc - 1) {
+      fprintf(stderr, USAGE_MSG, argv[0]);
+      exit(EXIT_FAILURE);
+   }
+
+   if (!zoneSize) {
+      zoneSize = blockSize;
+   }
+   if (blockSize < 1024 || blockSize > 32768 ||
+       (blockSize & (blockSize - 1)) || zoneSize < blockSize ||
+       (zoneSize & (zoneSize - 1))) {
+      fprintf(stderr, "Bad block size %u or zone size %u\n",
+              blockSize, zoneSize);
+      exit(EXIT_FAILURE);
+   }
+   if (holePercent > 100 || maxSize > UINT32_MAX) {
+      fprintf(stderr, USAGE_MSG, argv[0]);
+      exit(EXIT_FAILURE);
+   }
+
+   planTree();
+   layoutImage(argv[optind]);
+   writeTree();
+   finishImage();
+
+   printf("%s: %d inodes, %u zones of %u bytes, %u in use\n",
+          argv[optind], numNodes, sb.zones, zoneSize, nextZone);
+   exit(EXIT_SUCCESS);
+}
+
+/* Parses a count with an optional K, M or G suffix, or exits */
+uint64_t parseCount(const char *prog, const char *arg) {
+   char *end;
+   uint64_t count = strtoull(arg, &end, 10);
+   switch (*end) {
+      case 'G': case 'g':
+         count <<= 10;
+      /* fall through */
+      case 'M': case 'm':
+         count <<= 10;
+      /* fall through */
+      case 'K': case 'k':
+         count <<= 10;
+         end++;
+      break;
+   }
+   if (*end || end == arg || *arg == '-') {
+      fprintf(stderr, "Bad number %s.\n", arg);
+      fprintf(stderr, USAGE_MSG, prog);
+      exit(EXIT_FAILURE);
+   }
+   return count;
+}
+
+/* xorshift64*: the same seed always builds the same image */
+static uint64_t nextRandom(uint64_t *state) {
+   *state ^= *state >> 12;
+   *state ^= *state << 25;
+   *state ^= *state >> 27;
+   return *state * 0x2545F4914F6CDD1Dull;
+}
+
+/* Adds a node to the tree under parent (-1 for the root) */
+static int addNode(int parent, const char *name, int isDir, uint64_t size) {
+   struct genNode *node;
+
+   if (numNodes == maxNodes) {
+      maxNodes = maxNodes ? maxNodes * 2 : 256;
+      nodes = realloc(nodes, maxNodes * sizeof(struct genNode));
+      if (!nodes) {
+         fprintf(stderr, "Malloc is failing\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   node = nodes + numNodes;
+   memset(node, 0, sizeof(struct genNode));
+   node->parent = parent;
+   node->isDir = isDir;
+   node->size = size;
+   strncpy(node->name, name, DIRSIZ);
+
+   if (parent >= 0) {
+      struct genNode *dir = nodes + parent;
+      if (dir->numChildren == dir->maxChildren) {
+         dir->maxChildren = dir->maxChildren ? dir->maxChildren * 2 : 8;
+         dir->children = realloc(dir->children,
+                                 dir->maxChildren * sizeof(int));
+         if (!dir->children) {
+            fprintf(stderr, "Malloc is failing\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      dir->children[dir->numChildren++] = numNodes;
+      dir->size += sizeof(struct fileEntry);
+   }
+   return numNodes++;
+}
+
+/* Picks an ordinary file size: a power of two up to maxSize chosen
+   evenly, then a size evenly within it, so small and large files
+   are both common */
+static uint64_t pickSize(uint64_t *state) {
+   int bits = 0, pick;
+   uint64_t low;
+
+   while (bits < 63 && (2ull << bits) <= maxSize) {
+      bits++;
+   }
+   pick = nextRandom(state) % (bits + 1);
+   low = pick ? 1ull << pick : 0;
+   return low + nextRandom(state) % ((2ull << pick) - low);
+}
+
+/* Adds the files and subdirectories of one directory, recursively */
+static void planDir(int dir, int level, uint64_t *state) {
+   char name[DIRSIZ + 1];
+   int i;
+
+   for (i = 0; i < filesPerDir; i++) {
+      uint64_t size = pickSize(state);
+      snprintf(name, sizeof(name), "file%04d", i);
+      addNode(dir, name, 0, size < maxSize ? size : maxSize);
+   }
+   if (level >= depth) {
+      return;
+   }
+   for (i = 0; i < fanout; i++) {
+      snprintf(name, sizeof(name), "dir%03d", i);
+      planDir(addNode(dir, name, 1, 2 * sizeof(struct fileEntry)),
+              level + 1, state);
+   }
+}
+
+/* Decides the whole tree: every directory, every file and its size */
+void planTree(void) {
+   uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+   uint64_t perZone = zoneSize / sizeof(uint32_t);
+   uint64_t doubleStart = (DIRECT_ZONES + perZone) * zoneSize;
+   char name[DIRSIZ + 1];
+   int root, i;
+
+   root = addNode(-1, "", 1, 2 * sizeof(struct fileEntry));
+   planDir(root, 0, &state);
+
+   /* the large files sit in the root, a few zones into their
+      double-indirect range */
+   for (i = 0; i < largeFiles; i++) {
+      uint64_t size = doubleStart +
+                      (nextRandom(&state) % (4 * perZone) + 1) * zoneSize;
+      if (size > UINT32_MAX) {
+         fprintf(stderr, "Large files don't fit with %u-byte zones\n",
+                 zoneSize);
+         exit(EXIT_FAILURE);
+      }
+      snprintf(name, sizeof(name), "large%02d", i);
+      addNode(root, name, 0, size);
+   }
+}
+
+/* Zones a file of the given size takes at most: its data zones and
+   the indirect tables pointing at them */
+static uint64_t zonesFor(uint64_t size) {
+   uint64_t perZone = zoneSize / sizeof(uint32_t);
+   uint64_t data = (size + zoneSize - 1) / zoneSize;
+   uint64_t tables = 0;
+
+   if (data > DIRECT_ZONES) {
+      tables++;
+   }
+   if (data > DIRECT_ZONES + perZone) {
+      tables += 1 + (data - DIRECT_ZONES - perZone + perZone - 1) / perZone;
+   }
+   return data + tables;
+}
+
+/* Sizes the bitmaps, inode table and zones, creates the image file at
+   its full (sparse) size, and sets up the superblock */
+void layoutImage(const char *imagefile) {
+   uint64_t zonesNeeded = 0, bitsPerBlock = blockSize * 8;
+   uint64_t inodesPerBlock = blockSize / sizeof(struct inode);
+   uint64_t ninodes, itableBlocks, imapBlocks, zmapBlocks = 1, zones;
+   uint64_t metaBlocks, firstData = 0;
+   int i, pass;
+
+   for (i = 0; i < numNodes; i++) {
+      zonesNeeded += zonesFor(nodes[i].size);
+   }
+
+   /* room to grow: a quarter more inodes and an eighth more zones */
+   ninodes = numNodes + numNodes / 4 + 16;
+   ninodes = (ninodes + inodesPerBlock - 1) / inodesPerBlock * inodesPerBlock;
+   itableBlocks = ninodes / inodesPerBlock;
+   imapBlocks = (ninodes + 1 + bitsPerBlock - 1) / bitsPerBlock;
+
+   /* the zone map's size and the first data zone depend on each other */
+   zones = 0;
+   for (pass = 0; pass < 3; pass++) {
+      metaBlocks = 2 + imapBlocks + zmapBlocks + itableBlocks;
+      firstData = (metaBlocks * blockSize + zoneSize - 1) / zoneSize;
+      zones = firstData + zonesNeeded + zonesNeeded / 8 + 64;
+      zmapBlocks = (zones - firstData + 1 + bitsPerBlock - 1) / bitsPerBlock;
+   }
+   if (zones > UINT32_MAX || ninodes > UINT32_MAX || firstData > UINT16_MAX ||
+       imapBlocks > INT16_MAX || zmapBlocks > INT16_MAX) {
+      fprintf(stderr, "Image too big\n");
+      exit(EXIT_FAILURE);
+   }
+
+   memset(&sb, 0, sizeof(sb));
+   sb.ninodes = ninodes;
+   sb.i_blocks = imapBlocks;
+   sb.z_blocks = zmapBlocks;
+   sb.firstdata = firstData;
+   for (sb.log_zone_size = 0; (blockSize << sb.log_zone_size) < zoneSize;
+        sb.log_zone_size++) {
+   }
+   sb.max_file = UINT32_MAX;
+   sb.zones = zones;
+   sb.magic = MIN_MAGIC;
+   sb.blocksize = blockSize;
+
+   inodeMap = calloc(imapBlocks, blockSize);
+   zoneMap = calloc(zmapBlocks, blockSize);
+   inodeTable = calloc(ninodes, sizeof(struct inode));
+   if (!inodeMap || !zoneMap || !inodeTable) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   /* bit 0 of each map is reserved */
+   inodeMap[0] |= 1;
+   zoneMap[0] |= 1;
+   nextZone = firstData;
+
+   imageFd = open(imagefile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (imageFd < 0) {
+      fprintf(stderr, "Failed to create %s (errno: %d)\n", imagefile, errno);
+      exit(EXIT_FAILURE);
+   }
+   if (ftruncate(imageFd, (off_t)zones * zoneSize) < 0) {
+      fprintf(stderr, "Failed to size %s (errno: %d)\n", imagefile, errno);
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Writes len bytes at offset in the image, or exits */
+static void writeImage(const void *buf, uint64_t len, uint64_t offset) {
+   const char *next = buf;
+   while (len) {
+      ssize_t put = pwrite(imageFd, next, len, offset);
+      if (put < 0 && errno == EINTR) {
+         continue;
+      }
+      if (put <= 0) {
+         fprintf(stderr, "error writing image (%d)\n", errno);
+         exit(EXIT_FAILURE);
+      }
+      next += put;
+      len -= put;
+      offset += put;
+   }
+}
+
+/* Hands out the next free zone, marking it in the zone map */
+static uint32_t allocZone(void) {
+   uint32_t bit;
+   if (nextZone >= sb.zones) {
+      fprintf(stderr, "Out of zones\n");
+      exit(EXIT_FAILURE);
+   }
+   bit = nextZone - sb.firstdata + 1;
+   zoneMap[bit / 8] |= 1 << (bit % 8);
+   return nextZone++;
+}
+
+/* Fills one zone of a file with bytes that depend only on the seed,
+   the inode and where in the file they are */
+static void fillZone(uint8_t *buf, uint32_t inodeNum, uint64_t index) {
+   uint64_t state = (seed << 32 ^ (uint64_t)inodeNum << 20 ^ index) | 1;
+   uint32_t i;
+   for (i = 0; i < zoneSize; i += sizeof(uint64_t)) {
+      uint64_t word = nextRandom(&state);
+      memcpy(buf + i, &word, sizeof(word));
+   }
+}
+
+/* Where a file's zone pointers are being filled in. Indirect tables are
+   allocated when the first zone they cover is, and written out once
+   the file is done, so a run of holes leaves no table behind at all. */
+struct zoneTables {
+   struct inode *in;
+   uint32_t *indirect;           /* the single-indirect table */
+   uint32_t *doubleIndirect;     /* the double-indirect table */
+   uint32_t *second;             /* the second-level table being filled */
+   int secondIdx;                /* which one it is, -1 for none */
+};
+
+/* Writes out the second-level table being filled, if any */
+static void flushSecond(struct zoneTables *tables) {
+   if (tables->secondIdx >= 0) {
+      writeImage(tables->second, zoneSize,
+                 (uint64_t)tables->doubleIndirect[tables->secondIdx] *
+                 zoneSize);
+      memset(tables->second, 0, zoneSize);
+      tables->secondIdx = -1;
+   }
+}
+
+/* Records that zone index of the file lives in zone, allocating the
+   indirect tables on the way to it as needed */
+static void setZone(struct zoneTables *tables, uint64_t index, uint32_t zone) {
+   uint64_t perZone = zoneSize / sizeof(uint32_t);
+
+   if (index < DIRECT_ZONES) {
+      tables->in->zone[index] = zone;
+      return;
+   }
+   index -= DIRECT_ZONES;
+   if (index < perZone) {
+      if (!tables->in->indirect) {
+         tables->in->indirect = allocZone();
+      }
+      tables->indirect[index] = zone;
+      return;
+   }
+   index -= perZone;
+   if (!tables->in->two_indirect) {
+      tables->in->two_indirect = allocZone();
+   }
+   if (tables->secondIdx != index / perZone) {
+      flushSecond(tables);
+      tables->secondIdx = index / perZone;
+      tables->doubleIndirect[tables->secondIdx] = allocZone();
+   }
+   tables->second[index % perZone] = zone;
+}
+
+/* Writes one file or directory: its data zones in order, holes and
+   all, then its indirect tables */
+static void writeNode(int nodeIdx, uint8_t *data, uint64_t *state) {
+   struct genNode *node = nodes + nodeIdx;
+   struct inode *in = inodeTable + nodeIdx;
+   struct zoneTables tables;
+   uint64_t numZones = (node->size + zoneSize - 1) / zoneSize, index;
+   uint32_t inodeNum = nodeIdx + 1;
+
+   in->mode = node->isDir ? 0040755 : 0100644;
+   in->links = 1;
+   in->size = node->size;
+   in->atime = in->mtime = in->ctime = GEN_TIME;
+   inodeMap[inodeNum / 8] |= 1 << (inodeNum % 8);
+
+   tables.in = in;
+   tables.indirect = calloc(1, zoneSize);
+   tables.doubleIndirect = calloc(1, zoneSize);
+   tables.second = calloc(1, zoneSize);
+   tables.secondIdx = -1;
+   if (!tables.indirect || !tables.doubleIndirect || !tables.second) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for (index = 0; index < numZones; index++) {
+      uint32_t zone;
+      if (node->isDir) {
+         /* entries are laid out in zone order, . and .. first */
+         struct fileEntry *entries = (struct fileEntry *)data;
+         int perZoneEntries = zoneSize / sizeof(struct fileEntry), i;
+         memset(data, 0, zoneSize);
+         for (i = 0; i < perZoneEntries; i++) {
+            uint64_t entry = index * perZoneEntries + i;
+            if (entry == 0) {
+               entries[i].inode = inodeNum;
+               strcpy(entries[i].name, ".");
+            }
+            else if (entry == 1) {
+               entries[i].inode = node->parent < 0 ? inodeNum :
+                                  node->parent + 1;
+               strcpy(entries[i].name, "..");
+            }
+            else if (entry - 2 < node->numChildren) {
+               int child = node->children[entry - 2];
+               entries[i].inode = child + 1;
+               memcpy(entries[i].name, nodes[child].name, DIRSIZ);
+               if (nodes[child].isDir) {
+                  in->links++;
+               }
+            }
+         }
+         in->links += index == 0;      /* for . */
+      }
+      else {
+         if (nextRandom(state) % 100 < holePercent) {
+            continue;                  /* a hole */
+         }
+         fillZone(data, inodeNum, index);
+      }
+      zone = allocZone();
+      writeImage(data, zoneSize, (uint64_t)zone * zoneSize);
+      setZone(&tables, index, zone);
+   }
+
+   flushSecond(&tables);
+   if (in->indirect) {
+      writeImage(tables.indirect, zoneSize, (uint64_t)in->indirect * zoneSize);
+   }
+   if (in->two_indirect) {
+      writeImage(tables.doubleIndirect, zoneSize,
+                 (uint64_t)in->two_indirect * zoneSize);
+   }
+   free(tables.indirect);
+   free(tables.doubleIndirect);
+   free(tables.second);
+}
+
+/* Writes every file and directory, in inode order */
+void writeTree(void) {
+   uint64_t state = seed * 0xD1B54A32D192ED03ull + 1;
+   uint8_t *data = malloc(zoneSize);
+   int i;
+
+   if (!data) {
+      fprintf(stderr, "Malloc is failing\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < numNodes; i++) {
+      writeNode(i, data, &state);
+   }
+   free(data);
+}
+
+/* Writes the superblock, bitmaps and inode table */
+void finishImage(void) {
+   uint64_t imapOffset = 2 * (uint64_t)blockSize;
+   uint64_t zmapOffset = imapOffset + (uint64_t)sb.i_blocks * blockSize;
+   uint64_t itableOffset = zmapOffset + (uint64_t)sb.z_blocks * blockSize;
+
+   writeImage(&sb, sizeof(sb), 1024);
+   writeImage(inodeMap, (uint64_t)sb.i_blocks * blockSize, imapOffset);
+   writeImage(zoneMap, (uint64_t)sb.z_blocks * blockSize, zmapOffset);
+   writeImage(inodeTable, (uint64_t)sb.ninodes * sizeof(struct inode),
+              itableOffset);
+   if (close(imageFd) < 0) {
+      fprintf(stderr, "error writing image (%d)\n", errno);
+      exit(EXIT_FAILURE);
+   }
+}
@@ -0,0 +1,20 @@
+#include "minCommon.h"
+
+#define GEN_TIME 1000000000      /* every generated inode's timestamps */
+
+/* a file or directory mkminix has planned, before it is written */
+struct genNode {
+   char name[DIRSIZ + 1];
+   int parent;                   /* node index, -1 for the root */
+   int isDir;
+   uint64_t size;
+   int *children;                /* node indices, in directory order */
+   int numChildren;
+   int maxChildren;
+};
+
+uint64_t parseCount(const char *prog, const char *arg);
+void planTree(void);
+void layoutImage(const char *imagefile);
+void writeTree(void);
+void finishImage(void);